@@ -0,0 +1,279 @@
+/*
+  FUSE: Filesystem in Userspace
+
+  This program can be distributed under the terms of the GNU GPLv2.
+  See the file COPYING.
+*/
+
+/** @file
+ *
+ * Header-only C++20 coroutine layer for the low-level API.
+ *
+ * Handlers are written as coroutines returning fuse_coro::task and
+ * installed with fuse_coro::op<>:
+ *
+ *     static fuse_coro::task my_read(fuse_req_t req, fuse_ino_t ino,
+ *                                    size_t size, off_t off,
+ *                                    fuse_file_info *fi) {
+ *         auto fh = fi->fh;
+ *         co_await sched.schedule();
+ *         ...
+ *         fuse_reply_buf(req, buf, len);
+ *     }
+ *
+ *     ops.read = fuse_coro::op<my_read>;
+ *
+ * A handler starts running on the session loop thread that received
+ * the request. When it suspends, that thread returns to the session
+ * loop and can receive the next request, so the number of requests in
+ * flight is not limited by the number of loop threads. Suspended
+ * handlers are resumed on the threads of a fuse_coro::scheduler.
+ *
+ * The scheduler is deliberately not driven by the session loop:
+ * fuse_session_loop() and fuse_session_loop_mt() block reading
+ * requests and provide no way to run other work in between, so the
+ * scheduler resumes handlers on a few threads of its own. Replies may
+ * be sent from any thread, so this needs no support from libfuse, and
+ * the loop threads only receive requests and start handlers.
+ *
+ * Every handler must eventually reply to its request exactly once, as
+ * with ordinary handlers. An exception escaping from a handler is
+ * answered with EIO, so handlers must not throw after replying.
+ *
+ * Arguments that point into the request (names, xattr values, write
+ * buffers, struct fuse_file_info) are only valid until the handler
+ * suspends for the first time. Copy what is needed before the first
+ * co_await.
+ *
+ * ## Source code ##
+ * \include fuse_coro.hpp
+ */
+
+#ifndef FUSE_CORO_HPP_
+#define FUSE_CORO_HPP_
+
+#include <fuse_lowlevel.h>
+#include <errno.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace fuse_coro {
+
+// Return type of coroutine handlers. The coroutine starts immediately
+// and its frame is freed when it finishes; nothing waits for it.
+struct task {
+    struct promise_type {
+        fuse_req_t req {nullptr};
+
+        promise_type() = default;
+
+        // Chosen for handlers whose first argument is the request
+        template <typename... Args>
+        promise_type(fuse_req_t r, Args&&...) : req(r) {}
+
+        task get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+
+        void unhandled_exception() noexcept {
+            if (req == nullptr)
+                std::terminate();
+            fuse_reply_err(req, EIO);
+        }
+    };
+};
+
+
+// Adapts a coroutine handler to the function pointer type expected in
+// struct fuse_lowlevel_ops
+template <auto F>
+struct op_adapter;
+
+template <typename... Args, task (*F)(Args...)>
+struct op_adapter<F> {
+    static void call(Args... args) {
+        F(args...);
+    }
+};
+
+template <auto F>
+constexpr auto op = &op_adapter<F>::call;
+
+
+// A small pool of threads that resumes suspended handlers, either as
+// soon as possible or after a delay. It runs next to the session loop
+// rather than inside it, see the comment at the top of this file.
+class scheduler {
+public:
+    using clock = std::chrono::steady_clock;
+
+    explicit scheduler(unsigned nthreads = 2) {
+        if (nthreads == 0)
+            nthreads = 1;
+        for (unsigned i = 0; i < nthreads; i++)
+            threads.emplace_back([this] { run(); });
+    }
+
+    // Waits until everything that is queued or sleeping has run
+    ~scheduler() {
+        {
+            std::lock_guard<std::mutex> g {m};
+            stop = true;
+        }
+        cond.notify_all();
+        for (auto& t : threads)
+            t.join();
+    }
+
+    scheduler(const scheduler&) = delete;
+    scheduler& operator=(const scheduler&) = delete;
+
+    // Queue a coroutine for resumption. May be called from any thread.
+    void post(std::coroutine_handle<> h) {
+        {
+            std::lock_guard<std::mutex> g {m};
+            ready.push_back(h);
+        }
+        cond.notify_one();
+    }
+
+    // co_await sched.schedule() continues on a scheduler thread
+    auto schedule() {
+        struct awaiter {
+            scheduler& s;
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> h) { s.post(h); }
+            void await_resume() const noexcept {}
+        };
+        return awaiter {*this};
+    }
+
+    // co_await sched.sleep_for(d) continues on a scheduler thread once
+    // d has passed, without blocking any thread in the meantime
+    template <typename Rep, typename Period>
+    auto sleep_for(std::chrono::duration<Rep, Period> d) {
+        struct awaiter {
+            scheduler& s;
+            clock::time_point when;
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> h) {
+                {
+                    std::lock_guard<std::mutex> g {s.m};
+                    s.timers.push({when, h});
+                }
+                s.cond.notify_one();
+            }
+            void await_resume() const noexcept {}
+        };
+        return awaiter {*this, clock::now() +
+            std::chrono::duration_cast<clock::duration>(d)};
+    }
+
+private:
+    struct timer {
+        clock::time_point when;
+        std::coroutine_handle<> h;
+        bool operator>(const timer& o) const { return when > o.when; }
+    };
+
+    void run() {
+        std::unique_lock<std::mutex> l {m};
+        while (true) {
+            auto now = clock::now();
+            while (!timers.empty() && timers.top().when <= now) {
+                ready.push_back(timers.top().h);
+                timers.pop();
+            }
+
+            if (!ready.empty()) {
+                auto h = ready.front();
+                ready.pop_front();
+                l.unlock();
+                h.resume();
+                l.lock();
+                continue;
+            }
+
+            if (timers.empty()) {
+                if (stop)
+                    break;
+                cond.wait(l);
+            } else {
+                cond.wait_until(l, timers.top().when);
+            }
+        }
+        // Let the other threads see the stop condition, too
+        cond.notify_all();
+    }
+
+    std::mutex m;
+    std::condition_variable cond;
+    std::deque<std::coroutine_handle<>> ready;
+    std::priority_queue<timer, std::vector<timer>, std::greater<timer>> timers;
+    std::vector<std::thread> threads;
+    bool stop {false};
+};
+
+
+// Result of an operation that is completed by someone else, e.g. an
+// I/O completion callback running on another thread:
+//
+//     fuse_coro::completion<ssize_t> c {sched};
+//     backend_submit(..., [&c](ssize_t res) { c.set(res); });
+//     auto res = co_await c;
+//
+// The awaiting handler is resumed on the scheduler. set() must be
+// called exactly once, and the object must not be destroyed before it
+// has been awaited.
+template <typename T>
+class completion {
+public:
+    explicit completion(scheduler& s) : sched(s) {}
+
+    completion(const completion&) = delete;
+    completion& operator=(const completion&) = delete;
+
+    void set(T v) {
+        value = std::move(v);
+        if (state.exchange(READY, std::memory_order_acq_rel) == WAITING)
+            sched.post(waiter);
+    }
+
+    bool await_ready() const noexcept {
+        return state.load(std::memory_order_acquire) == READY;
+    }
+
+    bool await_suspend(std::coroutine_handle<> h) noexcept {
+        waiter = h;
+        int expected = EMPTY;
+        // If set() has been called in the meantime, don't suspend
+        return state.compare_exchange_strong(expected, WAITING,
+                                             std::memory_order_acq_rel);
+    }
+
+    T await_resume() { return std::move(value); }
+
+private:
+    enum { EMPTY, WAITING, READY };
+
+    scheduler& sched;
+    std::atomic<int> state {EMPTY};
+    std::coroutine_handle<> waiter;
+    T value {};
+};
+
+} // namespace fuse_coro
+
+#endif /* FUSE_CORO_HPP_ */
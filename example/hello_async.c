@@ -0,0 +1,436 @@
+/*
+  FUSE: Filesystem in Userspace
+
+  This program can be distributed under the terms of the GNU GPLv2.
+  See the file COPYING.
+*/
+
+/** @file
+ *
+ * High-level API example using asynchronous operations
+ *
+ * The filesystem contains a read-only file "hello" and a writable
+ * file "scratch".  getattr, read, write and readdir are implemented
+ * with the *_async methods: they queue the work for a backend thread,
+ * which completes it with fuse_async_done() after --delay
+ * milliseconds.  While an operation waits for the backend, no thread
+ * of the session loop is blocked, so many operations can be in flight
+ * even when running single-threaded (-s).
+ *
+ * Compile with:
+ *
+ *     gcc -Wall hello_async.c `pkg-config fuse3 --cflags --libs` -lpthread -o hello_async
+ *
+ * ## Source code ##
+ * \include hello_async.c
+ */
+
+
+#define FUSE_USE_VERSION FUSE_MAKE_VERSION(3, 17)
+
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+
+#define SCRATCH_MAX 65536
+
+static const char *hello_str = "Hello World!\n";
+
+static char scratch[SCRATCH_MAX];
+static size_t scratch_size;
+static pthread_mutex_t scratch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct options {
+	unsigned delay;
+	int show_help;
+} options;
+
+#define OPTION(t, p)                           \
+    { t, offsetof(struct options, p), 1 }
+static const struct fuse_opt option_spec[] = {
+	OPTION("--delay=%u", delay),
+	OPTION("-h", show_help),
+	OPTION("--help", show_help),
+	FUSE_OPT_END
+};
+
+/*
+ * The simulated backend: a single thread that runs queued jobs once
+ * they are due.  All jobs have the same delay, so the queue is
+ * ordered by due time.
+ */
+struct job {
+	struct job *next;
+	struct timespec due;
+	int (*fn)(struct job *job);
+	struct fuse_async *async;
+
+	const char *path;
+	struct stat *stbuf;
+	char *buf;
+	const char *wbuf;
+	size_t size;
+	off_t off;
+	void *dirbuf;
+	fuse_fill_dir_t filler;
+};
+
+static struct job *queue_head;
+static struct job **queue_tail = &queue_head;
+static int queue_stop;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t backend_thread;
+
+static int do_getattr(const char *path, struct stat *stbuf)
+{
+	memset(stbuf, 0, sizeof(struct stat));
+	if (strcmp(path, "/") == 0) {
+		stbuf->st_mode = S_IFDIR | 0755;
+		stbuf->st_nlink = 2;
+	} else if (strcmp(path, "/hello") == 0) {
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_nlink = 1;
+		stbuf->st_size = strlen(hello_str);
+	} else if (strcmp(path, "/scratch") == 0) {
+		stbuf->st_mode = S_IFREG | 0666;
+		stbuf->st_nlink = 1;
+		pthread_mutex_lock(&scratch_lock);
+		stbuf->st_size = scratch_size;
+		pthread_mutex_unlock(&scratch_lock);
+	} else
+		return -ENOENT;
+
+	return 0;
+}
+
+static int do_read(const char *path, char *buf, size_t size, off_t offset)
+{
+	size_t len;
+
+	if (strcmp(path, "/hello") == 0) {
+		len = strlen(hello_str);
+		if (offset >= len)
+			return 0;
+		if (offset + size > len)
+			size = len - offset;
+		memcpy(buf, hello_str + offset, size);
+		return size;
+	}
+
+	pthread_mutex_lock(&scratch_lock);
+	if (offset >= scratch_size)
+		size = 0;
+	else if (offset + size > scratch_size)
+		size = scratch_size - offset;
+	memcpy(buf, scratch + offset, size);
+	pthread_mutex_unlock(&scratch_lock);
+	return size;
+}
+
+static int do_write(const char *buf, size_t size, off_t offset)
+{
+	if (offset >= SCRATCH_MAX)
+		return -EFBIG;
+	if (offset + size > SCRATCH_MAX)
+		size = SCRATCH_MAX - offset;
+
+	pthread_mutex_lock(&scratch_lock);
+	if (offset > scratch_size)
+		memset(scratch + scratch_size, 0, offset - scratch_size);
+	memcpy(scratch + offset, buf, size);
+	if (offset + size > scratch_size)
+		scratch_size = offset + size;
+	pthread_mutex_unlock(&scratch_lock);
+	return size;
+}
+
+static int do_readdir(const char *path, void *buf, fuse_fill_dir_t filler)
+{
+	if (strcmp(path, "/") != 0)
+		return -ENOENT;
+
+	filler(buf, ".", NULL, 0, FUSE_FILL_DIR_DEFAULTS);
+	filler(buf, "..", NULL, 0, FUSE_FILL_DIR_DEFAULTS);
+	filler(buf, "hello", NULL, 0, FUSE_FILL_DIR_DEFAULTS);
+	filler(buf, "scratch", NULL, 0, FUSE_FILL_DIR_DEFAULTS);
+	return 0;
+}
+
+static int job_getattr(struct job *job)
+{
+	return do_getattr(job->path, job->stbuf);
+}
+
+static int job_read(struct job *job)
+{
+	return do_read(job->path, job->buf, job->size, job->off);
+}
+
+static int job_write(struct job *job)
+{
+	return do_write(job->wbuf, job->size, job->off);
+}
+
+static int job_readdir(struct job *job)
+{
+	return do_readdir(job->path, job->dirbuf, job->filler);
+}
+
+static void *backend(void *arg)
+{
+	struct job *job;
+	int res;
+
+	(void) arg;
+
+	pthread_mutex_lock(&queue_lock);
+	while (1) {
+		job = queue_head;
+		if (job == NULL) {
+			if (queue_stop)
+				break;
+			pthread_cond_wait(&queue_cond, &queue_lock);
+			continue;
+		}
+		if (pthread_cond_timedwait(&queue_cond, &queue_lock,
+					   &job->due) != ETIMEDOUT)
+			continue;
+
+		queue_head = job->next;
+		if (queue_head == NULL)
+			queue_tail = &queue_head;
+		pthread_mutex_unlock(&queue_lock);
+
+		res = job->fn(job);
+		fuse_async_done(job->async, res);
+		free(job);
+
+		pthread_mutex_lock(&queue_lock);
+	}
+	pthread_mutex_unlock(&queue_lock);
+	return NULL;
+}
+
+static struct job *job_new(int (*fn)(struct job *), const char *path,
+			   struct fuse_async *async)
+{
+	struct job *job = calloc(1, sizeof(struct job));
+
+	if (job == NULL)
+		return NULL;
+	job->fn = fn;
+	job->path = path;
+	job->async = async;
+	return job;
+}
+
+static int job_queue(struct job *job)
+{
+	struct timespec *due = &job->due;
+
+	clock_gettime(CLOCK_REALTIME, due);
+	due->tv_sec += options.delay / 1000;
+	due->tv_nsec += (options.delay % 1000) * 1000000L;
+	if (due->tv_nsec >= 1000000000L) {
+		due->tv_sec++;
+		due->tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&queue_lock);
+	*queue_tail = job;
+	queue_tail = &job->next;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+	return 0;
+}
+
+static void *hello_async_init(struct fuse_conn_info *conn,
+			      struct fuse_config *cfg)
+{
+	(void) conn;
+
+	/* Let every operation reach the filesystem */
+	cfg->entry_timeout = 0;
+	cfg->attr_timeout = 0;
+	cfg->negative_timeout = 0;
+	cfg->direct_io = 1;
+
+	/* Started here rather than in main(), since fuse_main()
+	   may fork into the background */
+	if (pthread_create(&backend_thread, NULL, backend, NULL) != 0) {
+		fprintf(stderr, "hello_async: failed to start backend\n");
+		abort();
+	}
+	return NULL;
+}
+
+static void hello_async_destroy(void *private_data)
+{
+	(void) private_data;
+
+	pthread_mutex_lock(&queue_lock);
+	queue_stop = 1;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+	pthread_join(backend_thread, NULL);
+}
+
+static int hello_async_getattr(const char *path, struct stat *stbuf,
+			       struct fuse_file_info *fi)
+{
+	(void) fi;
+	return do_getattr(path, stbuf);
+}
+
+static int hello_async_getattr_async(const char *path, struct stat *stbuf,
+				     struct fuse_file_info *fi,
+				     struct fuse_async *async)
+{
+	struct job *job;
+
+	(void) fi;
+	job = job_new(job_getattr, path, async);
+	if (job == NULL)
+		return -ENOMEM;
+	job->stbuf = stbuf;
+	return job_queue(job);
+}
+
+static int hello_async_readdir(const char *path, void *buf,
+			       fuse_fill_dir_t filler, off_t offset,
+			       struct fuse_file_info *fi,
+			       enum fuse_readdir_flags flags)
+{
+	(void) offset;
+	(void) fi;
+	(void) flags;
+	return do_readdir(path, buf, filler);
+}
+
+static int hello_async_readdir_async(const char *path, void *buf,
+				     fuse_fill_dir_t filler, off_t offset,
+				     struct fuse_file_info *fi,
+				     enum fuse_readdir_flags flags,
+				     struct fuse_async *async)
+{
+	struct job *job;
+
+	(void) offset;
+	(void) fi;
+	(void) flags;
+	job = job_new(job_readdir, path, async);
+	if (job == NULL)
+		return -ENOMEM;
+	job->dirbuf = buf;
+	job->filler = filler;
+	return job_queue(job);
+}
+
+static int hello_async_open(const char *path, struct fuse_file_info *fi)
+{
+	if (strcmp(path, "/scratch") == 0)
+		return 0;
+	if (strcmp(path, "/hello") != 0)
+		return -ENOENT;
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EACCES;
+	return 0;
+}
+
+static int hello_async_read(const char *path, char *buf, size_t size,
+			    off_t offset, struct fuse_file_info *fi)
+{
+	(void) fi;
+	return do_read(path, buf, size, offset);
+}
+
+static int hello_async_read_async(const char *path, char *buf, size_t size,
+				  off_t offset, struct fuse_file_info *fi,
+				  struct fuse_async *async)
+{
+	struct job *job;
+
+	(void) fi;
+	job = job_new(job_read, path, async);
+	if (job == NULL)
+		return -ENOMEM;
+	job->buf = buf;
+	job->size = size;
+	job->off = offset;
+	return job_queue(job);
+}
+
+static int hello_async_write(const char *path, const char *buf, size_t size,
+			     off_t offset, struct fuse_file_info *fi)
+{
+	(void) path;
+	(void) fi;
+	return do_write(buf, size, offset);
+}
+
+static int hello_async_write_async(const char *path, const char *buf,
+				   size_t size, off_t offset,
+				   struct fuse_file_info *fi,
+				   struct fuse_async *async)
+{
+	struct job *job;
+
+	(void) fi;
+	job = job_new(job_write, path, async);
+	if (job == NULL)
+		return -ENOMEM;
+	job->wbuf = buf;
+	job->size = size;
+	job->off = offset;
+	return job_queue(job);
+}
+
+static const struct fuse_operations hello_async_oper = {
+	.init		= hello_async_init,
+	.destroy	= hello_async_destroy,
+	.getattr	= hello_async_getattr,
+	.getattr_async	= hello_async_getattr_async,
+	.readdir	= hello_async_readdir,
+	.readdir_async	= hello_async_readdir_async,
+	.open		= hello_async_open,
+	.read		= hello_async_read,
+	.read_async	= hello_async_read_async,
+	.write		= hello_async_write,
+	.write_async	= hello_async_write_async,
+};
+
+static void show_help(const char *progname)
+{
+	printf("usage: %s [options] <mountpoint>\n\n", progname);
+	printf("File-system specific options:\n"
+	       "    --delay=<ms>        Backend latency\n"
+	       "                        (default: 0)\n"
+	       "\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+
+	if (fuse_opt_parse(&args, &options, option_spec, NULL) == -1)
+		return 1;
+
+	if (options.show_help) {
+		show_help(argv[0]);
+		assert(fuse_opt_add_arg(&args, "--help") == 0);
+		args.argv[0][0] = '\0';
+	}
+
+	ret = fuse_main(args.argc, args.argv, &hello_async_oper, NULL);
+	fuse_opt_free_args(&args);
+	return ret;
+}
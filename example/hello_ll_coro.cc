@@ -0,0 +1,303 @@
+/*
+  FUSE: Filesystem in Userspace
+  Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+
+  This program can be distributed under the terms of the GNU GPLv2.
+  See the file COPYING.
+*/
+
+/** @file
+ *
+ * hello_ll.c written with the C++20 coroutine layer in fuse_coro.hpp.
+ *
+ * The file contents are served by a simulated backend that answers
+ * after --delay milliseconds. While a read waits for the backend, the
+ * session loop thread is free to receive further requests, so many
+ * reads can be in flight even when running single-threaded (-s).
+ *
+ * Compile with:
+ *
+ *     g++ -std=c++20 -Wall hello_ll_coro.cc `pkg-config fuse3 --cflags --libs` -o hello_ll_coro
+ *
+ * ## Source code ##
+ * \include hello_ll_coro.cc
+ */
+
+#define FUSE_USE_VERSION FUSE_MAKE_VERSION(3, 12)
+
+#include "fuse_coro.hpp"
+
+#include <fuse_lowlevel.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include <chrono>
+#include <string>
+
+static const std::string hello_str = "Hello World!\n";
+static const char *hello_name = "hello";
+
+static struct options {
+    unsigned delay;
+    unsigned sched_threads;
+    int show_help;
+} options;
+
+#define OPTION(t, p) \
+    { t, offsetof(struct options, p), 1 }
+static const struct fuse_opt option_spec[] = {
+    OPTION("--delay=%u", delay),
+    OPTION("--sched-threads=%u", sched_threads),
+    OPTION("-h", show_help),
+    OPTION("--help", show_help),
+    FUSE_OPT_END
+};
+
+static fuse_coro::scheduler *sched;
+
+
+static int hello_stat(fuse_ino_t ino, struct stat *stbuf) {
+    stbuf->st_ino = ino;
+    switch (ino) {
+    case 1:
+        stbuf->st_mode = S_IFDIR | 0755;
+        stbuf->st_nlink = 2;
+        break;
+
+    case 2:
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = hello_str.size();
+        break;
+
+    default:
+        return -1;
+    }
+    return 0;
+}
+
+
+/* The simulated backend: completes a read after the configured delay.
+   This is a coroutine itself, but could just as well be a callback from
+   an I/O library. */
+static fuse_coro::task backend_read(off_t off, size_t size,
+                                    fuse_coro::completion<std::string>& res) {
+    co_await sched->sleep_for(std::chrono::milliseconds(options.delay));
+    if (off < (off_t) hello_str.size())
+        res.set(hello_str.substr(off, size));
+    else
+        res.set(std::string());
+}
+
+
+static void hello_ll_init(void *userdata, struct fuse_conn_info *conn) {
+    (void) userdata;
+
+    /* Disable the receiving and processing of FUSE_INTERRUPT requests */
+    conn->no_interrupt = 1;
+}
+
+
+static fuse_coro::task hello_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+                                        struct fuse_file_info *fi) {
+    struct stat stbuf;
+
+    (void) fi;
+
+    memset(&stbuf, 0, sizeof(stbuf));
+    if (hello_stat(ino, &stbuf) == -1)
+        fuse_reply_err(req, ENOENT);
+    else
+        fuse_reply_attr(req, &stbuf, 1.0);
+    co_return;
+}
+
+
+static fuse_coro::task hello_ll_lookup(fuse_req_t req, fuse_ino_t parent,
+                                       const char *name) {
+    struct fuse_entry_param e;
+
+    if (parent != 1 || strcmp(name, hello_name) != 0) {
+        fuse_reply_err(req, ENOENT);
+        co_return;
+    }
+
+    memset(&e, 0, sizeof(e));
+    e.ino = 2;
+    e.attr_timeout = 1.0;
+    e.entry_timeout = 1.0;
+    hello_stat(e.ino, &e.attr);
+
+    fuse_reply_entry(req, &e);
+}
+
+
+static void dirbuf_add(fuse_req_t req, std::string& b, const char *name,
+                       fuse_ino_t ino) {
+    struct stat stbuf;
+    size_t oldsize = b.size();
+    b.resize(oldsize + fuse_add_direntry(req, NULL, 0, name, NULL, 0));
+    memset(&stbuf, 0, sizeof(stbuf));
+    stbuf.st_ino = ino;
+    fuse_add_direntry(req, &b[oldsize], b.size() - oldsize, name, &stbuf,
+                      b.size());
+}
+
+
+static fuse_coro::task hello_ll_readdir(fuse_req_t req, fuse_ino_t ino,
+                                        size_t size, off_t off,
+                                        struct fuse_file_info *fi) {
+    (void) fi;
+
+    if (ino != 1) {
+        fuse_reply_err(req, ENOTDIR);
+        co_return;
+    }
+
+    std::string b;
+    dirbuf_add(req, b, ".", 1);
+    dirbuf_add(req, b, "..", 1);
+    dirbuf_add(req, b, hello_name, 2);
+    if (off < (off_t) b.size())
+        fuse_reply_buf(req, b.data() + off, std::min(b.size() - off, size));
+    else
+        fuse_reply_buf(req, NULL, 0);
+}
+
+
+static fuse_coro::task hello_ll_open(fuse_req_t req, fuse_ino_t ino,
+                                     struct fuse_file_info *fi) {
+    if (ino != 2) {
+        fuse_reply_err(req, EISDIR);
+    } else if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+        fuse_reply_err(req, EACCES);
+    } else {
+        /* Bypass the page cache, so that every read() reaches us */
+        fi->direct_io = 1;
+        fuse_reply_open(req, fi);
+    }
+    co_return;
+}
+
+
+static fuse_coro::task hello_ll_read(fuse_req_t req, fuse_ino_t ino,
+                                     size_t size, off_t off,
+                                     struct fuse_file_info *fi) {
+    (void) fi;
+
+    assert(ino == 2);
+    fuse_coro::completion<std::string> data {*sched};
+    backend_read(off, size, data);
+    auto buf = co_await data;
+    fuse_reply_buf(req, buf.data(), buf.size());
+}
+
+
+static struct fuse_lowlevel_ops hello_ll_oper() {
+    struct fuse_lowlevel_ops ops {};
+    ops.init = hello_ll_init;
+    ops.lookup = fuse_coro::op<hello_ll_lookup>;
+    ops.getattr = fuse_coro::op<hello_ll_getattr>;
+    ops.readdir = fuse_coro::op<hello_ll_readdir>;
+    ops.open = fuse_coro::op<hello_ll_open>;
+    ops.read = fuse_coro::op<hello_ll_read>;
+    return ops;
+}
+
+
+static void show_help(const char *progname) {
+    printf("usage: %s [options] <mountpoint>\n\n", progname);
+    printf("File-system specific options:\n"
+           "    --delay=<ms>           Backend latency for reads\n"
+           "                           (default: 0)\n"
+           "    --sched-threads=<n>    Threads resuming suspended handlers\n"
+           "                           (default: 2)\n"
+           "\n");
+}
+
+
+int main(int argc, char *argv[]) {
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_session *se;
+    struct fuse_cmdline_opts opts;
+    struct fuse_loop_config *config;
+    int ret = -1;
+
+    options.sched_threads = 2;
+    if (fuse_opt_parse(&args, &options, option_spec, NULL) == -1)
+        return 1;
+
+    if (fuse_parse_cmdline(&args, &opts) != 0)
+        return 1;
+    if (opts.show_help || options.show_help) {
+        show_help(argv[0]);
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
+        ret = 0;
+        goto err_out1;
+    } else if (opts.show_version) {
+        printf("FUSE library version %s\n", fuse_pkgversion());
+        fuse_lowlevel_version();
+        ret = 0;
+        goto err_out1;
+    }
+
+    if (opts.mountpoint == NULL) {
+        printf("usage: %s [options] <mountpoint>\n", argv[0]);
+        printf("       %s --help\n", argv[0]);
+        ret = 1;
+        goto err_out1;
+    }
+
+    {
+        const struct fuse_lowlevel_ops ops = hello_ll_oper();
+        se = fuse_session_new(&args, &ops, sizeof(ops), NULL);
+    }
+    if (se == NULL)
+        goto err_out1;
+
+    if (fuse_set_signal_handlers(se) != 0)
+        goto err_out2;
+
+    if (fuse_session_mount(se, opts.mountpoint) != 0)
+        goto err_out3;
+
+    fuse_daemonize(opts.foreground);
+
+    /* The scheduler threads must be started after fuse_daemonize()
+       has forked */
+    sched = new fuse_coro::scheduler(options.sched_threads);
+
+    /* Block until ctrl+c or fusermount -u */
+    if (opts.singlethread) {
+        ret = fuse_session_loop(se);
+    } else {
+        config = fuse_loop_cfg_create();
+        fuse_loop_cfg_set_clone_fd(config, opts.clone_fd);
+        fuse_loop_cfg_set_max_threads(config, opts.max_threads);
+        ret = fuse_session_loop_mt(se, config);
+        fuse_loop_cfg_destroy(config);
+        config = NULL;
+    }
+
+    /* Finish the handlers that are still suspended */
+    delete sched;
+    sched = NULL;
+
+    fuse_session_unmount(se);
+err_out3:
+    fuse_remove_signal_handlers(se);
+err_out2:
+    fuse_session_destroy(se);
+err_out1:
+    free(opts.mountpoint);
+    fuse_opt_free_args(&args);
+
+    return ret ? 1 : 0;
+}
@@ -50,6 +50,10 @@
  *      The current time is 15:58:43
  *      The current time is 15:58:44
  *
+ * With the ``--async`` option, the notifications are queued with
+ * fuse_lowlevel_notify_inval_inode_async() and sent by a separate
+ * thread of the library instead.
+ *
  * ## Compilation ##
  *
  *     gcc -Wall notify_inval_inode.c `pkg-config fuse3 --cflags --libs` -o notify_inval_inode
@@ -89,6 +93,7 @@ static _Atomic bool is_stop = false;
 /* Command line parsing */
 struct options {
     int no_notify;
+    int async;
     int update_interval;
 };
 static struct options options = {
@@ -100,6 +105,7 @@ static struct options options = {
     { t, offsetof(struct options, p), 1 }
 static const struct fuse_opt option_spec[] = {
     OPTION("--no-notify", no_notify),
+    OPTION("--async", async),
     OPTION("--update-interval=%d", update_interval),
     FUSE_OPT_END
 };
@@ -291,8 +297,13 @@ static void* update_fs_loop(void *data) {
              * might come up during umount, when kernel side already releases
              * all inodes, but does not send FUSE_DESTROY yet.
              */
-            int ret =
-                fuse_lowlevel_notify_inval_inode(se, FILE_INO, 0, 0);
+            int ret;
+
+            if (options.async)
+                ret = fuse_lowlevel_notify_inval_inode_async(se, FILE_INO,
+                                                             0, 0);
+            else
+                ret = fuse_lowlevel_notify_inval_inode(se, FILE_INO, 0, 0);
             if ((ret != 0 && !is_stop) &&
                  ret != -ENOENT && ret != -EBADF && ret != -ENODEV) {
                 fprintf(stderr,
@@ -312,6 +323,7 @@ static void show_help(const char *progname)
     printf("File-system specific options:\n"
                "    --update-interval=<secs>  Update-rate of file system contents\n"
                "    --no-notify            Disable kernel notifications\n"
+               "    --async                Queue notifications instead of sending them\n"
                "\n");
 }
 
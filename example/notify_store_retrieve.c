@@ -49,6 +49,10 @@
  *      The current time is 15:58:43
  *      The current time is 15:58:44
  *
+ *  With the ``--callback`` option, the data is retrieved with
+ *  fuse_lowlevel_notify_retrieve_cb() instead of through the
+ *  retrieve_reply() method.
+ *
  * ## Compilation ##
  *
  *     gcc -Wall notify_store_retrieve.c `pkg-config fuse3 --cflags --libs` -o notify_store_retrieve
@@ -98,6 +102,7 @@ static pthread_t updater;
 /* Command line parsing */
 struct options {
     int no_notify;
+    int callback;
     int update_interval;
 };
 static struct options options = {
@@ -109,6 +114,7 @@ static struct options options = {
     { t, offsetof(struct options, p), 1 }
 static const struct fuse_opt option_spec[] = {
     OPTION("--no-notify", no_notify),
+    OPTION("--callback", callback),
     OPTION("--update-interval=%d", update_interval),
     FUSE_OPT_END
 };
@@ -274,8 +280,8 @@ static void tfs_read(fuse_req_t req, fuse_ino_t ino, size_t size,
     reply_buf_limited(req, file_contents, file_size, off, size);
 }
 
-static void tfs_retrieve_reply(fuse_req_t req, void *cookie, fuse_ino_t ino,
-                               off_t offset, struct fuse_bufvec *data) {
+static void check_retrieved(void *cookie, fuse_ino_t ino, off_t offset,
+                            struct fuse_bufvec *data) {
     struct fuse_bufvec bufv;
     char buf[MAX_STR_LEN];
     char *expected;
@@ -297,9 +303,24 @@ static void tfs_retrieve_reply(fuse_req_t req, void *cookie, fuse_ino_t ino,
     assert(strncmp(buf, expected, ret) == 0);
     free(expected);
     retrieve_status = 2;
+}
+
+static void tfs_retrieve_reply(fuse_req_t req, void *cookie, fuse_ino_t ino,
+                               off_t offset, struct fuse_bufvec *data) {
+    check_retrieved(cookie, ino, offset, data);
     fuse_reply_none(req);
 }
 
+/* Used instead of tfs_retrieve_reply() with --callback */
+static void retrieve_done(void *cookie, fuse_ino_t ino, off_t offset,
+                          int error, struct fuse_bufvec *data) {
+    if (error) {
+        free(cookie);
+        return;
+    }
+    check_retrieved(cookie, ino, offset, data);
+}
+
 static void tfs_destroy(void *userdata)
 {
 	(void)userdata;
@@ -369,8 +390,15 @@ static void* update_fs_loop(void *data) {
 
             /* To make sure that everything worked correctly, ask the
                kernel to send us back the stored data */
-            ret = fuse_lowlevel_notify_retrieve(se, FILE_INO, MAX_STR_LEN,
-                                                0, (void*) strdup(file_contents));
+            if (options.callback)
+                ret = fuse_lowlevel_notify_retrieve_cb(se, FILE_INO,
+                                                       MAX_STR_LEN, 0,
+                                                       retrieve_done,
+                                                       strdup(file_contents));
+            else
+                ret = fuse_lowlevel_notify_retrieve(se, FILE_INO,
+                                                    MAX_STR_LEN, 0,
+                                                    strdup(file_contents));
             assert((ret == 0 || is_umount) || ret == -ENOENT || ret == -EBADF ||
                    ret != -ENODEV);
             if(retrieve_status == 0)
@@ -388,6 +416,7 @@ static void show_help(const char *progname)
     printf("File-system specific options:\n"
                "    --update-interval=<secs>  Update-rate of file system contents\n"
                "    --no-notify            Disable kernel notifications\n"
+               "    --callback             Use fuse_lowlevel_notify_retrieve_cb()\n"
                "\n");
 }
 
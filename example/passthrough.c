@@ -77,6 +77,9 @@ static void *xmp_init(struct fuse_conn_info *conn,
 	cfg->attr_timeout = 0;
 	cfg->negative_timeout = 0;
 
+	/* read, write and fsync only need the file handle */
+	cfg->nullpath_data_ok = 1;
+
 	return NULL;
 }
 
@@ -59,18 +59,26 @@
 #include <string.h>
 #include <sys/file.h>
 #include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/xattr.h>
 #include <time.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <limits.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
 
 // C++ includes
 #include <cstddef>
 #include <cstdio>
 #include <cstdlib>
 #include "cxxopts.hpp"
+#include <array>
+#include <atomic>
+#include <condition_variable>
 #include <mutex>
+#include <thread>
+#include <vector>
 #include <syslog.h>
 
 using namespace std;
@@ -120,11 +128,27 @@ struct Inode {
     dev_t src_dev {0};
     ino_t src_ino {0};
     int generation {0};
-    int backing_id {0};
     uint64_t nopen {0};
     uint64_t nlookup {0};
     std::mutex m;
 
+    // fsync() group commit, protected by m. Requests are numbered as
+    // they arrive; a sync that is started after a request has arrived
+    // covers it. Each request gets the result of the first sync that
+    // covered it, which is stored in its SyncWaiter.
+    struct SyncWaiter {
+        uint64_t ticket;
+        bool full;
+        int err;
+    };
+    uint64_t sync_requested {0};     // last request number handed out
+    uint64_t sync_full_requested {0}; // last request that was not datasync
+    uint64_t sync_done {0};          // last request covered by any sync
+    uint64_t sync_full_done {0};     // last request covered by fsync()
+    std::vector<SyncWaiter*> sync_waiters; // requests not covered yet
+    bool sync_running {false};
+    std::condition_variable sync_cond;
+
     // Delete copy constructor and assignments. We could implement
     // move if we need it.
     Inode() = default;
@@ -139,10 +163,18 @@ struct Inode {
     }
 };
 
-struct Fs {
+// The inode map is split into shards with separate locks, so that
+// lookups and forgets of different inodes don't contend.
+constexpr size_t INODE_SHARDS = 64;
+
+struct InodeShard {
     // Must be acquired *after* any Inode.m locks.
-    std::mutex mutex;
-    InodeMap inodes; // protected by mutex
+    std::mutex m;
+    InodeMap inodes; // protected by m
+};
+
+struct Fs {
+    std::array<InodeShard, INODE_SHARDS> shards;
     Inode root;
     double timeout;
     bool debug;
@@ -158,10 +190,19 @@ struct Fs {
     std::string fuse_mount_options;
     bool direct_io;
     bool passthrough;
+    bool io_uring;
+    unsigned uring_depth;
+    std::atomic<uint64_t> fsync_requests;
+    std::atomic<uint64_t> fsync_syncs;
 };
 static Fs fs{};
 
 
+static InodeShard& get_shard(const SrcId& id) {
+    return fs.shards[std::hash<SrcId>{}(id) % INODE_SHARDS];
+}
+
+
 #define FUSE_BUF_COPY_FLAGS                      \
         (fs.nosplice ?                           \
             FUSE_BUF_NO_SPLICE :                 \
@@ -355,10 +396,11 @@ static int do_lookup(fuse_ino_t parent, const char *name,
     }
 
     SrcId id {e->attr.st_ino, e->attr.st_dev};
-    unique_lock<mutex> fs_lock {fs.mutex};
+    InodeShard& shard = get_shard(id);
+    unique_lock<mutex> fs_lock {shard.m};
     Inode* inode_p;
     try {
-        inode_p = &fs.inodes[id];
+        inode_p = &shard.inodes[id];
     } catch (std::bad_alloc&) {
         return ENOMEM;
     }
@@ -391,7 +433,7 @@ static int do_lookup(fuse_ino_t parent, const char *name,
     } else { // no existing inode
         /* This is just here to make Helgrind happy. It violates the
            lock ordering requirement (inode.m must be acquired before
-           fs.mutex), but this is of no consequence because at this
+           shard.m), but this is of no consequence because at this
            point no other thread has access to the inode mutex */
         lock_guard<mutex> g {inode.m};
         inode.src_ino = e->attr.st_ino;
@@ -562,7 +604,7 @@ static void sfs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
 			    if (fs.debug)
 				    cerr << "DEBUG: unlink: release inode " << e.attr.st_ino
 					    << "; fd=" << inode.fd << endl;
-			    lock_guard<mutex> g_fs {fs.mutex};
+			    lock_guard<mutex> g_fs {get_shard({inode.src_ino, inode.src_dev}).m};
 			    close(inode.fd);
 			    inode.fd = -ENOENT;
 			    inode.generation++;
@@ -597,9 +639,11 @@ static void forget_one(fuse_ino_t ino, uint64_t n) {
         if (fs.debug)
             cerr << "DEBUG: forget: cleaning up inode " << inode.src_ino << endl;
         {
-            lock_guard<mutex> g_fs {fs.mutex};
+            SrcId id {inode.src_ino, inode.src_dev};
+            InodeShard& shard = get_shard(id);
+            lock_guard<mutex> g_fs {shard.m};
             l.unlock();
-            fs.inodes.erase({inode.src_ino, inode.src_dev});
+            shard.inodes.erase(id);
         }
     } else if (fs.debug)
             cerr << "DEBUG: forget: inode " << inode.src_ino
@@ -635,17 +679,24 @@ static void sfs_readlink(fuse_req_t req, fuse_ino_t ino) {
 }
 
 
+// Size of the buffer that getdents64() reads directory entries into
+constexpr size_t DIR_BUF_SIZE = 64 * 1024;
+
 struct DirHandle {
-    DIR *dp {nullptr};
-    off_t offset;
+    int fd {-1};
+    off_t offset {0};       // offset of the entry at buf[pos]
+    std::vector<char> buf;
+    size_t pos {0};
+    size_t end {0};
+    std::mutex m;
 
     DirHandle() = default;
     DirHandle(const DirHandle&) = delete;
     DirHandle& operator=(const DirHandle&) = delete;
 
     ~DirHandle() {
-        if(dp)
-            closedir(dp);
+        if (fd != -1)
+            close(fd);
     }
 };
 
@@ -668,18 +719,10 @@ static void sfs_opendir(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi) {
     // access d until we've called fuse_reply_*.
     lock_guard<mutex> g {inode.m};
 
-    auto fd = openat(inode.fd, ".", O_RDONLY);
-    if (fd == -1)
-        goto out_errno;
-
-    // On success, dir stream takes ownership of fd, so we
-    // do not have to close it.
-    d->dp = fdopendir(fd);
-    if(d->dp == nullptr)
+    d->fd = openat(inode.fd, ".", O_RDONLY | O_DIRECTORY);
+    if (d->fd == -1)
         goto out_errno;
 
-    d->offset = 0;
-
     fi->fh = reinterpret_cast<uint64_t>(d);
     if(fs.timeout) {
         fi->keep_cache = 1;
@@ -703,11 +746,65 @@ static bool is_dot_or_dotdot(const char *name) {
 }
 
 
+/* Refill the directory buffer. Returns the number of bytes read, 0 at
+   the end of the directory or -errno */
+static ssize_t dir_fill(DirHandle *d) {
+    if (d->buf.empty()) {
+        try {
+            d->buf.resize(DIR_BUF_SIZE);
+        } catch (std::bad_alloc&) {
+            return -ENOMEM;
+        }
+    }
+    auto res = syscall(SYS_getdents64, d->fd, d->buf.data(), d->buf.size());
+    if (res == -1)
+        return -errno;
+    d->pos = 0;
+    d->end = res;
+    return res;
+}
+
+
+/* Lookup of a directory entry whose inode number is known from
+   getdents64(). If the inode is already in the inode map, a single
+   fstatat() is enough instead of opening the file. */
+static int do_lookup_dirent(fuse_ino_t parent, const char *name,
+                            ino_t d_ino, fuse_entry_param *e) {
+    memset(e, 0, sizeof(*e));
+    e->attr_timeout = fs.timeout;
+    e->entry_timeout = fs.timeout;
+
+    if (fstatat(get_fs_fd(parent), name, &e->attr, AT_SYMLINK_NOFOLLOW) == -1)
+        return errno;
+
+    SrcId id {e->attr.st_ino, e->attr.st_dev};
+    if (id.first == d_ino && id.second == fs.src_dev) {
+        InodeShard& shard = get_shard(id);
+        lock_guard<mutex> g_fs {shard.m};
+        auto it = shard.inodes.find(id);
+        if (it != shard.inodes.end()) {
+            Inode& inode = it->second;
+            /* inode.m must be acquired before shard.m, so only try
+               to lock it here and fall back to a full lookup */
+            unique_lock<mutex> l {inode.m, try_to_lock};
+            if (l.owns_lock() && inode.fd > 0) {
+                inode.nlookup++;
+                e->ino = reinterpret_cast<fuse_ino_t>(&inode);
+                e->generation = inode.generation;
+                return 0;
+            }
+        }
+    }
+    return do_lookup(parent, name, e);
+}
+
+
 static void do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
                     off_t offset, fuse_file_info *fi, const int plus) {
     auto d = get_dir_handle(fi);
-    Inode& inode = get_inode(ino);
-    lock_guard<mutex> g {inode.m};
+    lock_guard<mutex> g {d->m};
+    std::vector<struct dirent64*> batch;
+    std::vector<fuse_entry_param> entries;
     char *p;
     auto rem = size;
     int err = 0, count = 0;
@@ -726,62 +823,91 @@ static void do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
     if (offset != d->offset) {
         if (fs.debug)
             cerr << "DEBUG: readdir(): seeking to " << offset << endl;
-        seekdir(d->dp, offset);
+        if (lseek(d->fd, offset, SEEK_SET) == -1) {
+            err = errno;
+            goto error;
+        }
+        d->pos = d->end = 0;
         d->offset = offset;
     }
 
     while (1) {
-        bool did_lookup = false;
-        struct dirent *entry;
-        errno = 0;
-        entry = readdir(d->dp);
-        if (!entry) {
-            if(errno) {
-                err = errno;
+        if (d->pos == d->end) {
+            auto res = dir_fill(d);
+            if (res < 0) {
+                err = -res;
                 if (fs.debug)
-                    warn("DEBUG: readdir(): readdir failed with");
+                    cerr << "DEBUG: readdir(): getdents64 failed: "
+                         << strerror(err) << endl;
                 goto error;
             }
-            break; // End of stream
+            if (res == 0)
+                break; // End of stream
+        }
+
+        /* Collect the buffered entries that fit into the reply */
+        batch.clear();
+        size_t need = 0;
+        for (auto pos = d->pos; pos < d->end;) {
+            auto entry = reinterpret_cast<struct dirent64*>(&d->buf[pos]);
+            size_t entsize = plus ?
+                fuse_add_direntry_plus(req, nullptr, 0, entry->d_name,
+                                       nullptr, 0) :
+                fuse_add_direntry(req, nullptr, 0, entry->d_name,
+                                  nullptr, 0);
+            if (need + entsize > rem)
+                break;
+            need += entsize;
+            batch.push_back(entry);
+            pos += entry->d_reclen;
+        }
+        if (batch.empty()) {
+            if (fs.debug)
+                cerr << "DEBUG: readdir(): buffer full, returning data. " << endl;
+            break;
         }
-        d->offset = entry->d_off;
 
-        fuse_entry_param e{};
-        size_t entsize;
-        if (plus) {
-            if (is_dot_or_dotdot(entry->d_name)) {
+        /* Look them up in one go, without holding any lock in between */
+        entries.assign(batch.size(), fuse_entry_param{});
+        for (size_t i = 0; i < batch.size(); i++) {
+            auto entry = batch[i];
+            auto& e = entries[i];
+            if (!plus || is_dot_or_dotdot(entry->d_name)) {
                 /* fuse kernel ignores attributes for these and also does
                  * not increase lookup count (see fuse_direntplus_link) */
                 e.attr.st_ino = entry->d_ino;
                 e.attr.st_mode = entry->d_type << 12;
-            } else {
-                err = do_lookup(ino, entry->d_name, &e);
-                if (err)
-                    goto error;
-                did_lookup = true;
+                continue;
+            }
+            err = do_lookup_dirent(ino, entry->d_name, entry->d_ino, &e);
+            if (err) {
+                batch.resize(i);
+                break;
             }
-            entsize = fuse_add_direntry_plus(req, p, rem, entry->d_name, &e, entry->d_off);
-        } else {
-            e.attr.st_ino = entry->d_ino;
-            e.attr.st_mode = entry->d_type << 12;
-            entsize = fuse_add_direntry(req, p, rem, entry->d_name, &e.attr, entry->d_off);
-        }
-
-        if (entsize > rem) {
-            if (fs.debug)
-                cerr << "DEBUG: readdir(): buffer full, returning data. " << endl;
-            if (did_lookup)
-                forget_one(e.ino, 1);
-            break;
         }
 
-        p += entsize;
-        rem -= entsize;
-        count++;
-        if (fs.debug) {
-            cerr << "DEBUG: readdir(): added to buffer: " << entry->d_name
-                 << ", ino " << e.attr.st_ino << ", offset " << entry->d_off << endl;
+        for (size_t i = 0; i < batch.size(); i++) {
+            auto entry = batch[i];
+            size_t entsize;
+            if (plus)
+                entsize = fuse_add_direntry_plus(req, p, rem, entry->d_name,
+                                                 &entries[i], entry->d_off);
+            else
+                entsize = fuse_add_direntry(req, p, rem, entry->d_name,
+                                            &entries[i].attr, entry->d_off);
+            p += entsize;
+            rem -= entsize;
+            count++;
+            d->pos += entry->d_reclen;
+            d->offset = entry->d_off;
+            if (fs.debug) {
+                cerr << "DEBUG: readdir(): added to buffer: " << entry->d_name
+                     << ", ino " << entries[i].attr.st_ino << ", offset "
+                     << entry->d_off << endl;
+            }
         }
+        if (err)
+            goto error;
     }
     err = 0;
 error:
@@ -829,22 +955,15 @@ static void sfs_releasedir(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi) {
 
 static void do_passthrough_open(fuse_req_t req, fuse_ino_t ino, int fd,
                                 fuse_file_info *fi) {
-    Inode& inode = get_inode(ino);
-    /* Setup a shared backing file on first open of an inode */
-    if (inode.backing_id) {
-        if (fs.debug)
-            cerr << "DEBUG: reusing shared backing file "
-                 << inode.backing_id << " for inode " << ino << endl;
-        fi->backing_id = inode.backing_id;
-    } else if (!(inode.backing_id = fuse_passthrough_open(req, fd))) {
+    /* The library shares one backing file between all opens of an
+       inode and closes it on the last release */
+    if (!fuse_passthrough_open_inode(req, ino, fd, fi)) {
         cerr << "DEBUG: fuse_passthrough_open failed for inode " << ino
              << ", disabling rw passthrough." << endl;
         fs.passthrough = false;
-    } else {
-        if (fs.debug)
-            cerr << "DEBUG: setup shared backing file "
-                 << inode.backing_id << " for inode " << ino << endl;
-        fi->backing_id = inode.backing_id;
+    } else if (fs.debug) {
+        cerr << "DEBUG: using shared backing file "
+             << fi->backing_id << " for inode " << ino << endl;
     }
     /* open in passthrough mode must drop old page cache */
     if (fi->backing_id)
@@ -896,7 +1015,7 @@ static void sfs_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
                          fuse_file_info *fi) {
     (void) ino;
     int res;
-    int fd = dirfd(get_dir_handle(fi)->dp);
+    int fd = get_dir_handle(fi)->fd;
     if (datasync)
         res = fdatasync(fd);
     else
@@ -967,19 +1086,6 @@ static void sfs_release(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi) {
     Inode& inode = get_inode(ino);
     lock_guard<mutex> g {inode.m};
     inode.nopen--;
-
-    /* Close the shared backing file on last file close of an inode */
-    if (inode.backing_id && !inode.nopen) {
-        if (fuse_passthrough_close(req, inode.backing_id) < 0) {
-            cerr << "DEBUG: fuse_passthrough_close failed for inode "
-                 << ino << " backing file " << inode.backing_id << endl;
-        } else if (fs.debug) {
-            cerr << "DEBUG: closed backing file " << inode.backing_id
-                 << " for inode " << ino << endl;
-        }
-        inode.backing_id = 0;
-    }
-
     close(fi->fh);
     fuse_reply_err(req, 0);
 }
@@ -992,19 +1098,345 @@ static void sfs_flush(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi) {
 }
 
 
+/* Concurrent fsync requests for the same inode are coalesced: while
+   a sync is running, further requests wait for it to finish and are
+   then all covered by a single follow-up sync. */
 static void sfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
                       fuse_file_info *fi) {
-    (void) ino;
+    Inode& inode = get_inode(ino);
+    unique_lock<mutex> l {inode.m};
+    Inode::SyncWaiter self {++inode.sync_requested, !datasync, 0};
+    if (self.full)
+        inode.sync_full_requested = self.ticket;
+    inode.sync_waiters.push_back(&self);
+    fs.fsync_requests++;
+
+    while (true) {
+        auto done = datasync ? inode.sync_done : inode.sync_full_done;
+        if (done >= self.ticket)
+            break;
+        if (inode.sync_running) {
+            inode.sync_cond.wait(l);
+            continue;
+        }
+
+        // Sync on behalf of everyone who has arrived so far
+        auto target = inode.sync_requested;
+        auto full = inode.sync_full_requested > inode.sync_full_done;
+        inode.sync_running = true;
+        l.unlock();
+        auto res = full ? fsync(fi->fh) : fdatasync(fi->fh);
+        auto err = res == -1 ? errno : 0;
+        fs.fsync_syncs++;
+        l.lock();
+        inode.sync_running = false;
+        inode.sync_done = target;
+        if (full)
+            inode.sync_full_done = target;
+        auto& waiters = inode.sync_waiters;
+        for (auto it = waiters.begin(); it != waiters.end();) {
+            auto w = *it;
+            if (w->ticket <= target && (full || !w->full)) {
+                w->err = err;
+                it = waiters.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        inode.sync_cond.notify_all();
+    }
+    l.unlock();
+    fuse_reply_err(req, self.err);
+}
+
+
+// When --io-uring is given, reads and writes that are not handled by
+// kernel passthrough are submitted to an io_uring instead of being
+// executed on the worker thread. A single completion thread sends the
+// replies, so the worker threads are free to take the next request
+// while the I/O is in flight. liburing is not required, the ring is
+// set up with the raw system calls.
+struct UringOp {
+    fuse_req_t req;
+    int fd;
+    bool write;
+    char *buf;
+    size_t size;    // total size of the request
+    size_t done;    // bytes transferred so far
+    off_t off;
+};
+
+struct Uring {
+    int fd {-1};
+    unsigned entries {0};
+
+    // Submission queue
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    io_uring_sqe *sqes;
+
+    // Completion queue
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    io_uring_cqe *cqes;
+
+    void *ring_ptr {nullptr};
+    size_t ring_size {0};
+    size_t sqes_size {0};
+
+    std::mutex m;
+    std::condition_variable space;
+    unsigned inflight {0}; // protected by m
+    std::thread thread;
+};
+static Uring uring;
+
+
+static int uring_enter(unsigned to_submit, unsigned min_complete,
+                       unsigned flags) {
+    auto res = syscall(SYS_io_uring_enter, uring.fd, to_submit,
+                       min_complete, flags, nullptr, 0);
+    return res == -1 ? -errno : static_cast<int>(res);
+}
+
+
+/* Queue an operation. If `resubmit` is set, the operation already
+   holds a slot (it is being continued after a short transfer) and
+   must not wait for one. */
+static void uring_submit(UringOp *op, bool resubmit) {
+    {
+        unique_lock<mutex> l {uring.m};
+        if (!resubmit) {
+            uring.space.wait(l, []{ return uring.inflight < uring.entries; });
+            uring.inflight++;
+        }
+
+        auto tail = *uring.sq_tail;
+        auto idx = tail & *uring.sq_mask;
+        auto sqe = &uring.sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        if (op == nullptr) {
+            sqe->opcode = IORING_OP_NOP;
+        } else {
+            sqe->opcode = op->write ? IORING_OP_WRITE : IORING_OP_READ;
+            sqe->fd = op->fd;
+            sqe->addr = reinterpret_cast<uint64_t>(op->buf + op->done);
+            sqe->len = op->size - op->done;
+            sqe->off = op->off + op->done;
+        }
+        sqe->user_data = reinterpret_cast<uint64_t>(op);
+        uring.sq_array[idx] = idx;
+        __atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    }
+
+    /* Entries queued by other threads in the meantime are picked up
+       by their own io_uring_enter() calls, which is fine since each
+       call submits whatever is pending. Errors for the operation
+       itself are reported in its completion. */
     int res;
-    if (datasync)
-        res = fdatasync(fi->fh);
+    do
+        res = uring_enter(1, 0, 0);
+    while (res == -EINTR || res == -EAGAIN || res == -EBUSY);
+    if (res < 0) {
+        cerr << "ERROR: io_uring_enter(): " << strerror(-res) << endl;
+        abort();
+    }
+}
+
+
+static void uring_put(UringOp *op) {
+    free(op->buf);
+    delete op;
+    lock_guard<mutex> g {uring.m};
+    uring.inflight--;
+    uring.space.notify_one();
+}
+
+
+static void uring_complete(UringOp *op, int res) {
+    if (res > 0) {
+        op->done += res;
+        if (op->done < op->size) {
+            uring_submit(op, true);
+            return;
+        }
+    } else if (res < 0 && op->done == 0) {
+        fuse_reply_err(op->req, -res);
+        uring_put(op);
+        return;
+    }
+
+    // End of file, or an error after a partial transfer
+    if (op->write)
+        fuse_reply_write(op->req, op->done);
     else
-        res = fsync(fi->fh);
-    fuse_reply_err(req, res == -1 ? errno : 0);
+        fuse_reply_buf(op->req, op->buf, op->done);
+    uring_put(op);
+}
+
+
+static void uring_reap() {
+    while (true) {
+        auto res = uring_enter(0, 1, IORING_ENTER_GETEVENTS);
+        if (res < 0 && res != -EINTR) {
+            cerr << "ERROR: io_uring_enter(): " << strerror(-res) << endl;
+            abort();
+        }
+
+        auto head = *uring.cq_head;
+        auto tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+        bool exit = false;
+        for (; head != tail; head++) {
+            auto cqe = &uring.cqes[head & *uring.cq_mask];
+            auto op = reinterpret_cast<UringOp*>(cqe->user_data);
+            if (op == nullptr)
+                exit = true;
+            else
+                uring_complete(op, cqe->res);
+        }
+        __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+        if (exit)
+            return;
+    }
+}
+
+
+static int uring_init(unsigned depth) {
+    io_uring_params p {};
+    auto fd = syscall(SYS_io_uring_setup, depth, &p);
+    if (fd == -1)
+        return -errno;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(fd);
+        return -ENOSYS;
+    }
+
+    auto sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    auto cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    uring.ring_size = std::max(sq_size, cq_size);
+    uring.ring_ptr = mmap(nullptr, uring.ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (uring.ring_ptr == MAP_FAILED) {
+        auto err = errno;
+        close(fd);
+        return -err;
+    }
+    uring.sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+    auto sqes = mmap(nullptr, uring.sqes_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        auto err = errno;
+        munmap(uring.ring_ptr, uring.ring_size);
+        close(fd);
+        return -err;
+    }
+
+    auto ring = static_cast<char*>(uring.ring_ptr);
+    uring.sq_tail = reinterpret_cast<unsigned*>(ring + p.sq_off.tail);
+    uring.sq_mask = reinterpret_cast<unsigned*>(ring + p.sq_off.ring_mask);
+    uring.sq_array = reinterpret_cast<unsigned*>(ring + p.sq_off.array);
+    uring.sqes = static_cast<io_uring_sqe*>(sqes);
+    uring.cq_head = reinterpret_cast<unsigned*>(ring + p.cq_off.head);
+    uring.cq_tail = reinterpret_cast<unsigned*>(ring + p.cq_off.tail);
+    uring.cq_mask = reinterpret_cast<unsigned*>(ring + p.cq_off.ring_mask);
+    uring.cqes = reinterpret_cast<io_uring_cqe*>(ring + p.cq_off.cqes);
+
+    // The completion queue is at least as large as the submission
+    // queue, so limiting the number of operations in flight to the
+    // latter ensures that it cannot overflow.
+    uring.entries = p.sq_entries;
+    uring.fd = fd;
+    return 0;
+}
+
+
+// The ring is set up before mounting, so that --io-uring can fail
+// early, but the completion thread has to be started after
+// fuse_daemonize() has forked
+static void uring_start() {
+    if (uring.fd != -1)
+        uring.thread = std::thread(uring_reap);
+}
+
+
+static void uring_exit() {
+    if (uring.fd == -1)
+        return;
+
+    if (uring.thread.joinable()) {
+        {
+            unique_lock<mutex> l {uring.m};
+            uring.space.wait(l, []{ return uring.inflight == 0; });
+        }
+        uring_submit(nullptr, true);
+        uring.thread.join();
+    }
+
+    munmap(uring.sqes, uring.sqes_size);
+    munmap(uring.ring_ptr, uring.ring_size);
+    close(uring.fd);
+    uring.fd = -1;
+}
+
+
+static UringOp *uring_op_new(fuse_req_t req, fuse_file_info *fi, bool write,
+                             size_t size, off_t off) {
+    auto op = new (nothrow) UringOp {req, static_cast<int>(fi->fh), write,
+                                     nullptr, size, 0, off};
+    if (op == nullptr)
+        return nullptr;
+    // Page aligned, so that it can be used with O_DIRECT files
+    if (posix_memalign(reinterpret_cast<void**>(&op->buf), 4096,
+                       size ? size : 1) != 0) {
+        delete op;
+        return nullptr;
+    }
+    return op;
+}
+
+
+static void uring_read(fuse_req_t req, size_t size, off_t off,
+                       fuse_file_info *fi) {
+    auto op = uring_op_new(req, fi, false, size, off);
+    if (op == nullptr) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    uring_submit(op, false);
+}
+
+
+static void uring_write(fuse_req_t req, size_t size, off_t off,
+                        fuse_bufvec *in_buf, fuse_file_info *fi) {
+    auto op = uring_op_new(req, fi, true, size, off);
+    if (op == nullptr) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    // The request buffer is reused once we return, so the data has to
+    // be copied (or spliced out of the pipe) before submitting.
+    fuse_bufvec mem_buf = FUSE_BUFVEC_INIT(size);
+    mem_buf.buf[0].mem = op->buf;
+    auto copied = fuse_buf_copy(&mem_buf, in_buf, FUSE_BUF_COPY_FLAGS);
+    if (copied < 0) {
+        fuse_reply_err(req, -copied);
+        uring_put(op);
+        return;
+    }
+    op->size = copied;
+
+    uring_submit(op, false);
 }
 
 
 static void do_read(fuse_req_t req, size_t size, off_t off, fuse_file_info *fi) {
+    if (fs.io_uring) {
+        uring_read(req, size, off, fi);
+        return;
+    }
 
     fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
     buf.buf[0].flags = static_cast<fuse_buf_flags>(
@@ -1029,6 +1461,11 @@ static void sfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
 
 static void do_write_buf(fuse_req_t req, size_t size, off_t off,
                          fuse_bufvec *in_buf, fuse_file_info *fi) {
+    if (fs.io_uring) {
+        uring_write(req, size, off, in_buf, fi);
+        return;
+    }
+
     fuse_bufvec out_buf = FUSE_BUFVEC_INIT(size);
     out_buf.buf[0].flags = static_cast<fuse_buf_flags>(
         FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
@@ -1081,6 +1518,30 @@ static void sfs_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
 }
 #endif
 
+#ifdef HAVE_COPY_FILE_RANGE
+static void sfs_copy_file_range(fuse_req_t req, fuse_ino_t ino_in, off_t off_in,
+                                fuse_file_info *fi_in, fuse_ino_t ino_out,
+                                off_t off_out, fuse_file_info *fi_out,
+                                size_t len, int flags) {
+    (void) ino_in;
+    (void) ino_out;
+    if (fs.debug)
+        cerr << "DEBUG: copy_file_range(): " << len << " bytes from fd "
+             << fi_in->fh << " offset " << off_in << " to fd " << fi_out->fh
+             << " offset " << off_out << endl;
+
+    // Copies within one file system are done by the kernel, and are
+    // reflinks where the file system supports that
+    auto res = copy_file_range(fi_in->fh, &off_in, fi_out->fh, &off_out,
+                               len, flags);
+    if (res == -1)
+        fuse_reply_err(req, errno);
+    else
+        fuse_reply_write(req, res);
+}
+#endif
+
+
 static void sfs_flock(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi,
                       int op) {
     (void) ino;
@@ -1239,6 +1700,9 @@ static void assign_operations(fuse_lowlevel_ops &sfs_oper) {
     sfs_oper.fallocate = sfs_fallocate;
 #endif
     sfs_oper.flock = sfs_flock;
+#ifdef HAVE_COPY_FILE_RANGE
+    sfs_oper.copy_file_range = sfs_copy_file_range;
+#endif
 #ifdef HAVE_SETXATTR
     sfs_oper.setxattr = sfs_setxattr;
     sfs_oper.getxattr = sfs_getxattr;
@@ -1307,7 +1771,11 @@ static cxxopts::ParseResult parse_options(int argc, char **argv) {
         ("num-threads", "Number of libfuse worker threads",
                         cxxopts::value<int>()->default_value(SFS_DEFAULT_THREADS))
         ("clone-fd", "use separate fuse device fd for each thread")
-        ("direct-io", "enable fuse kernel internal direct-io");
+        ("direct-io", "enable fuse kernel internal direct-io")
+        ("io-uring", "Use io_uring for reads and writes that are not "
+                     "passed through")
+        ("io-uring-depth", "Number of io_uring operations in flight",
+                           cxxopts::value<unsigned>()->default_value("256"));
 
     // FIXME: Find a better way to limit the try clause to just
     // opt_parser.parse() (cf. https://github.com/jarro2783/cxxopts/issues/146)
@@ -1340,6 +1808,8 @@ static cxxopts::ParseResult parse_options(int argc, char **argv) {
     fs.num_threads = options["num-threads"].as<int>();
     fs.clone_fd = options.count("clone-fd");
     fs.direct_io = options.count("direct-io");
+    fs.io_uring = options.count("io-uring");
+    fs.uring_depth = options["io-uring-depth"].as<unsigned>();
     char* resolved_path = realpath(argv[1], NULL);
     if (resolved_path == NULL)
         warn("WARNING: realpath() failed with");
@@ -1417,6 +1887,12 @@ int main(int argc, char *argv[]) {
     if (fs.root.fd == -1)
         err(1, "ERROR: open(\"%s\", O_PATH)", fs.source.c_str());
 
+    if (fs.io_uring) {
+        ret = uring_init(fs.uring_depth);
+        if (ret < 0)
+            errx(1, "ERROR: io_uring setup failed: %s", strerror(-ret));
+    }
+
     // Initialize fuse
     fuse_args args = FUSE_ARGS_INIT(0, nullptr);
     if (fuse_opt_add_arg(&args, argv[0]) ||
@@ -1457,18 +1933,28 @@ int main(int argc, char *argv[]) {
     if (!fs.foreground)
         fuse_log_enable_syslog("passthrough-hp", LOG_PID | LOG_CONS, LOG_DAEMON);
 
+    uring_start();
+
     if (options.count("single"))
         ret = fuse_session_loop(se);
     else
         ret = fuse_session_loop_mt(se, loop_config);
 
+    uring_exit();
     fuse_session_unmount(se);
 
+    if (fs.debug) {
+        cerr << "DEBUG: " << fs.fsync_requests << " fsync requests, "
+             << fs.fsync_syncs << " syncs ("
+             << fs.fsync_requests - fs.fsync_syncs << " coalesced)" << endl;
+    }
+
 err_out3:
     fuse_remove_signal_handlers(se);
 err_out2:
     fuse_session_destroy(se);
 err_out1:
+    uring_exit();
 
     fuse_loop_cfg_destroy(loop_config);
     fuse_opt_free_args(&args);
@@ -69,8 +69,7 @@ struct _uintptr_to_must_hold_fuse_ino_t_dummy_struct \
 #endif
 
 struct lo_inode {
-	struct lo_inode *next; /* protected by lo->mutex */
-	struct lo_inode *prev; /* protected by lo->mutex */
+	struct lo_inode *hash_next; /* protected by lo->mutex */
 	int fd;
 	ino_t ino;
 	dev_t dev;
@@ -94,6 +93,10 @@ struct lo_data {
 	int cache;
 	int timeout_set;
 	struct lo_inode root; /* protected by lo->mutex */
+	/* Known inodes hashed by (st_ino, st_dev), protected by lo->mutex */
+	struct lo_inode **inodes;
+	size_t inodes_size;
+	size_t inodes_count;
 };
 
 static const struct fuse_opt lo_opts[] = {
@@ -190,12 +193,18 @@ static void lo_destroy(void *userdata)
 {
 	struct lo_data *lo = (struct lo_data*) userdata;
 
-	while (lo->root.next != &lo->root) {
-		struct lo_inode* next = lo->root.next;
-		lo->root.next = next->next;
-		close(next->fd);
-		free(next);
+	for (size_t i = 0; i < lo->inodes_size; i++) {
+		while (lo->inodes[i]) {
+			struct lo_inode *inode = lo->inodes[i];
+			lo->inodes[i] = inode->hash_next;
+			close(inode->fd);
+			free(inode);
+		}
 	}
+	free(lo->inodes);
+	lo->inodes = NULL;
+	lo->inodes_size = 0;
+	lo->inodes_count = 0;
 }
 
 static void lo_getattr(fuse_req_t req, fuse_ino_t ino,
@@ -289,24 +298,91 @@ out_err:
 	fuse_reply_err(req, saverr);
 }
 
-static struct lo_inode *lo_find(struct lo_data *lo, struct stat *st)
+static size_t lo_hash(struct lo_data *lo, ino_t ino, dev_t dev)
+{
+	uint64_t hash = ((uint64_t) ino ^ ((uint64_t) dev << 32)) *
+		0x9E3779B97F4A7C15ULL;
+
+	return (hash >> 32) & (lo->inodes_size - 1);
+}
+
+/* Must be called with lo->mutex held */
+static struct lo_inode *lo_find_locked(struct lo_data *lo, struct stat *st)
 {
 	struct lo_inode *p;
-	struct lo_inode *ret = NULL;
 
-	pthread_mutex_lock(&lo->mutex);
-	for (p = lo->root.next; p != &lo->root; p = p->next) {
+	if (!lo->inodes_size)
+		return NULL;
+
+	for (p = lo->inodes[lo_hash(lo, st->st_ino, st->st_dev)]; p;
+	     p = p->hash_next) {
 		if (p->ino == st->st_ino && p->dev == st->st_dev) {
 			assert(p->refcount > 0);
-			ret = p;
-			ret->refcount++;
-			break;
+			p->refcount++;
+			return p;
 		}
 	}
+	return NULL;
+}
+
+static struct lo_inode *lo_find(struct lo_data *lo, struct stat *st)
+{
+	struct lo_inode *ret;
+
+	pthread_mutex_lock(&lo->mutex);
+	ret = lo_find_locked(lo, st);
 	pthread_mutex_unlock(&lo->mutex);
 	return ret;
 }
 
+/* Must be called with lo->mutex held */
+static int lo_hash_add(struct lo_data *lo, struct lo_inode *inode)
+{
+	size_t slot;
+
+	if (lo->inodes_count >= lo->inodes_size) {
+		size_t old_size = lo->inodes_size;
+		size_t new_size = old_size ? old_size * 2 : 256;
+		struct lo_inode **old = lo->inodes;
+		struct lo_inode **table;
+
+		table = calloc(new_size, sizeof(table[0]));
+		if (!table)
+			return -1;
+
+		lo->inodes = table;
+		lo->inodes_size = new_size;
+		for (size_t i = 0; i < old_size; i++) {
+			while (old[i]) {
+				struct lo_inode *p = old[i];
+
+				old[i] = p->hash_next;
+				slot = lo_hash(lo, p->ino, p->dev);
+				p->hash_next = table[slot];
+				table[slot] = p;
+			}
+		}
+		free(old);
+	}
+
+	slot = lo_hash(lo, inode->ino, inode->dev);
+	inode->hash_next = lo->inodes[slot];
+	lo->inodes[slot] = inode;
+	lo->inodes_count++;
+	return 0;
+}
+
+/* Must be called with lo->mutex held */
+static void lo_hash_del(struct lo_data *lo, struct lo_inode *inode)
+{
+	struct lo_inode **pp = &lo->inodes[lo_hash(lo, inode->ino, inode->dev)];
+
+	while (*pp != inode)
+		pp = &(*pp)->hash_next;
+	*pp = inode->hash_next;
+	lo->inodes_count--;
+}
+
 static int lo_do_lookup(fuse_req_t req, fuse_ino_t parent, const char *name,
 			 struct fuse_entry_param *e)
 {
@@ -333,26 +409,36 @@ static int lo_do_lookup(fuse_req_t req, fuse_ino_t parent, const char *name,
 		close(newfd);
 		newfd = -1;
 	} else {
-		struct lo_inode *prev, *next;
+		struct lo_inode *new_inode;
 
 		saverr = ENOMEM;
-		inode = calloc(1, sizeof(struct lo_inode));
-		if (!inode)
+		new_inode = calloc(1, sizeof(struct lo_inode));
+		if (!new_inode)
 			goto out_err;
 
-		inode->refcount = 1;
-		inode->fd = newfd;
-		inode->ino = e->attr.st_ino;
-		inode->dev = e->attr.st_dev;
+		new_inode->refcount = 1;
+		new_inode->fd = newfd;
+		new_inode->ino = e->attr.st_ino;
+		new_inode->dev = e->attr.st_dev;
 
+		/* Another lookup may have added the inode in the meantime */
 		pthread_mutex_lock(&lo->mutex);
-		prev = &lo->root;
-		next = prev->next;
-		next->prev = inode;
-		inode->next = next;
-		inode->prev = prev;
-		prev->next = inode;
+		inode = lo_find_locked(lo, &e->attr);
+		if (!inode) {
+			if (lo_hash_add(lo, new_inode) == -1) {
+				pthread_mutex_unlock(&lo->mutex);
+				free(new_inode);
+				goto out_err;
+			}
+			inode = new_inode;
+			new_inode = NULL;
+		}
 		pthread_mutex_unlock(&lo->mutex);
+		if (new_inode) {
+			close(newfd);
+			free(new_inode);
+		}
+		newfd = -1;
 	}
 	e->ino = (uintptr_t) inode;
 
@@ -519,13 +605,7 @@ static void unref_inode(struct lo_data *lo, struct lo_inode *inode, uint64_t n)
 	assert(inode->refcount >= n);
 	inode->refcount -= n;
 	if (!inode->refcount) {
-		struct lo_inode *prev, *next;
-
-		prev = inode->prev;
-		next = inode->next;
-		next->prev = prev;
-		prev->next = next;
-
+		lo_hash_del(lo, inode);
 		pthread_mutex_unlock(&lo->mutex);
 		close(inode->fd);
 		free(inode);
@@ -1202,6 +1282,7 @@ int main(int argc, char *argv[])
 	struct fuse_session *se;
 	struct fuse_cmdline_opts opts;
 	struct fuse_loop_config *config;
+	struct fuse_prefetch_stats ra_stats;
 	struct lo_data lo = { .debug = 0,
 	                      .writeback = 0 };
 	int ret = -1;
@@ -1210,7 +1291,6 @@ int main(int argc, char *argv[])
 	umask(0);
 
 	pthread_mutex_init(&lo.mutex, NULL);
-	lo.root.next = lo.root.prev = &lo.root;
 	lo.root.fd = -1;
 	lo.cache = CACHE_NORMAL;
 
@@ -1315,6 +1395,17 @@ int main(int argc, char *argv[])
 		config = NULL;
 	}
 
+	/* Only reported if -o store_prefetch was used */
+	fuse_lowlevel_prefetch_stats(se, &ra_stats);
+	if (ra_stats.reads)
+		printf("prefetch: %llu reads, %llu bytes stored, "
+		       "%llu bytes discarded, %llu invalidated, %llu failed\n",
+		       (unsigned long long) ra_stats.reads,
+		       (unsigned long long) ra_stats.stored,
+		       (unsigned long long) ra_stats.discarded,
+		       (unsigned long long) ra_stats.invalidated,
+		       (unsigned long long) ra_stats.errors);
+
 	fuse_session_unmount(se);
 err_out3:
 	fuse_remove_signal_handlers(se);
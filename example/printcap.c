@@ -89,6 +89,8 @@ static void pc_init(void *userdata,
 			printf("\tFUSE_CAP_HANDLE_KILLPRIV_V2\n");
 	if(conn->capable & FUSE_CAP_DIRECT_IO_ALLOW_MMAP)
 			printf("\tFUSE_CAP_DIRECT_IO_ALLOW_MMAP\n");
+	if(conn->capable & FUSE_CAP_CREATE_SUPP_GROUP)
+			printf("\tFUSE_CAP_CREATE_SUPP_GROUP\n");
 	fuse_session_exit(se);
 }
 
@@ -36,6 +36,9 @@ extern "C" {
 /** Handle for a FUSE filesystem */
 struct fuse;
 
+/** Handle for an operation that completes asynchronously */
+struct fuse_async;
+
 /**
  * Readdir flags, passed to ->readdir()
  */
@@ -310,6 +313,99 @@ struct fuse_config {
 	 */
 	unsigned int fmask;
 	unsigned int dmask;
+
+	/**
+	 * Memory budget for the inode cache kept by the `remember`
+	 * and `noforget` options. If the number of nodes exceeds
+	 * `max_nodes`, or the memory used by nodes, their names and
+	 * their cached attributes exceeds `max_node_mem` bytes, nodes
+	 * that the kernel has already forgotten are evicted in
+	 * least-recently-used order. Nodes that are still referenced
+	 * by the kernel or by cached children are never evicted, so
+	 * the budget is a soft limit. A value of zero means no limit.
+	 */
+	unsigned int max_nodes;
+	unsigned long max_node_mem;
+
+	/**
+	 * Cache file attributes in the library for `attr_timeout`
+	 * seconds. Stat and lookup requests are then answered
+	 * without calling the `getattr` handler, which avoids
+	 * round-trips for network filesystems. Cached attributes are
+	 * invalidated by modifications done through the filesystem,
+	 * but not by changes made behind the library's back, so this
+	 * should only be used if such changes are rare or if
+	 * fuse_invalidate_path() is called for them.
+	 */
+	int attr_cache;
+
+	/**
+	 * Remember names that the filesystem reported as
+	 * non-existent for `neg_cache_timeout` seconds, independent of
+	 * the kernel's `negative_timeout`. Lookups of such names are
+	 * answered with ENOENT without calling the `getattr`
+	 * handler. At most `neg_cache_size` names are remembered, the
+	 * least recently added ones are dropped first. Entries are
+	 * invalidated when a name is created through the filesystem,
+	 * or by fuse_invalidate_path() for changes made behind the
+	 * library's back. A timeout of zero disables the cache.
+	 */
+	double neg_cache_timeout;
+	unsigned int neg_cache_size;
+
+	/**
+	 * Like `nullpath_ok`, but only for the data path: the read,
+	 * write and fsync operations are passed a NULL path, while all
+	 * other operations still get one. This suits filesystems that
+	 * need paths for metadata operations but do I/O on the file
+	 * handle, and saves the path lookup and the locking of the
+	 * directory tree on every read and write.
+	 */
+	int nullpath_data_ok;
+
+	/**
+	 * Don't read whole directories into memory before replying
+	 * to the first readdir request. Instead, the `readdir` handler
+	 * is run in a separate thread for each open directory, and is
+	 * paused by the filler function whenever a reply buffer is
+	 * full. This bounds the memory used per directory handle by
+	 * the size of a single reply, at the cost of one thread per
+	 * directory being read. Seeking to anything but the offset
+	 * following the last returned entry restarts the listing.
+	 *
+	 * Filesystems that pass non-zero offsets to the filler
+	 * function are restarted at the requested offset, and
+	 * entries before it are skipped otherwise.
+	 */
+	int readdir_stream;
+
+	/**
+	 * Keep complete directory listings in the library, and reuse
+	 * them for later opens of the directory as long as its mtime
+	 * is unchanged. The mtime is refreshed on opendir if it is
+	 * older than `ac_attr_timeout` seconds. Open directories are
+	 * marked with `cache_readdir`, and with `keep_cache` if the
+	 * cached listing is still valid, so that the kernel can cache
+	 * them as well. Listings are dropped by local modifications of
+	 * the directory and when the directory's inode is forgotten.
+	 *
+	 * This only applies to filesystems that pass zero offsets to
+	 * the filler function, and is ignored with `readdir_stream`.
+	 */
+	int readdir_cache;
+
+	/**
+	 * Number of threads used to look up directory entries in
+	 * parallel for readdirplus. If the filesystem doesn't pass
+	 * attributes to the filler function, the library looks up the
+	 * entries that fit into each reply itself, so that the kernel
+	 * doesn't have to send a separate lookup for each of them.
+	 * Zero disables this.
+	 *
+	 * Like `readdir_cache`, this only applies to filesystems that
+	 * pass zero offsets to the filler function.
+	 */
+	unsigned int readdirplus_prefetch;
 };
 
 
@@ -839,6 +935,49 @@ struct fuse_operations {
 	 * Find next data or hole after the specified offset
 	 */
 	off_t (*lseek) (const char *, off_t off, int whence, struct fuse_file_info *);
+
+	/**
+	 * Asynchronous variants of getattr, read, write and readdir
+	 *
+	 * If one of these is implemented, it is called instead of the
+	 * corresponding synchronous operation when handling a request
+	 * from the kernel; getattr_async is also used for lookups.
+	 * Instead of blocking until the result is known, the method
+	 * may start the operation and return 0.  The result is then
+	 * passed to fuse_async_done(), which may be called from any
+	 * thread, and also before the method has returned.  The
+	 * arguments (path, buffers, file info and, for readdir, the
+	 * filler and its buffer) remain valid until then.  The return
+	 * value and the result passed to fuse_async_done() have the
+	 * same meaning as the return value of the synchronous
+	 * operation.
+	 *
+	 * If the method returns a negated error value instead, the
+	 * request fails with that error and fuse_async_done() must not
+	 * be called.
+	 *
+	 * The path of the node stays locked until the operation has
+	 * completed, as it would be while a synchronous operation is
+	 * running.  Interrupts are not delivered to the operation, it
+	 * may poll fuse_async_interrupted() instead.
+	 *
+	 * The synchronous operations are still used where the library
+	 * needs the result right away (e.g. getattr after creating a
+	 * file) and by stacked modules, so they should be implemented
+	 * as well.  readdir_async is not used with the readdir_stream
+	 * option.
+	 */
+	int (*getattr_async) (const char *, struct stat *,
+			      struct fuse_file_info *fi,
+			      struct fuse_async *async);
+	int (*read_async) (const char *, char *, size_t, off_t,
+			   struct fuse_file_info *, struct fuse_async *async);
+	int (*write_async) (const char *, const char *, size_t, off_t,
+			    struct fuse_file_info *, struct fuse_async *async);
+	int (*readdir_async) (const char *, void *, fuse_fill_dir_t, off_t,
+			      struct fuse_file_info *,
+			      enum fuse_readdir_flags,
+			      struct fuse_async *async);
 };
 
 /** Extra context that may be needed by some filesystems
@@ -1196,10 +1335,34 @@ int fuse_getgroups(int size, gid_t list[]);
  */
 int fuse_interrupted(void);
 
+/**
+ * Complete an asynchronous operation
+ *
+ * Finishes an operation started by one of the *_async methods of
+ * struct fuse_operations and replies to the kernel.  Must be called
+ * exactly once for every such method that returned 0.  The handle is
+ * invalid afterwards.
+ *
+ * @param async the handle passed to the method
+ * @param res result of the operation, as it would have been returned
+ *            by the synchronous method
+ */
+void fuse_async_done(struct fuse_async *async, int res);
+
+/**
+ * Check if the request of an asynchronous operation has been interrupted
+ *
+ * @param async the handle passed to the *_async method
+ * @return 1 if the request has been interrupted, 0 otherwise
+ */
+int fuse_async_interrupted(struct fuse_async *async);
+
 /**
  * Invalidates cache for the given path.
  *
- * This calls fuse_lowlevel_notify_inval_inode internally.
+ * This calls fuse_lowlevel_notify_inval_inode internally. If the path
+ * is not known, a negative entry cached for it (see
+ * `neg_cache_timeout`) is dropped instead.
  *
  * @return 0 on successful invalidation, negative error value otherwise.
  *         This routine may return -ENOENT to indicate that there was
@@ -1237,6 +1400,61 @@ void fuse_stop_cleanup_thread(struct fuse *fuse);
  */
 int fuse_clean_cache(struct fuse *fuse);
 
+/**
+ * Statistics about the internal state of the high-level library
+ *
+ * Note: this data structure is ABI sensitive, new fields have to be
+ * appended at the end of the structure
+ */
+struct fuse_stats {
+	/** Number of nodes currently allocated (including the root) */
+	uint64_t nodes;
+
+	/** Bytes allocated for node names that don't fit inline */
+	uint64_t name_bytes;
+
+	/** Nodes evicted to stay within max_nodes/max_node_mem */
+	uint64_t evictions;
+
+	/** Number of lock-holding batches run by fuse_clean_cache() */
+	uint64_t clean_batches;
+
+	/** Longest time the lock was held by a single batch, in ns */
+	uint64_t clean_max_hold_ns;
+
+	/** Number of FORGET entries processed */
+	uint64_t forgets;
+
+	/** Number of FORGET and BATCH_FORGET requests processed */
+	uint64_t forget_batches;
+
+	/** Attribute requests served from the attribute cache */
+	uint64_t attr_hits;
+
+	/** Attribute requests that had to be passed to the filesystem */
+	uint64_t attr_misses;
+
+	/** Number of names currently in the negative entry cache */
+	uint64_t neg_entries;
+
+	/** Lookups answered with ENOENT from the negative entry cache */
+	uint64_t neg_hits;
+
+	/** Directory listings served from the readdir cache */
+	uint64_t dir_hits;
+
+	/** Forgotten nodes freed by the background reclaimer */
+	uint64_t reclaimed;
+};
+
+/**
+ * Get a snapshot of the statistics of a fuse instance
+ *
+ * @param fuse struct fuse pointer for fuse instance
+ * @param stats the statistics are stored here
+ */
+void fuse_get_stats(struct fuse *fuse, struct fuse_stats *stats);
+
 /*
  * Stacking API
  */
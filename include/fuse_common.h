@@ -489,6 +489,19 @@ struct fuse_loop_config_v1 {
  */
 #define FUSE_CAP_PASSTHROUGH      (1 << 29)
 
+/**
+ * Indicates that the kernel can tell which supplementary group of the
+ * caller applies to a new inode.
+ *
+ * If enabled, create, mknod, mkdir and symlink requests carry the
+ * group of the parent directory if the caller is a member of it
+ * through its supplementary groups, and fuse_req_getgroups() returns
+ * only that group for these requests, without consulting /proc.
+ *
+ * This feature is disabled by default.
+ */
+#define FUSE_CAP_CREATE_SUPP_GROUP (1 << 30)
+
 /**
  * Ioctl flags
  *
@@ -1413,6 +1413,69 @@ int fuse_reply_readlink(fuse_req_t req, const char *link);
 int fuse_passthrough_open(fuse_req_t req, int fd);
 int fuse_passthrough_close(fuse_req_t req, int backing_id);
 
+/**
+ * Setup a shared passthrough backing file for open reply
+ *
+ * The kernel uses a single backing file for all passthrough opens of
+ * an inode.  This function keeps track of it: on the first call for
+ * @a ino, @a fd is registered with fuse_passthrough_open(); later
+ * calls reuse the same backing id.  Each call takes a reference for
+ * the open file identified by fi->fh, which must be set before and be
+ * unique among the open files of the inode.  The reference is dropped
+ * by the library when the file is released, and the backing file is
+ * closed with fuse_passthrough_close() when the last one is dropped.
+ *
+ * On success fi->backing_id is set.  The request must then be
+ * answered with fuse_reply_open() or fuse_reply_create(), since
+ * otherwise the kernel will never release the file.
+ *
+ * Possible requests:
+ *   open, create
+ *
+ * @param req request handle
+ * @param ino the inode number
+ * @param fd backing file descriptor, used if no backing file is
+ *           registered for the inode yet
+ * @param fi file information
+ * @return positive backing id for success, 0 for failure
+ */
+int fuse_passthrough_open_inode(fuse_req_t req, fuse_ino_t ino, int fd,
+				struct fuse_file_info *fi);
+
+/**
+ * Statistics of the backing files managed by
+ * fuse_passthrough_open_inode()
+ */
+struct fuse_passthrough_stats {
+	/** Backing files currently open */
+	uint64_t active;
+
+	/** Open files currently using one of them */
+	uint64_t refs;
+
+	/** Backing files opened */
+	uint64_t opened;
+
+	/** Opens that reused an already open backing file */
+	uint64_t shared;
+
+	/** Backing files closed after their last release */
+	uint64_t closed;
+
+	/** Failures to open or close a backing file */
+	uint64_t errors;
+};
+
+/**
+ * Get statistics of the backing files managed by
+ * fuse_passthrough_open_inode()
+ *
+ * @param se the session object
+ * @param stats the statistics are stored here
+ */
+void fuse_passthrough_stats(struct fuse_session *se,
+			    struct fuse_passthrough_stats *stats);
+
 /**
  * Reply with open parameters
  *
@@ -1807,6 +1870,161 @@ int fuse_lowlevel_notify_delete(struct fuse_session *se,
 				fuse_ino_t parent, fuse_ino_t child,
 				const char *name, size_t namelen);
 
+/**
+ * Statistics of the asynchronous notification queue
+ *
+ * See fuse_lowlevel_notify_stats().
+ */
+struct fuse_notify_stats {
+	/** Notifications added to the queue */
+	uint64_t queued;
+
+	/** Notifications merged into one that was already pending */
+	uint64_t coalesced;
+
+	/** Notifications written to the kernel */
+	uint64_t sent;
+
+	/** Notifications for which the kernel returned an error */
+	uint64_t errors;
+
+	/** Notifications rejected with -EAGAIN because the queue was full */
+	uint64_t full;
+
+	/** Notifications currently pending */
+	uint64_t pending;
+
+	/** Highest number of notifications pending at the same time */
+	uint64_t max_pending;
+};
+
+/**
+ * Queue an inode invalidation
+ *
+ * Like fuse_lowlevel_notify_inval_inode(), but the notification is
+ * added to a queue owned by the session and written to the kernel
+ * by a separate thread.  This function never blocks on the kernel,
+ * so it may also be called while executing a filesystem operation
+ * on the same inode.
+ *
+ * If an invalidation of the same inode is already pending, the two
+ * are merged: the byte ranges are replaced by a single range covering
+ * both.
+ *
+ * The size of the queue is set with the "notify_queue_size" session
+ * option (default: 4096).
+ *
+ * fuse_session_destroy() stops the queue before calling the destroy
+ * handler.  Notifications still pending are discarded, and later ones
+ * are rejected with -ENOTCONN.
+ *
+ * @param se the session object
+ * @param ino the inode number
+ * @param off the offset in the inode where to start invalidating
+ *            or negative to invalidate attributes only
+ * @param len the amount of cache to invalidate or 0 for all
+ * @return zero for success, -EAGAIN if the queue is full, -ENOSYS if
+ *         the kernel does not support the notification, -errno for
+ *         other failures
+ */
+int fuse_lowlevel_notify_inval_inode_async(struct fuse_session *se,
+					   fuse_ino_t ino, off_t off,
+					   off_t len);
+
+/**
+ * Queue a directory entry invalidation
+ *
+ * Like fuse_lowlevel_notify_inval_entry(), but asynchronous (see
+ * fuse_lowlevel_notify_inval_inode_async()).  Nothing is queued if an
+ * invalidation or deletion of the same entry is already pending.
+ *
+ * @param se the session object
+ * @param parent inode number
+ * @param name file name
+ * @param namelen strlen() of file name
+ * @return zero for success, -errno for failure (see
+ *         fuse_lowlevel_notify_inval_inode_async())
+ */
+int fuse_lowlevel_notify_inval_entry_async(struct fuse_session *se,
+					   fuse_ino_t parent,
+					   const char *name, size_t namelen);
+
+/**
+ * Queue a directory entry deletion
+ *
+ * Like fuse_lowlevel_notify_delete(), but asynchronous (see
+ * fuse_lowlevel_notify_inval_inode_async()).  A pending invalidation
+ * of the same entry is turned into the deletion, and nothing is
+ * queued if the same deletion is already pending.
+ *
+ * @param se the session object
+ * @param parent inode number
+ * @param child inode number
+ * @param name file name
+ * @param namelen strlen() of file name
+ * @return zero for success, -errno for failure (see
+ *         fuse_lowlevel_notify_inval_inode_async())
+ */
+int fuse_lowlevel_notify_delete_async(struct fuse_session *se,
+				      fuse_ino_t parent, fuse_ino_t child,
+				      const char *name, size_t namelen);
+
+/**
+ * Wait until all queued notifications have been sent
+ *
+ * Must not be called while executing a filesystem operation, since
+ * sending the notifications may have to wait for that operation to
+ * complete.
+ *
+ * @param se the session object
+ */
+void fuse_lowlevel_notify_flush(struct fuse_session *se);
+
+/**
+ * Get statistics of the asynchronous notification queue
+ *
+ * @param se the session object
+ * @param stats the statistics are stored here
+ */
+void fuse_lowlevel_notify_stats(struct fuse_session *se,
+				struct fuse_notify_stats *stats);
+
+/**
+ * Statistics of the sequential read prefetch (-o store_prefetch)
+ *
+ * Prefetch is disabled if FUSE_CAP_WRITEBACK_CACHE is enabled, since
+ * stored data could replace dirty pages that haven't been written
+ * back yet.
+ *
+ * See fuse_lowlevel_prefetch_stats().
+ */
+struct fuse_prefetch_stats {
+	/** Reads sent to the filesystem ahead of the kernel */
+	uint64_t reads;
+
+	/** Bytes pushed into the page cache */
+	uint64_t stored;
+
+	/** Bytes read but not stored, since the file changed meanwhile */
+	uint64_t discarded;
+
+	/** Stores that raced with a write or truncation and were
+	    invalidated again */
+	uint64_t invalidated;
+
+	/** Reads or stores that failed */
+	uint64_t errors;
+};
+
+/**
+ * Get statistics of the sequential read prefetch
+ *
+ * @param se the session object
+ * @param stats the statistics are stored here
+ */
+void fuse_lowlevel_prefetch_stats(struct fuse_session *se,
+				  struct fuse_prefetch_stats *stats);
+
 /**
  * Store data to the kernel buffers
  *
@@ -1867,6 +2085,55 @@ int fuse_lowlevel_notify_store(struct fuse_session *se, fuse_ino_t ino,
 int fuse_lowlevel_notify_retrieve(struct fuse_session *se, fuse_ino_t ino,
 				  size_t size, off_t offset, void *cookie);
 
+/**
+ * Callback function for fuse_lowlevel_notify_retrieve_cb()
+ *
+ * If the data was retrieved, @a error is zero and @a bufv contains
+ * the data.  If the session is spliced, the data is still in a pipe
+ * and can be moved to its destination with fuse_buf_copy() without
+ * copying it through memory.  The buffer is only valid until the
+ * callback returns.
+ *
+ * Otherwise @a bufv is NULL and @a error is negative, e.g. -ENOTCONN
+ * if the session was destroyed before the kernel replied.
+ *
+ * @param cookie user data supplied to fuse_lowlevel_notify_retrieve_cb()
+ * @param ino the inode number supplied to fuse_lowlevel_notify_retrieve_cb()
+ * @param offset the offset of the returned data
+ * @param error zero for success, -errno for failure
+ * @param bufv the buffer containing the returned data
+ */
+typedef void (*fuse_retrieve_func_t)(void *cookie, fuse_ino_t ino,
+				     off_t offset, int error,
+				     struct fuse_bufvec *bufv);
+
+/**
+ * Retrieve data from the kernel buffers, with a completion callback
+ *
+ * Like fuse_lowlevel_notify_retrieve(), but instead of the
+ * retrieve_reply() method, @a func is called with the returned data.
+ * Any number of retrieves may be outstanding at the same time; replies
+ * are matched to their retrieve in constant time and may be processed
+ * in parallel by the worker threads of a multi-threaded session.
+ *
+ * If this function returns zero, @a func is called exactly once.
+ *
+ * Added in FUSE protocol version 7.15. If the kernel does not support
+ * this (or a newer) version, the function will return -ENOSYS and do
+ * nothing.
+ *
+ * @param se the session object
+ * @param ino the inode number
+ * @param size the number of bytes to retrieve
+ * @param offset the starting offset into the file to retrieve from
+ * @param func the completion callback
+ * @param cookie user data to supply to the completion callback
+ * @return zero for success, -errno for failure
+ */
+int fuse_lowlevel_notify_retrieve_cb(struct fuse_session *se, fuse_ino_t ino,
+				     size_t size, off_t offset,
+				     fuse_retrieve_func_t func, void *cookie);
+
 
 /* ----------------------------------------------------------- *
  * Utility functions					       *
@@ -1900,7 +2167,14 @@ const struct fuse_ctx *fuse_req_ctx(fuse_req_t req);
  *
  * The current fuse kernel module in linux (as of 2.6.30) doesn't pass
  * the group list to userspace, hence this function needs to parse
- * "/proc/$TID/task/$TID/status" to get the group IDs.
+ * "/proc/$TID/task/$TID/status" to get the group IDs. With the
+ * `groups_cache_timeout=T` option, the result is cached per process
+ * for T seconds.
+ *
+ * If FUSE_CAP_CREATE_SUPP_GROUP is enabled, create, mknod, mkdir and
+ * symlink requests instead return the group passed by the kernel,
+ * which is the parent directory's group if the caller is a member of
+ * it through its supplementary groups, or no group at all.
  *
  * This feature may not be supported on all operating systems.  In
  * such a case this function will return -ENOSYS.
@@ -53,6 +53,15 @@
 
 #define NODE_TABLE_MIN_SIZE 8192
 
+/* Max number of LRU entries to look at per node budget check */
+#define NODE_BUDGET_SCAN 64
+
+/* Max number of LRU entries to expire while holding the lock */
+#define CLEAN_BATCH_SIZE 256
+
+/* Max number of nodes the reclaimer frees while holding the lock */
+#define RECLAIM_BATCH_SIZE 256
+
 struct fuse_fs {
 	struct fuse_operations op;
 	void *user_data;
@@ -104,6 +113,45 @@ struct node_slab {
 	int used;
 };
 
+struct neg_entry {
+	struct neg_entry *hash_next;
+	struct list_head lru;
+	fuse_ino_t parent;
+	struct timespec stamp;
+	char name[];
+};
+
+struct neg_table {
+	struct neg_entry **array;
+	size_t size;
+	size_t use;
+	struct list_head lru;
+	uint64_t epoch;
+	uint64_t hits;
+};
+
+struct prefetch_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_cond_t done_cond;
+	struct list_head batches;
+	pthread_t *threads;
+	int nthreads;
+	int started;
+	int exit;
+};
+
+/* Nodes waiting to be freed by the reclaimer, protected by f->lock */
+struct node_reclaim {
+	pthread_cond_t cond;
+	struct node *nodes;
+	uint64_t pending;
+	uint64_t freed;
+	pthread_t thread;
+	int started;
+	int running;
+};
+
 struct fuse {
 	struct fuse_session *se;
 	struct node_table name_table;
@@ -120,7 +168,24 @@ struct fuse {
 	int pagesize;
 	struct list_head partial_slabs;
 	struct list_head full_slabs;
+	struct list_head empty_slabs;
 	pthread_t prune_thread;
+	uint64_t nodes;
+	uint64_t name_bytes;
+	uint64_t evictions;
+	uint64_t forgets;
+	uint64_t forget_batches;
+	uint64_t clean_batches;
+	uint64_t clean_max_hold_ns;
+	uint64_t attr_epoch;
+	uint64_t attr_nodes;
+	uint64_t attr_hits;
+	uint64_t attr_misses;
+	struct neg_table neg_table;
+	uint64_t dir_epoch;
+	uint64_t dir_hits;
+	struct prefetch_pool prefetch;
+	struct node_reclaim reclaim;
 };
 
 struct lock {
@@ -130,6 +195,10 @@ struct lock {
 	pid_t pid;
 	uint64_t owner;
 	struct lock *next;
+	struct lock *left;
+	struct lock *right;
+	off_t maxend;
+	unsigned int prio;
 };
 
 struct node {
@@ -146,12 +215,20 @@ struct node {
 	struct timespec mtime;
 	off_t size;
 	struct lock *locks;
+	struct node_attr *attr;
+	struct dir_cache *dir;
 	unsigned int is_hidden : 1;
 	unsigned int cache_valid : 1;
+	unsigned int attr_valid : 1;
 	int treelock;
 	char inline_name[32];
 };
 
+struct node_attr {
+	struct stat stat;
+	struct timespec updated;
+};
+
 #define TREELOCK_WRITE -1
 #define TREELOCK_WAIT_OFFSET INT_MIN
 
@@ -164,9 +241,18 @@ struct node_lru {
 struct fuse_direntry {
 	struct stat stat;
 	char *name;
+	int attr_valid;
 	struct fuse_direntry *next;
 };
 
+/* Directory listing shared by a node and the handles reading it */
+struct dir_cache {
+	int refctr;
+	struct timespec mtime;
+	enum fuse_readdir_flags flags;
+	struct fuse_direntry *first;
+};
+
 struct fuse_dh {
 	pthread_mutex_t lock;
 	struct fuse *fuse;
@@ -181,6 +267,35 @@ struct fuse_dh {
 	uint64_t fh;
 	int error;
 	fuse_ino_t nodeid;
+
+	/* -o readdir_cache */
+	struct dir_cache *dir;
+	struct timespec mtime;
+	int mtime_valid;
+
+	/* -o readdir_stream */
+	int stream_state;
+	int stream_cancel;
+	pthread_t stream_thread;
+	pthread_cond_t stream_cond;
+	char *stream_path;
+	struct fuse_file_info stream_fi;
+	enum fuse_readdir_flags stream_flags;
+	struct fuse_context stream_ctx;
+	off_t stream_skip;
+	off_t stream_next;
+	off_t stream_pos;
+
+	/* readdir_async in progress, the entries are being filled */
+	int async_busy;
+	pthread_cond_t async_cond;
+};
+
+enum {
+	STREAM_NONE,	/* no reader thread */
+	STREAM_FULL,	/* reader waiting for the next request */
+	STREAM_FILL,	/* reader filling dh->contents */
+	STREAM_DONE,	/* filesystem's readdir returned */
 };
 
 struct fuse_context_i {
@@ -383,9 +498,15 @@ static inline void list_del(struct list_head *entry)
 	prev->next = next;
 }
 
+static inline int node_budget_enabled(struct fuse *f)
+{
+	return f->conf.max_nodes || f->conf.max_node_mem;
+}
+
 static inline int lru_enabled(struct fuse *f)
 {
-	return f->conf.remember > 0;
+	return f->conf.remember > 0 ||
+		(f->conf.remember < 0 && node_budget_enabled(f));
 }
 
 static struct node_lru *node_lru(struct node *node)
@@ -450,9 +571,13 @@ static struct node *alloc_node(struct fuse *f)
 	struct list_head *node;
 
 	if (list_empty(&f->partial_slabs)) {
-		int res = alloc_slab(f);
-		if (res != 0)
+		if (!list_empty(&f->empty_slabs)) {
+			slab = list_to_slab(f->empty_slabs.next);
+			list_del(&slab->list);
+			list_add_tail(&slab->list, &f->partial_slabs);
+		} else if (alloc_slab(f) != 0) {
 			return NULL;
+		}
 	}
 	slab = list_to_slab(f->partial_slabs.next);
 	slab->used++;
@@ -463,6 +588,7 @@ static struct node *alloc_node(struct fuse *f)
 		list_add_tail(&slab->list, &f->full_slabs);
 	}
 	memset(node, 0, sizeof(struct node));
+	f->nodes++;
 
 	return (struct node *) node;
 }
@@ -478,33 +604,68 @@ static void free_slab(struct fuse *f, struct node_slab *slab)
 			 slab);
 }
 
+/*
+ * Empty slabs are not unmapped by free_node_mem(), because that is
+ * called with f->lock held, possibly many times in a row for a batch
+ * of forgets.  They are parked on the empty_slabs list instead, where
+ * they can be reused by alloc_node(), and unmapped later by this
+ * function outside of the lock.
+ */
+static void release_empty_slabs(struct fuse *f)
+{
+	struct list_head empty;
+
+	init_list_head(&empty);
+	pthread_mutex_lock(&f->lock);
+	while (!list_empty(&f->empty_slabs)) {
+		struct list_head *curr = f->empty_slabs.next;
+
+		list_del(curr);
+		list_add_tail(curr, &empty);
+	}
+	pthread_mutex_unlock(&f->lock);
+
+	while (!list_empty(&empty))
+		free_slab(f, list_to_slab(empty.next));
+}
+
 static void free_node_mem(struct fuse *f, struct node *node)
 {
 	struct node_slab *slab = node_to_slab(f, node);
 	struct list_head *n = (struct list_head *) node;
 
+	f->nodes--;
 	slab->used--;
-	if (slab->used) {
-		if (list_empty(&slab->freelist)) {
-			list_del(&slab->list);
-			list_add_tail(&slab->list, &f->partial_slabs);
-		}
-		list_add_head(n, &slab->freelist);
-	} else {
-		free_slab(f, slab);
+	if (list_empty(&slab->freelist)) {
+		list_del(&slab->list);
+		list_add_tail(&slab->list, &f->partial_slabs);
+	}
+	list_add_head(n, &slab->freelist);
+	if (!slab->used) {
+		list_del(&slab->list);
+		list_add_tail(&slab->list, &f->empty_slabs);
 	}
 }
 #else
 static struct node *alloc_node(struct fuse *f)
 {
-	return (struct node *) calloc(1, get_node_size(f));
+	struct node *node = (struct node *) calloc(1, get_node_size(f));
+
+	if (node)
+		f->nodes++;
+	return node;
 }
 
 static void free_node_mem(struct fuse *f, struct node *node)
 {
-	(void) f;
+	f->nodes--;
 	free(node);
 }
+
+static void release_empty_slabs(struct fuse *f)
+{
+	(void) f;
+}
 #endif
 
 static size_t id_hash(struct fuse *f, fuse_ino_t ino)
@@ -544,6 +705,7 @@ static struct node *get_node(struct fuse *f, fuse_ino_t nodeid)
 static void curr_time(struct timespec *now);
 static double diff_timespec(const struct timespec *t1,
 			   const struct timespec *t2);
+static void drop_dir_cache(struct fuse *f, struct node *node);
 
 static void remove_node_lru(struct node *node)
 {
@@ -561,10 +723,23 @@ static void set_forget_time(struct fuse *f, struct node *node)
 	curr_time(&lnode->forget_time);
 }
 
-static void free_node(struct fuse *f, struct node *node)
+static void free_node_name(struct fuse *f, struct node *node)
 {
-	if (node->name != node->inline_name)
+	if (node->name != node->inline_name) {
+		if (node->name)
+			f->name_bytes -= strlen(node->name) + 1;
 		free(node->name);
+	}
+}
+
+static void free_node(struct fuse *f, struct node *node)
+{
+	free_node_name(f, node);
+	if (node->attr) {
+		free(node->attr);
+		f->attr_nodes--;
+	}
+	drop_dir_cache(f, node);
 	free_node_mem(f, node);
 }
 
@@ -738,8 +913,7 @@ static void unhash_name(struct fuse *f, struct node *node)
 				*nodep = node->name_next;
 				node->name_next = NULL;
 				unref_node(f, node->parent);
-				if (node->name != node->inline_name)
-					free(node->name);
+				free_node_name(f, node);
 				node->name = NULL;
 				node->parent = NULL;
 				f->name_table.use--;
@@ -796,6 +970,7 @@ static int hash_name(struct fuse *f, struct node *node, fuse_ino_t parentid,
 		node->name = strdup(name);
 		if (node->name == NULL)
 			return -1;
+		f->name_bytes += strlen(name) + 1;
 	}
 
 	parent->refctr ++;
@@ -821,7 +996,15 @@ static void delete_node(struct fuse *f, struct node *node)
 	if (lru_enabled(f))
 		remove_node_lru(node);
 	unhash_id(f, node);
-	free_node(f, node);
+	if (f->reclaim.running) {
+		/* Can no longer be found, free it in node_reclaimer() */
+		node->id_next = f->reclaim.nodes;
+		f->reclaim.nodes = node;
+		f->reclaim.pending++;
+		pthread_cond_signal(&f->reclaim.cond);
+	} else {
+		free_node(f, node);
+	}
 }
 
 static void unref_node(struct fuse *f, struct node *node)
@@ -864,12 +1047,62 @@ static void inc_nlookup(struct node *node)
 	node->nlookup++;
 }
 
-static struct node *find_node(struct fuse *f, fuse_ino_t parent,
-			      const char *name)
+static void forget_lru_node(struct fuse *f, struct node *node)
+{
+	assert(node->nlookup == 1);
+	node->nlookup = 0;
+	unhash_name(f, node);
+	unref_node(f, node);
+}
+
+static int node_over_budget(struct fuse *f)
+{
+	/* Nodes waiting for the reclaimer are already gone */
+	uint64_t nodes = f->nodes - f->reclaim.pending;
+
+	if (f->conf.max_nodes && nodes > f->conf.max_nodes)
+		return 1;
+	if (f->conf.max_node_mem &&
+	    nodes * get_node_size(f) + f->name_bytes +
+	    f->attr_nodes * sizeof(struct node_attr) > f->conf.max_node_mem)
+		return 1;
+	return 0;
+}
+
+/*
+ * Evict nodes that are only kept by "remember"/"noforget", oldest
+ * first, until the node cache is back within its budget.  Only a
+ * bounded number of LRU entries is looked at, so that nodes pinned by
+ * cached children don't make every call walk the whole list.
+ */
+static void prune_node_budget(struct fuse *f)
+{
+	struct list_head *curr, *next;
+	int scan = NODE_BUDGET_SCAN;
+
+	if (!node_budget_enabled(f) || !lru_enabled(f))
+		return;
+
+	for (curr = f->lru_table.next;
+	     curr != &f->lru_table && scan && node_over_budget(f);
+	     curr = next, scan--) {
+		struct node *node = &list_entry(curr, struct node_lru, lru)->node;
+
+		next = curr->next;
+		/* Don't forget active directories */
+		if (node->refctr > 1 || node->treelock)
+			continue;
+
+		forget_lru_node(f, node);
+		f->evictions++;
+	}
+}
+
+static struct node *find_node_locked(struct fuse *f, fuse_ino_t parent,
+				     const char *name)
 {
 	struct node *node;
 
-	pthread_mutex_lock(&f->lock);
 	if (!name)
 		node = get_node(f, parent);
 	else
@@ -894,15 +1127,198 @@ static struct node *find_node(struct fuse *f, fuse_ino_t parent,
 			struct node_lru *lnode = node_lru(node);
 			init_list_head(&lnode->lru);
 		}
+		prune_node_budget(f);
 	} else if (lru_enabled(f) && node->nlookup == 1) {
 		remove_node_lru(node);
 	}
 	inc_nlookup(node);
 out_err:
+	return node;
+}
+
+static struct node *find_node(struct fuse *f, fuse_ino_t parent,
+			      const char *name)
+{
+	struct node *node;
+
+	pthread_mutex_lock(&f->lock);
+	node = find_node_locked(f, parent, name);
 	pthread_mutex_unlock(&f->lock);
 	return node;
 }
 
+/*
+ * Negative entry cache (-o neg_cache_timeout=T)
+ *
+ * Names for which the filesystem returned ENOENT are remembered per
+ * parent, so that repeated lookups of non-existent names don't have
+ * to go to the filesystem.  The table has a fixed number of buckets
+ * and holds at most neg_cache_size entries, the oldest entry is
+ * dropped when it's full.  As with the attribute cache, an epoch
+ * counter makes sure that a lookup racing with the creation of the
+ * same name can't add a stale entry.
+ *
+ * The table is allocated after the filesystem's init() method has
+ * run, so that it can enable the cache by setting neg_cache_timeout.
+ * If that fails, the cache stays disabled.
+ */
+static void neg_table_init(struct fuse *f)
+{
+	struct neg_table *t = &f->neg_table;
+
+	if (f->conf.neg_cache_timeout <= 0 || !f->conf.neg_cache_size)
+		return;
+
+	t->size = 16;
+	while (t->size < f->conf.neg_cache_size)
+		t->size *= 2;
+	t->array = (struct neg_entry **)
+		calloc(1, sizeof(struct neg_entry *) * t->size);
+	if (t->array == NULL)
+		fuse_log(FUSE_LOG_ERR, "fuse: memory allocation failed\n");
+}
+
+static void neg_table_destroy(struct neg_table *t)
+{
+	while (!list_empty(&t->lru)) {
+		struct neg_entry *ent =
+			list_entry(t->lru.next, struct neg_entry, lru);
+
+		list_del(&ent->lru);
+		free(ent);
+	}
+	free(t->array);
+}
+
+static struct neg_entry **neg_find(struct neg_table *t, fuse_ino_t parent,
+				   const char *name)
+{
+	uint64_t hash = parent;
+	const char *s;
+	struct neg_entry **entp;
+
+	for (s = name; *s; s++)
+		hash = hash * 31 + (unsigned char) *s;
+
+	for (entp = &t->array[hash & (t->size - 1)]; *entp;
+	     entp = &(*entp)->hash_next) {
+		if ((*entp)->parent == parent &&
+		    strcmp((*entp)->name, name) == 0)
+			break;
+	}
+	return entp;
+}
+
+static void neg_remove(struct neg_table *t, struct neg_entry **entp)
+{
+	struct neg_entry *ent = *entp;
+
+	*entp = ent->hash_next;
+	list_del(&ent->lru);
+	t->use--;
+	free(ent);
+}
+
+static uint64_t neg_cache_epoch(struct fuse *f)
+{
+	uint64_t epoch;
+
+	if (f->neg_table.array == NULL)
+		return 0;
+
+	pthread_mutex_lock(&f->lock);
+	epoch = f->neg_table.epoch;
+	pthread_mutex_unlock(&f->lock);
+	return epoch;
+}
+
+/* Returns 1 if name is known not to exist in parent */
+static int neg_cache_lookup(struct fuse *f, fuse_ino_t parent,
+			    const char *name)
+{
+	struct neg_table *t = &f->neg_table;
+	struct neg_entry **entp;
+	struct timespec now;
+	int found = 0;
+
+	if (t->array == NULL)
+		return 0;
+
+	pthread_mutex_lock(&f->lock);
+	entp = neg_find(t, parent, name);
+	if (*entp) {
+		curr_time(&now);
+		if (diff_timespec(&now, &(*entp)->stamp) <
+		    f->conf.neg_cache_timeout) {
+			t->hits++;
+			found = 1;
+		} else {
+			neg_remove(t, entp);
+		}
+	}
+	pthread_mutex_unlock(&f->lock);
+	return found;
+}
+
+static void neg_cache_add(struct fuse *f, fuse_ino_t parent,
+			  const char *name, uint64_t epoch)
+{
+	struct neg_table *t = &f->neg_table;
+	struct neg_entry **entp;
+	struct neg_entry *ent;
+
+	if (t->array == NULL)
+		return;
+
+	pthread_mutex_lock(&f->lock);
+	if (epoch != t->epoch)
+		goto out;
+
+	entp = neg_find(t, parent, name);
+	if (*entp) {
+		ent = *entp;
+		list_del(&ent->lru);
+	} else {
+		if (t->use >= f->conf.neg_cache_size) {
+			struct neg_entry *old =
+				list_entry(t->lru.next, struct neg_entry, lru);
+
+			neg_remove(t, neg_find(t, old->parent, old->name));
+			entp = neg_find(t, parent, name);
+		}
+		ent = malloc(sizeof(struct neg_entry) + strlen(name) + 1);
+		if (ent == NULL)
+			goto out;
+		ent->parent = parent;
+		strcpy(ent->name, name);
+		ent->hash_next = NULL;
+		*entp = ent;
+		t->use++;
+	}
+	curr_time(&ent->stamp);
+	list_add_tail(&ent->lru, &t->lru);
+out:
+	pthread_mutex_unlock(&f->lock);
+}
+
+/* Forget that name doesn't exist in parent, because it was just created */
+static void invalidate_negative(struct fuse *f, fuse_ino_t parent,
+				const char *name)
+{
+	struct neg_table *t = &f->neg_table;
+	struct neg_entry **entp;
+
+	if (t->array == NULL)
+		return;
+
+	pthread_mutex_lock(&f->lock);
+	t->epoch++;
+	entp = neg_find(t, parent, name);
+	if (*entp)
+		neg_remove(t, entp);
+	pthread_mutex_unlock(&f->lock);
+}
+
 static int lookup_path_in_cache(struct fuse *f,
 		const char *path, fuse_ino_t *inop)
 {
@@ -1225,6 +1641,16 @@ static int get_path_nullok(struct fuse *f, fuse_ino_t nodeid, char **path)
 	return err;
 }
 
+static int get_path_data(struct fuse *f, fuse_ino_t nodeid, char **path)
+{
+	if (f->conf.nullpath_data_ok) {
+		*path = NULL;
+		return 0;
+	}
+
+	return get_path_nullok(f, nodeid, path);
+}
+
 static int get_path_name(struct fuse *f, fuse_ino_t nodeid, const char *name,
 			 char **path)
 {
@@ -1358,12 +1784,13 @@ static void free_path2(struct fuse *f, fuse_ino_t nodeid1, fuse_ino_t nodeid2,
 	free(path2);
 }
 
-static void forget_node(struct fuse *f, fuse_ino_t nodeid, uint64_t nlookup)
+static void forget_node_locked(struct fuse *f, fuse_ino_t nodeid,
+			       uint64_t nlookup)
 {
 	struct node *node;
+
 	if (nodeid == FUSE_ROOT_ID)
 		return;
-	pthread_mutex_lock(&f->lock);
 	node = get_node(f, nodeid);
 
 	/*
@@ -1392,8 +1819,18 @@ static void forget_node(struct fuse *f, fuse_ino_t nodeid, uint64_t nlookup)
 		unref_node(f, node);
 	} else if (lru_enabled(f) && node->nlookup == 1) {
 		set_forget_time(f, node);
+		prune_node_budget(f);
 	}
+}
+
+static void forget_node(struct fuse *f, fuse_ino_t nodeid, uint64_t nlookup)
+{
+	if (nodeid == FUSE_ROOT_ID)
+		return;
+	pthread_mutex_lock(&f->lock);
+	forget_node_locked(f, nodeid, nlookup);
 	pthread_mutex_unlock(&f->lock);
+	release_empty_slabs(f);
 }
 
 static void unlink_node(struct fuse *f, struct node *node)
@@ -2401,6 +2838,9 @@ static char *hidden_name(struct fuse *f, fuse_ino_t dir, const char *oldname,
 		if (res)
 			break;
 
+		if (neg_cache_lookup(f, dir, newname))
+			break;
+
 		memset(&buf, 0, sizeof(buf));
 		res = fuse_fs_getattr(f->fs, newpath, &buf, NULL);
 		if (res == -ENOENT)
@@ -2422,6 +2862,7 @@ static int hide_node(struct fuse *f, const char *oldpath,
 	newpath = hidden_name(f, dir, oldname, newname, sizeof(newname));
 	if (newpath) {
 		err = fuse_fs_rename(f->fs, oldpath, newpath, 0);
+		invalidate_negative(f, dir, newname);
 		if (!err)
 			err = rename_node(f, dir, oldname, dir, newname, 1);
 		free(newpath);
@@ -2435,6 +2876,11 @@ static int mtime_eq(const struct stat *stbuf, const struct timespec *ts)
 		ST_MTIM_NSEC(stbuf) == ts->tv_nsec;
 }
 
+static int timespec_eq(const struct timespec *t1, const struct timespec *t2)
+{
+	return t1->tv_sec == t2->tv_sec && t1->tv_nsec == t2->tv_nsec;
+}
+
 #ifndef CLOCK_MONOTONIC
 #define CLOCK_MONOTONIC CLOCK_REALTIME
 #endif
@@ -2464,56 +2910,251 @@ static void update_stat(struct node *node, const struct stat *stbuf)
 	curr_time(&node->stat_updated);
 }
 
-static int do_lookup(struct fuse *f, fuse_ino_t nodeid, const char *name,
-		     struct fuse_entry_param *e)
+/*
+ * Attribute cache (-o attr_cache)
+ *
+ * Attributes returned by the filesystem are stored in the node, and
+ * served from there for attr_timeout seconds.  Every local
+ * modification invalidates the attributes of the affected nodes and
+ * bumps f->attr_epoch.  Attributes are only stored if the epoch didn't
+ * change while they were being fetched, so that a getattr racing with
+ * a modification can't put stale attributes into the cache.
+ */
+static uint64_t attr_cache_epoch(struct fuse *f)
 {
-	struct node *node;
+	uint64_t epoch;
 
-	node = find_node(f, nodeid, name);
-	if (node == NULL)
-		return -ENOMEM;
+	if (!f->conf.attr_cache)
+		return 0;
 
-	e->ino = node->nodeid;
-	e->generation = node->generation;
-	e->entry_timeout = f->conf.entry_timeout;
-	e->attr_timeout = f->conf.attr_timeout;
-	if (f->conf.auto_cache) {
-		pthread_mutex_lock(&f->lock);
-		update_stat(node, &e->attr);
-		pthread_mutex_unlock(&f->lock);
-	}
-	set_stat(f, e->ino, &e->attr);
-	return 0;
+	pthread_mutex_lock(&f->lock);
+	epoch = f->attr_epoch;
+	pthread_mutex_unlock(&f->lock);
+	return epoch;
 }
 
-static int lookup_path(struct fuse *f, fuse_ino_t nodeid,
-		       const char *name, const char *path,
-		       struct fuse_entry_param *e, struct fuse_file_info *fi)
+static void set_attr_cache(struct fuse *f, struct node *node,
+			   const struct stat *stbuf, uint64_t epoch)
 {
-	int res;
+	if (!f->conf.attr_cache || epoch != f->attr_epoch)
+		return;
 
-	memset(e, 0, sizeof(struct fuse_entry_param));
-	res = fuse_fs_getattr(f->fs, path, &e->attr, fi);
-	if (res == 0) {
-		res = do_lookup(f, nodeid, name, e);
-		if (res == 0 && f->conf.debug) {
-			fuse_log(FUSE_LOG_DEBUG, "   NODEID: %llu\n",
-				(unsigned long long) e->ino);
-		}
+	if (!node->attr) {
+		node->attr = malloc(sizeof(struct node_attr));
+		if (node->attr == NULL)
+			return;
+		f->attr_nodes++;
 	}
-	return res;
+	node->attr->stat = *stbuf;
+	curr_time(&node->attr->updated);
+	node->attr_valid = 1;
 }
 
-static struct fuse_context_i *fuse_get_context_internal(void)
+static int get_attr_cache(struct fuse *f, struct node *node,
+			  struct stat *stbuf)
 {
-	return (struct fuse_context_i *) pthread_getspecific(fuse_context_key);
+	struct timespec now;
+
+	if (node->attr_valid) {
+		curr_time(&now);
+		if (diff_timespec(&now, &node->attr->updated) <
+		    f->conf.attr_timeout) {
+			*stbuf = node->attr->stat;
+			f->attr_hits++;
+			return 1;
+		}
+		node->attr_valid = 0;
+	}
+	f->attr_misses++;
+	return 0;
 }
 
-static struct fuse_context_i *fuse_create_context(struct fuse *f)
+/*
+ * Invalidate cached attributes of a node, or if name is given of the
+ * directory entry and of the directory itself.  The cached listing of
+ * the directory is dropped as well, and so is the listing of the
+ * node's parent, since READDIRPLUS replies from it carry the node's
+ * attributes.
+ */
+static void invalidate_attr(struct fuse *f, fuse_ino_t nodeid,
+			    const char *name)
 {
-	struct fuse_context_i *c = fuse_get_context_internal();
-	if (c == NULL) {
-		c = (struct fuse_context_i *)
+	struct node *node;
+
+	if (!f->conf.attr_cache && !f->conf.readdir_cache)
+		return;
+
+	pthread_mutex_lock(&f->lock);
+	f->attr_epoch++;
+	f->dir_epoch++;
+	node = get_node_nocheck(f, nodeid);
+	if (node) {
+		node->attr_valid = 0;
+		drop_dir_cache(f, node);
+		if (node->parent)
+			drop_dir_cache(f, node->parent);
+	}
+	if (name) {
+		node = lookup_node(f, nodeid, name);
+		if (node)
+			node->attr_valid = 0;
+	}
+	pthread_mutex_unlock(&f->lock);
+}
+
+/*
+ * Inode number and link count from the cached attributes of a node,
+ * even if they have expired, or zero if there are none.  Without
+ * use_ino the cached st_ino may be the node ID, so it isn't returned.
+ */
+static void cached_links(struct fuse *f, fuse_ino_t nodeid, ino_t *st_ino,
+			 nlink_t *nlink)
+{
+	struct node *node;
+
+	*st_ino = 0;
+	*nlink = 0;
+	if (!f->conf.attr_cache)
+		return;
+
+	pthread_mutex_lock(&f->lock);
+	node = get_node_nocheck(f, nodeid);
+	if (node && node->attr) {
+		if (f->conf.use_ino)
+			*st_ino = node->attr->stat.st_ino;
+		*nlink = node->attr->stat.st_nlink;
+	}
+	pthread_mutex_unlock(&f->lock);
+}
+
+/*
+ * The other names of a hard-linked file have nodes of their own, whose
+ * cached st_nlink becomes stale on link and unlink.  Hard links are
+ * rare, so these nodes are found by scanning the cache for the inode
+ * number.  If it isn't known, the attributes of all files with more
+ * than one link are invalidated.
+ */
+static void invalidate_attr_links(struct fuse *f, ino_t st_ino)
+{
+	struct node *node;
+	size_t i;
+
+	if (!f->conf.attr_cache)
+		return;
+
+	pthread_mutex_lock(&f->lock);
+	f->attr_epoch++;
+	for (i = 0; i < f->id_table.size; i++) {
+		for (node = f->id_table.array[i]; node != NULL;
+		     node = node->id_next) {
+			if (!node->attr_valid)
+				continue;
+			if (st_ino ? node->attr->stat.st_ino == st_ino :
+			    node->attr->stat.st_nlink > 1)
+				node->attr_valid = 0;
+		}
+	}
+	pthread_mutex_unlock(&f->lock);
+}
+
+static int lookup_attr_cache(struct fuse *f, fuse_ino_t parent,
+			     const char *name, struct fuse_entry_param *e)
+{
+	struct node *node;
+	int found = 0;
+
+	memset(e, 0, sizeof(struct fuse_entry_param));
+	pthread_mutex_lock(&f->lock);
+	node = lookup_node(f, parent, name);
+	if (node && get_attr_cache(f, node, &e->attr)) {
+		find_node_locked(f, parent, name);
+		e->ino = node->nodeid;
+		e->generation = node->generation;
+		e->entry_timeout = f->conf.entry_timeout;
+		e->attr_timeout = f->conf.attr_timeout;
+		found = 1;
+	}
+	pthread_mutex_unlock(&f->lock);
+	if (found)
+		set_stat(f, e->ino, &e->attr);
+
+	return found;
+}
+
+static void update_attr_cache(struct fuse *f, fuse_ino_t nodeid,
+			      const struct stat *stbuf, uint64_t epoch)
+{
+	if (!f->conf.attr_cache)
+		return;
+
+	pthread_mutex_lock(&f->lock);
+	set_attr_cache(f, get_node(f, nodeid), stbuf, epoch);
+	pthread_mutex_unlock(&f->lock);
+}
+
+static int do_lookup(struct fuse *f, fuse_ino_t nodeid, const char *name,
+		     struct fuse_entry_param *e)
+{
+	struct node *node;
+
+	node = find_node(f, nodeid, name);
+	if (node == NULL)
+		return -ENOMEM;
+
+	e->ino = node->nodeid;
+	e->generation = node->generation;
+	e->entry_timeout = f->conf.entry_timeout;
+	e->attr_timeout = f->conf.attr_timeout;
+	if (f->conf.auto_cache || f->conf.readdir_cache) {
+		pthread_mutex_lock(&f->lock);
+		update_stat(node, &e->attr);
+		pthread_mutex_unlock(&f->lock);
+	}
+	set_stat(f, e->ino, &e->attr);
+	return 0;
+}
+
+static int lookup_path_finish(struct fuse *f, fuse_ino_t nodeid,
+			      const char *name, struct fuse_entry_param *e,
+			      int res, uint64_t epoch, uint64_t neg_epoch)
+{
+	if (res == -ENOENT && name)
+		neg_cache_add(f, nodeid, name, neg_epoch);
+	if (res == 0) {
+		res = do_lookup(f, nodeid, name, e);
+		if (res == 0)
+			update_attr_cache(f, e->ino, &e->attr, epoch);
+		if (res == 0 && f->conf.debug) {
+			fuse_log(FUSE_LOG_DEBUG, "   NODEID: %llu\n",
+				(unsigned long long) e->ino);
+		}
+	}
+	return res;
+}
+
+static int lookup_path(struct fuse *f, fuse_ino_t nodeid,
+		       const char *name, const char *path,
+		       struct fuse_entry_param *e, struct fuse_file_info *fi)
+{
+	uint64_t epoch = attr_cache_epoch(f);
+	uint64_t neg_epoch = neg_cache_epoch(f);
+	int res;
+
+	memset(e, 0, sizeof(struct fuse_entry_param));
+	res = fuse_fs_getattr(f->fs, path, &e->attr, fi);
+	return lookup_path_finish(f, nodeid, name, e, res, epoch, neg_epoch);
+}
+
+static struct fuse_context_i *fuse_get_context_internal(void)
+{
+	return (struct fuse_context_i *) pthread_getspecific(fuse_context_key);
+}
+
+static struct fuse_context_i *fuse_create_context(struct fuse *f)
+{
+	struct fuse_context_i *c = fuse_get_context_internal();
+	if (c == NULL) {
+		c = (struct fuse_context_i *)
 			calloc(1, sizeof(struct fuse_context_i));
 		if (c == NULL) {
 			/* This is hard to deal with properly, so just
@@ -2622,6 +3263,7 @@ static void fuse_lib_init(void *data, struct fuse_conn_info *conn)
 	if(conn->capable & FUSE_CAP_EXPORT_SUPPORT)
 		conn->want |= FUSE_CAP_EXPORT_SUPPORT;
 	fuse_fs_init(f->fs, conn, &f->conf);
+	neg_table_init(f);
 
 	if (f->conf.intr) {
 		if (fuse_init_intr_signal(f->conf.intr_signal,
@@ -2648,6 +3290,159 @@ static void fuse_lib_destroy(void *data)
 	fuse_fs_destroy(f->fs);
 }
 
+/*
+ * Asynchronous operations
+ *
+ * If the filesystem implements the *_async variant of an operation,
+ * the request handler only starts it.  Everything that would follow
+ * the synchronous call (releasing the path, updating the caches and
+ * nodes, replying) is done by the complete callback, which is run by
+ * fuse_async_done() on whatever thread the filesystem calls it from.
+ */
+struct fuse_async {
+	struct fuse *f;
+	fuse_req_t req;
+	fuse_ino_t ino;
+	char *path;
+	void (*complete)(struct fuse_async *a, int res);
+	struct fuse_file_info fi;
+	uint64_t epoch;
+
+	/* getattr, lookup */
+	struct stat stat;
+	uint64_t neg_epoch;
+	struct node *dot;
+	const char *name;
+
+	/* read, write, readdir */
+	char *buf;
+	size_t size;
+	off_t off;
+
+	/* readdir */
+	struct fuse_dh *dh;
+	enum fuse_readdir_flags flags;
+	int use_cache;
+
+	char namebuf[];
+};
+
+static struct fuse_async *fuse_async_new(struct fuse *f, fuse_req_t req,
+					 fuse_ino_t ino, char *path,
+					 void (*complete)(struct fuse_async *,
+							  int),
+					 size_t namelen)
+{
+	struct fuse_async *a;
+
+	a = (struct fuse_async *) calloc(1, sizeof(struct fuse_async) +
+					 namelen);
+	if (a == NULL)
+		return NULL;
+
+	a->f = f;
+	a->req = req;
+	a->ino = ino;
+	a->path = path;
+	a->complete = complete;
+	return a;
+}
+
+void fuse_async_done(struct fuse_async *a, int res)
+{
+	/* The completion may run on a thread of the filesystem */
+	req_fuse_prepare(a->req);
+	a->complete(a, res);
+	free(a->buf);
+	free(a);
+}
+
+int fuse_async_interrupted(struct fuse_async *a)
+{
+	return fuse_req_interrupted(a->req);
+}
+
+/* Check the return value of a *_async method */
+static void fuse_async_started(struct fuse_async *a, int res)
+{
+	if (res > 0) {
+		fuse_log(FUSE_LOG_ERR,
+			 "fuse: asynchronous operation returned %i\n", res);
+		res = -EIO;
+	}
+	/* Not started, so fuse_async_done() won't be called */
+	if (res)
+		fuse_async_done(a, res);
+}
+
+static int fuse_fs_getattr_async(struct fuse_fs *fs, const char *path,
+				 struct stat *buf, struct fuse_file_info *fi,
+				 struct fuse_async *a)
+{
+	fuse_get_context()->private_data = fs->user_data;
+	if (fs->debug) {
+		char buf[10];
+		fuse_log(FUSE_LOG_DEBUG, "getattr_async[%s] %s\n",
+			file_info_string(fi, buf, sizeof(buf)),
+			path);
+	}
+	return fs->op.getattr_async(path, buf, fi, a);
+}
+
+static void lookup_async_complete(struct fuse_async *a, int res)
+{
+	struct fuse *f = a->f;
+	struct fuse_entry_param e;
+
+	memset(&e, 0, sizeof(e));
+	e.attr = a->stat;
+	res = lookup_path_finish(f, a->ino, a->name, &e, res, a->epoch,
+				 a->neg_epoch);
+	if (res == -ENOENT && f->conf.negative_timeout != 0.0) {
+		e.ino = 0;
+		e.entry_timeout = f->conf.negative_timeout;
+		res = 0;
+	}
+	free_path(f, a->ino, a->path);
+	if (a->dot) {
+		pthread_mutex_lock(&f->lock);
+		unref_node(f, a->dot);
+		pthread_mutex_unlock(&f->lock);
+	}
+	reply_entry(a->req, &e, res);
+}
+
+static void lookup_async_start(struct fuse *f, fuse_req_t req,
+			      fuse_ino_t parent, const char *name, char *path,
+			      struct node *dot)
+{
+	struct fuse_async *a;
+	int res;
+
+	a = fuse_async_new(f, req, parent, path, lookup_async_complete,
+			   name ? strlen(name) + 1 : 0);
+	if (a == NULL) {
+		free_path(f, parent, path);
+		if (dot) {
+			pthread_mutex_lock(&f->lock);
+			unref_node(f, dot);
+			pthread_mutex_unlock(&f->lock);
+		}
+		reply_err(req, -ENOMEM);
+		return;
+	}
+	if (name) {
+		strcpy(a->namebuf, name);
+		a->name = a->namebuf;
+	}
+	a->dot = dot;
+	a->epoch = attr_cache_epoch(f);
+	a->neg_epoch = neg_cache_epoch(f);
+
+	res = fuse_fs_getattr_async(f->fs, path, &a->stat, NULL, a);
+	fuse_async_started(a, res);
+}
+
 static void fuse_lib_lookup(fuse_req_t req, fuse_ino_t parent,
 			    const char *name)
 {
@@ -2682,7 +3477,35 @@ static void fuse_lib_lookup(fuse_req_t req, fuse_ino_t parent,
 		}
 	}
 
+	if (name && f->conf.attr_cache && lookup_attr_cache(f, parent, name, &e)) {
+		if (f->conf.debug)
+			fuse_log(FUSE_LOG_DEBUG, "LOOKUP %llu/%s (cached)\n",
+				 (unsigned long long) parent, name);
+		reply_entry(req, &e, 0);
+		return;
+	}
+
+	if (name && neg_cache_lookup(f, parent, name)) {
+		if (f->conf.debug)
+			fuse_log(FUSE_LOG_DEBUG, "LOOKUP %llu/%s (negative)\n",
+				 (unsigned long long) parent, name);
+		memset(&e, 0, sizeof(e));
+		err = -ENOENT;
+		if (f->conf.negative_timeout != 0.0) {
+			e.entry_timeout = f->conf.negative_timeout;
+			err = 0;
+		}
+		reply_entry(req, &e, err);
+		return;
+	}
+
 	err = get_path_name(f, parent, name, &path);
+	if (!err && f->fs->op.getattr_async) {
+		if (f->conf.debug)
+			fuse_log(FUSE_LOG_DEBUG, "LOOKUP %s\n", path);
+		lookup_async_start(f, req, parent, name, path, dot);
+		return;
+	}
 	if (!err) {
 		struct fuse_intr_data d;
 		if (f->conf.debug)
@@ -2710,79 +3533,207 @@ static void do_forget(struct fuse *f, fuse_ino_t ino, uint64_t nlookup)
 	if (f->conf.debug)
 		fuse_log(FUSE_LOG_DEBUG, "FORGET %llu/%llu\n", (unsigned long long)ino,
 			(unsigned long long) nlookup);
-	forget_node(f, ino, nlookup);
+	forget_node_locked(f, ino, nlookup);
 }
 
 static void fuse_lib_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
 {
-	do_forget(req_fuse(req), ino, nlookup);
+	struct fuse *f = req_fuse(req);
+
+	pthread_mutex_lock(&f->lock);
+	do_forget(f, ino, nlookup);
+	f->forgets++;
+	f->forget_batches++;
+	pthread_mutex_unlock(&f->lock);
+	release_empty_slabs(f);
 	fuse_reply_none(req);
 }
 
+/*
+ * Frees the nodes deleted by other threads, in batches so that f->lock
+ * is not held for too long at a time.  Started by the first
+ * BATCH_FORGET, so that forget storms (e.g. after the kernel dropped
+ * its caches) only have to unhash the nodes while holding the lock.
+ */
+static void *node_reclaimer(void *data)
+{
+	struct fuse *f = (struct fuse *) data;
+	struct node *node;
+	int n;
+
+	pthread_mutex_lock(&f->lock);
+	while (f->reclaim.running || f->reclaim.nodes) {
+		if (!f->reclaim.nodes) {
+			pthread_cond_wait(&f->reclaim.cond, &f->lock);
+			continue;
+		}
+		for (n = 0; n < RECLAIM_BATCH_SIZE && f->reclaim.nodes; n++) {
+			node = f->reclaim.nodes;
+			f->reclaim.nodes = node->id_next;
+			free_node(f, node);
+		}
+		f->reclaim.pending -= n;
+		f->reclaim.freed += n;
+		pthread_mutex_unlock(&f->lock);
+		release_empty_slabs(f);
+		pthread_mutex_lock(&f->lock);
+	}
+	pthread_mutex_unlock(&f->lock);
+
+	return NULL;
+}
+
+/* Called with f->lock held */
+static void reclaim_start(struct fuse *f)
+{
+	f->reclaim.started = 1;
+	if (fuse_start_thread(&f->reclaim.thread, node_reclaimer, f) == 0)
+		f->reclaim.running = 1;
+}
+
+static void reclaim_stop(struct fuse *f)
+{
+	int running;
+
+	pthread_mutex_lock(&f->lock);
+	running = f->reclaim.running;
+	f->reclaim.running = 0;
+	pthread_cond_signal(&f->reclaim.cond);
+	pthread_mutex_unlock(&f->lock);
+
+	if (running)
+		pthread_join(f->reclaim.thread, NULL);
+	pthread_cond_destroy(&f->reclaim.cond);
+}
+
+/*
+ * The whole batch is processed with a single acquisition of f->lock.
+ * Forgotten nodes are only unhashed, and freed by node_reclaimer().
+ */
 static void fuse_lib_forget_multi(fuse_req_t req, size_t count,
 				  struct fuse_forget_data *forgets)
 {
 	struct fuse *f = req_fuse(req);
 	size_t i;
 
+	pthread_mutex_lock(&f->lock);
+	if (!f->reclaim.started)
+		reclaim_start(f);
 	for (i = 0; i < count; i++)
 		do_forget(f, forgets[i].ino, forgets[i].nlookup);
+	f->forgets += count;
+	f->forget_batches++;
+	pthread_mutex_unlock(&f->lock);
+	release_empty_slabs(f);
 
 	fuse_reply_none(req);
 }
 
 
-static void fuse_lib_getattr(fuse_req_t req, fuse_ino_t ino,
-			     struct fuse_file_info *fi)
+static void getattr_reply(struct fuse *f, fuse_req_t req, fuse_ino_t ino,
+			  struct stat *buf, int cached, uint64_t epoch,
+			  int err)
 {
-	struct fuse *f = req_fuse_prepare(req);
-	struct stat buf;
-	char *path;
-	int err;
-
-	memset(&buf, 0, sizeof(buf));
-
-	if (fi != NULL)
-		err = get_path_nullok(f, ino, &path);
-	else
-		err = get_path(f, ino, &path);
-	if (!err) {
-		struct fuse_intr_data d;
-		fuse_prepare_interrupt(f, req, &d);
-		err = fuse_fs_getattr(f->fs, path, &buf, fi);
-		fuse_finish_interrupt(f, req, &d);
-		free_path(f, ino, path);
-	}
 	if (!err) {
 		struct node *node;
 
 		pthread_mutex_lock(&f->lock);
 		node = get_node(f, ino);
-		if (node->is_hidden && buf.st_nlink > 0)
-			buf.st_nlink--;
-		if (f->conf.auto_cache)
-			update_stat(node, &buf);
+		if (!cached)
+			set_attr_cache(f, node, buf, epoch);
+		if (node->is_hidden && buf->st_nlink > 0)
+			buf->st_nlink--;
+		if (f->conf.auto_cache || f->conf.readdir_cache)
+			update_stat(node, buf);
 		pthread_mutex_unlock(&f->lock);
-		set_stat(f, ino, &buf);
-		fuse_reply_attr(req, &buf, f->conf.attr_timeout);
+		set_stat(f, ino, buf);
+		fuse_reply_attr(req, buf, f->conf.attr_timeout);
 	} else
 		reply_err(req, err);
 }
 
-int fuse_fs_chmod(struct fuse_fs *fs, const char *path, mode_t mode,
-		  struct fuse_file_info *fi)
+static void getattr_async_complete(struct fuse_async *a, int res)
 {
-	fuse_get_context()->private_data = fs->user_data;
-	if (fs->op.chmod) {
-		if (fs->debug) {
-			char buf[10];
-			fuse_log(FUSE_LOG_DEBUG, "chmod[%s] %s %llo\n",
-				file_info_string(fi, buf, sizeof(buf)),
-				path, (unsigned long long) mode);
-		}
-		return fs->op.chmod(path, mode, fi);
-	}
-	else
+	free_path(a->f, a->ino, a->path);
+	getattr_reply(a->f, a->req, a->ino, &a->stat, 0, a->epoch, res);
+}
+
+static void getattr_async_start(struct fuse *f, fuse_req_t req,
+				fuse_ino_t ino, char *path,
+				struct fuse_file_info *fi, uint64_t epoch)
+{
+	struct fuse_async *a;
+	int res;
+
+	a = fuse_async_new(f, req, ino, path, getattr_async_complete, 0);
+	if (a == NULL) {
+		free_path(f, ino, path);
+		reply_err(req, -ENOMEM);
+		return;
+	}
+	if (fi) {
+		a->fi = *fi;
+		fi = &a->fi;
+	}
+	a->epoch = epoch;
+
+	res = fuse_fs_getattr_async(f->fs, path, &a->stat, fi, a);
+	fuse_async_started(a, res);
+}
+
+static void fuse_lib_getattr(fuse_req_t req, fuse_ino_t ino,
+			     struct fuse_file_info *fi)
+{
+	struct fuse *f = req_fuse_prepare(req);
+	struct stat buf;
+	char *path;
+	uint64_t epoch = 0;
+	int cached = 0;
+	int err = 0;
+
+	memset(&buf, 0, sizeof(buf));
+
+	if (f->conf.attr_cache) {
+		pthread_mutex_lock(&f->lock);
+		cached = get_attr_cache(f, get_node(f, ino), &buf);
+		epoch = f->attr_epoch;
+		pthread_mutex_unlock(&f->lock);
+	}
+
+	if (!cached) {
+		if (fi != NULL)
+			err = get_path_nullok(f, ino, &path);
+		else
+			err = get_path(f, ino, &path);
+	}
+	if (!cached && !err && f->fs->op.getattr_async) {
+		getattr_async_start(f, req, ino, path, fi, epoch);
+		return;
+	}
+	if (!cached && !err) {
+		struct fuse_intr_data d;
+		fuse_prepare_interrupt(f, req, &d);
+		err = fuse_fs_getattr(f->fs, path, &buf, fi);
+		fuse_finish_interrupt(f, req, &d);
+		free_path(f, ino, path);
+	}
+	getattr_reply(f, req, ino, &buf, cached, epoch, err);
+}
+
+int fuse_fs_chmod(struct fuse_fs *fs, const char *path, mode_t mode,
+		  struct fuse_file_info *fi)
+{
+	fuse_get_context()->private_data = fs->user_data;
+	if (fs->op.chmod) {
+		if (fs->debug) {
+			char buf[10];
+			fuse_log(FUSE_LOG_DEBUG, "chmod[%s] %s %llo\n",
+				file_info_string(fi, buf, sizeof(buf)),
+				path, (unsigned long long) mode);
+		}
+		return fs->op.chmod(path, mode, fi);
+	}
+	else
 		return -ENOSYS;
 }
 
@@ -2792,6 +3743,7 @@ static void fuse_lib_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
 	struct fuse *f = req_fuse_prepare(req);
 	struct stat buf;
 	char *path;
+	uint64_t epoch = 0;
 	int err;
 
 	memset(&buf, 0, sizeof(buf));
@@ -2849,6 +3801,8 @@ static void fuse_lib_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
 			tv[1].tv_nsec = ST_MTIM_NSEC(attr);
 			err = fuse_fs_utimens(f->fs, path, tv, fi);
 		}
+		invalidate_attr(f, ino, NULL);
+		epoch = attr_cache_epoch(f);
 		if (!err) {
 			err = fuse_fs_getattr(f->fs, path, &buf, fi);
 		}
@@ -2856,7 +3810,8 @@ static void fuse_lib_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
 		free_path(f, ino, path);
 	}
 	if (!err) {
-		if (f->conf.auto_cache) {
+		update_attr_cache(f, ino, &buf, epoch);
+		if (f->conf.auto_cache || f->conf.readdir_cache) {
 			pthread_mutex_lock(&f->lock);
 			update_stat(get_node(f, ino), &buf);
 			pthread_mutex_unlock(&f->lock);
@@ -2928,6 +3883,8 @@ static void fuse_lib_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
 			fi.flags = O_CREAT | O_EXCL | O_WRONLY;
 			err = fuse_fs_create(f->fs, path, mode, &fi);
 			if (!err) {
+				invalidate_attr(f, parent, name);
+				invalidate_negative(f, parent, name);
 				err = lookup_path(f, parent, name, path, &e,
 						  &fi);
 				fuse_fs_release(f->fs, path, &fi);
@@ -2935,9 +3892,12 @@ static void fuse_lib_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
 		}
 		if (err == -ENOSYS) {
 			err = fuse_fs_mknod(f->fs, path, mode, rdev);
-			if (!err)
+			if (!err) {
+				invalidate_attr(f, parent, name);
+				invalidate_negative(f, parent, name);
 				err = lookup_path(f, parent, name, path, &e,
 						  NULL);
+			}
 		}
 		fuse_finish_interrupt(f, req, &d);
 		free_path(f, parent, path);
@@ -2959,8 +3919,11 @@ static void fuse_lib_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
 
 		fuse_prepare_interrupt(f, req, &d);
 		err = fuse_fs_mkdir(f->fs, path, mode);
-		if (!err)
+		if (!err) {
+			invalidate_attr(f, parent, name);
+			invalidate_negative(f, parent, name);
 			err = lookup_path(f, parent, name, path, &e, NULL);
+		}
 		fuse_finish_interrupt(f, req, &d);
 		free_path(f, parent, path);
 	}
@@ -2972,6 +3935,8 @@ static void fuse_lib_unlink(fuse_req_t req, fuse_ino_t parent,
 {
 	struct fuse *f = req_fuse_prepare(req);
 	struct node *wnode;
+	ino_t st_ino = 0;
+	nlink_t nlink = 0;
 	char *path;
 	int err;
 
@@ -2979,6 +3944,8 @@ static void fuse_lib_unlink(fuse_req_t req, fuse_ino_t parent,
 	if (!err) {
 		struct fuse_intr_data d;
 
+		if (wnode)
+			cached_links(f, wnode->nodeid, &st_ino, &nlink);
 		fuse_prepare_interrupt(f, req, &d);
 		if (!f->conf.hard_remove && is_open(f, parent, name)) {
 			err = hide_node(f, path, parent, name);
@@ -3001,6 +3968,11 @@ static void fuse_lib_unlink(fuse_req_t req, fuse_ino_t parent,
 			if (!err)
 				remove_node(f, parent, name);
 		}
+		invalidate_attr(f, parent, NULL);
+		if (wnode)
+			invalidate_attr(f, wnode->nodeid, NULL);
+		if (!err && nlink != 1)
+			invalidate_attr_links(f, st_ino);
 		fuse_finish_interrupt(f, req, &d);
 		free_path_wrlock(f, parent, wnode, path);
 	}
@@ -3021,6 +3993,7 @@ static void fuse_lib_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
 		fuse_prepare_interrupt(f, req, &d);
 		err = fuse_fs_rmdir(f->fs, path);
 		fuse_finish_interrupt(f, req, &d);
+		invalidate_attr(f, parent, name);
 		if (!err)
 			remove_node(f, parent, name);
 		free_path_wrlock(f, parent, wnode, path);
@@ -3042,8 +4015,11 @@ static void fuse_lib_symlink(fuse_req_t req, const char *linkname,
 
 		fuse_prepare_interrupt(f, req, &d);
 		err = fuse_fs_symlink(f->fs, linkname, path);
-		if (!err)
+		if (!err) {
+			invalidate_attr(f, parent, name);
+			invalidate_negative(f, parent, name);
 			err = lookup_path(f, parent, name, path, &e, NULL);
+		}
 		fuse_finish_interrupt(f, req, &d);
 		free_path(f, parent, path);
 	}
@@ -3082,6 +4058,13 @@ static void fuse_lib_rename(fuse_req_t req, fuse_ino_t olddir,
 				}
 			}
 		}
+		invalidate_attr(f, olddir, NULL);
+		invalidate_attr(f, newdir, NULL);
+		invalidate_negative(f, newdir, newname);
+		if (wnode1)
+			invalidate_attr(f, wnode1->nodeid, NULL);
+		if (wnode2)
+			invalidate_attr(f, wnode2->nodeid, NULL);
 		fuse_finish_interrupt(f, req, &d);
 		free_path2(f, olddir, newdir, wnode1, wnode2, oldpath, newpath);
 	}
@@ -3101,12 +4084,20 @@ static void fuse_lib_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
 			&oldpath, &newpath, NULL, NULL);
 	if (!err) {
 		struct fuse_intr_data d;
+		ino_t st_ino;
+		nlink_t nlink;
 
+		cached_links(f, ino, &st_ino, &nlink);
 		fuse_prepare_interrupt(f, req, &d);
 		err = fuse_fs_link(f->fs, oldpath, newpath);
-		if (!err)
+		if (!err) {
+			invalidate_attr(f, ino, NULL);
+			invalidate_attr_links(f, st_ino);
+			invalidate_attr(f, newparent, newname);
+			invalidate_negative(f, newparent, newname);
 			err = lookup_path(f, newparent, newname, newpath,
 					  &e, NULL);
+		}
 		fuse_finish_interrupt(f, req, &d);
 		free_path2(f, ino, newparent, NULL, NULL, oldpath, newpath);
 	}
@@ -3160,6 +4151,8 @@ static void fuse_lib_create(fuse_req_t req, fuse_ino_t parent,
 		fuse_prepare_interrupt(f, req, &d);
 		err = fuse_fs_create(f->fs, path, mode, fi);
 		if (!err) {
+			invalidate_attr(f, parent, name);
+			invalidate_negative(f, parent, name);
 			err = lookup_path(f, parent, name, path, &e, fi);
 			if (err)
 				fuse_fs_release(f->fs, path, fi);
@@ -3247,6 +4240,10 @@ static void fuse_lib_open(fuse_req_t req, fuse_ino_t ino,
 		fuse_prepare_interrupt(f, req, &d);
 		err = fuse_fs_open(f->fs, path, fi);
 		if (!err) {
+			/* With atomic_o_trunc the size changes without a
+			   setattr */
+			if (fi->flags & O_TRUNC)
+				invalidate_attr(f, ino, NULL);
 			if (f->conf.direct_io)
 				fi->direct_io = 1;
 			if (f->conf.kernel_cache)
@@ -3280,6 +4277,56 @@ static void fuse_lib_open(fuse_req_t req, fuse_ino_t ino,
 	free_path(f, ino, path);
 }
 
+static void read_async_complete(struct fuse_async *a, int res)
+{
+	struct fuse *f = a->f;
+
+	free_path(f, a->ino, a->path);
+	if (f->fs->debug && res >= 0)
+		fuse_log(FUSE_LOG_DEBUG, "   read[%llu] %i bytes from %llu\n",
+			(unsigned long long) a->fi.fh, res,
+			(unsigned long long) a->off);
+	if (res > (int) a->size) {
+		fuse_log(FUSE_LOG_ERR, "fuse: read too many bytes\n");
+		res = -EIO;
+	}
+
+	if (res >= 0)
+		fuse_reply_buf(a->req, a->buf, res);
+	else
+		reply_err(a->req, res);
+}
+
+static void read_async_start(struct fuse *f, fuse_req_t req, fuse_ino_t ino,
+			     char *path, size_t size, off_t off,
+			     struct fuse_file_info *fi)
+{
+	struct fuse_async *a;
+	int res;
+
+	a = fuse_async_new(f, req, ino, path, read_async_complete, 0);
+	if (a != NULL)
+		a->buf = malloc(size ? size : 1);
+	if (a == NULL || a->buf == NULL) {
+		free(a);
+		free_path(f, ino, path);
+		reply_err(req, -ENOMEM);
+		return;
+	}
+	a->size = size;
+	a->off = off;
+	a->fi = *fi;
+
+	fuse_get_context()->private_data = f->fs->user_data;
+	if (f->fs->debug)
+		fuse_log(FUSE_LOG_DEBUG,
+			"read_async[%llu] %zu bytes from %llu flags: 0x%x\n",
+			(unsigned long long) fi->fh,
+			size, (unsigned long long) off, fi->flags);
+	res = f->fs->op.read_async(path, a->buf, size, off, &a->fi, a);
+	fuse_async_started(a, res);
+}
+
 static void fuse_lib_read(fuse_req_t req, fuse_ino_t ino, size_t size,
 			  off_t off, struct fuse_file_info *fi)
 {
@@ -3288,7 +4335,11 @@ static void fuse_lib_read(fuse_req_t req, fuse_ino_t ino, size_t size,
 	char *path;
 	int res;
 
-	res = get_path_nullok(f, ino, &path);
+	res = get_path_data(f, ino, &path);
+	if (res == 0 && f->fs->op.read_async) {
+		read_async_start(f, req, ino, path, size, off, fi);
+		return;
+	}
 	if (res == 0) {
 		struct fuse_intr_data d;
 
@@ -3306,6 +4357,70 @@ static void fuse_lib_read(fuse_req_t req, fuse_ino_t ino, size_t size,
 	fuse_free_buf(buf);
 }
 
+static void write_async_complete(struct fuse_async *a, int res)
+{
+	struct fuse *f = a->f;
+
+	free_path(f, a->ino, a->path);
+	if (f->fs->debug && res >= 0)
+		fuse_log(FUSE_LOG_DEBUG, "   write[%llu] %i bytes to %llu\n",
+			(unsigned long long) a->fi.fh, res,
+			(unsigned long long) a->off);
+	if (res > (int) a->size)
+		fuse_log(FUSE_LOG_ERR, "fuse: wrote too many bytes\n");
+
+	if (res > 0)
+		invalidate_attr(f, a->ino, NULL);
+	if (res >= 0)
+		fuse_reply_write(a->req, res);
+	else
+		reply_err(a->req, res);
+}
+
+/*
+ * The data is copied, since the request buffer is reused as soon as
+ * the handler returns.
+ */
+static void write_async_start(struct fuse *f, fuse_req_t req, fuse_ino_t ino,
+			      char *path, struct fuse_bufvec *buf, off_t off,
+			      struct fuse_file_info *fi)
+{
+	size_t size = fuse_buf_size(buf);
+	struct fuse_bufvec tmp = FUSE_BUFVEC_INIT(size);
+	struct fuse_async *a;
+	ssize_t res;
+
+	a = fuse_async_new(f, req, ino, path, write_async_complete, 0);
+	if (a != NULL)
+		a->buf = malloc(size ? size : 1);
+	if (a == NULL || a->buf == NULL) {
+		free(a);
+		free_path(f, ino, path);
+		reply_err(req, -ENOMEM);
+		return;
+	}
+	a->off = off;
+	a->fi = *fi;
+
+	tmp.buf[0].mem = a->buf;
+	res = fuse_buf_copy(&tmp, buf, 0);
+	if (res < 0) {
+		fuse_async_done(a, res);
+		return;
+	}
+	a->size = res;
+
+	fuse_get_context()->private_data = f->fs->user_data;
+	if (f->fs->debug)
+		fuse_log(FUSE_LOG_DEBUG,
+			"write_async%s[%llu] %zu bytes to %llu flags: 0x%x\n",
+			fi->writepage ? "page" : "",
+			(unsigned long long) fi->fh, a->size,
+			(unsigned long long) off, fi->flags);
+	res = f->fs->op.write_async(path, a->buf, a->size, off, &a->fi, a);
+	fuse_async_started(a, res);
+}
+
 static void fuse_lib_write_buf(fuse_req_t req, fuse_ino_t ino,
 			       struct fuse_bufvec *buf, off_t off,
 			       struct fuse_file_info *fi)
@@ -3314,7 +4429,11 @@ static void fuse_lib_write_buf(fuse_req_t req, fuse_ino_t ino,
 	char *path;
 	int res;
 
-	res = get_path_nullok(f, ino, &path);
+	res = get_path_data(f, ino, &path);
+	if (res == 0 && f->fs->op.write_async) {
+		write_async_start(f, req, ino, path, buf, off, fi);
+		return;
+	}
 	if (res == 0) {
 		struct fuse_intr_data d;
 
@@ -3324,6 +4443,8 @@ static void fuse_lib_write_buf(fuse_req_t req, fuse_ino_t ino,
 		free_path(f, ino, path);
 	}
 
+	if (res > 0)
+		invalidate_attr(f, ino, NULL);
 	if (res >= 0)
 		fuse_reply_write(req, res);
 	else
@@ -3337,7 +4458,7 @@ static void fuse_lib_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
 	char *path;
 	int err;
 
-	err = get_path_nullok(f, ino, &path);
+	err = get_path_data(f, ino, &path);
 	if (!err) {
 		struct fuse_intr_data d;
 
@@ -3358,6 +4479,139 @@ static struct fuse_dh *get_dirhandle(const struct fuse_file_info *llfi,
 	return dh;
 }
 
+static void free_direntries(struct fuse_direntry *de)
+{
+	while (de) {
+		struct fuse_direntry *next = de->next;
+		free(de->name);
+		free(de);
+		de = next;
+	}
+}
+
+/*
+ * Directory listing cache (-o readdir_cache)
+ *
+ * A complete listing collected by readdir is kept in the directory's
+ * node, tagged with the mtime the directory had when it was opened.
+ * Later handles opened while the mtime is unchanged share the listing
+ * instead of calling the filesystem's readdir, and the kernel is told
+ * to keep its own copy.  Local modifications drop the listing and bump
+ * f->dir_epoch, so that a listing racing with a modification is not
+ * stored.
+ */
+static void put_dir_cache(struct fuse *f, struct dir_cache *dc)
+{
+	(void) f;
+
+	if (--dc->refctr == 0) {
+		free_direntries(dc->first);
+		free(dc);
+	}
+}
+
+static void drop_dir_cache(struct fuse *f, struct node *node)
+{
+	if (node->dir) {
+		put_dir_cache(f, node->dir);
+		node->dir = NULL;
+	}
+}
+
+static void open_dir_cache(struct fuse *f, fuse_ino_t ino, const char *path,
+			   struct fuse_dh *dh, struct fuse_file_info *llfi)
+{
+	struct node *node;
+	struct timespec now;
+	struct stat stbuf;
+	int err = 0;
+
+	pthread_mutex_lock(&f->lock);
+	node = get_node(f, ino);
+	curr_time(&now);
+	if ((!node->stat_updated.tv_sec && !node->stat_updated.tv_nsec) ||
+	    diff_timespec(&now, &node->stat_updated) > f->conf.ac_attr_timeout) {
+		pthread_mutex_unlock(&f->lock);
+		err = fuse_fs_getattr(f->fs, path, &stbuf, NULL);
+		pthread_mutex_lock(&f->lock);
+		if (!err)
+			update_stat(node, &stbuf);
+	}
+	if (!err) {
+		dh->mtime = node->mtime;
+		dh->mtime_valid = 1;
+		llfi->cache_readdir = 1;
+		if (node->dir && timespec_eq(&node->dir->mtime, &dh->mtime))
+			llfi->keep_cache = 1;
+	}
+	pthread_mutex_unlock(&f->lock);
+}
+
+static void free_dh_entries(struct fuse *f, struct fuse_dh *dh)
+{
+	if (dh->dir) {
+		pthread_mutex_lock(&f->lock);
+		put_dir_cache(f, dh->dir);
+		pthread_mutex_unlock(&f->lock);
+		dh->dir = NULL;
+	} else {
+		free_direntries(dh->first);
+	}
+	dh->first = NULL;
+}
+
+static int get_dir_cache(struct fuse *f, fuse_ino_t ino, struct fuse_dh *dh,
+			 enum fuse_readdir_flags flags)
+{
+	struct node *node;
+	struct dir_cache *dc = NULL;
+
+	pthread_mutex_lock(&f->lock);
+	node = get_node(f, ino);
+	if (node->dir && node->dir->flags == flags &&
+	    timespec_eq(&node->dir->mtime, &dh->mtime)) {
+		dc = node->dir;
+		dc->refctr++;
+		f->dir_hits++;
+	}
+	pthread_mutex_unlock(&f->lock);
+	if (!dc)
+		return 0;
+
+	free_dh_entries(f, dh);
+	dh->dir = dc;
+	dh->first = dc->first;
+	dh->filled = 1;
+	return 1;
+}
+
+static void set_dir_cache(struct fuse *f, fuse_ino_t ino, struct fuse_dh *dh,
+			  enum fuse_readdir_flags flags, uint64_t epoch)
+{
+	struct dir_cache *dc;
+	struct node *node;
+
+	dc = malloc(sizeof(struct dir_cache));
+	if (!dc)
+		return;
+
+	pthread_mutex_lock(&f->lock);
+	if (epoch != f->dir_epoch) {
+		pthread_mutex_unlock(&f->lock);
+		free(dc);
+		return;
+	}
+	node = get_node(f, ino);
+	drop_dir_cache(f, node);
+	dc->refctr = 2;
+	dc->mtime = dh->mtime;
+	dc->flags = flags;
+	dc->first = dh->first;
+	node->dir = dc;
+	dh->dir = dc;
+	pthread_mutex_unlock(&f->lock);
+}
+
 static void fuse_lib_opendir(fuse_req_t req, fuse_ino_t ino,
 			     struct fuse_file_info *llfi)
 {
@@ -3381,6 +4635,8 @@ static void fuse_lib_opendir(fuse_req_t req, fuse_ino_t ino,
 	dh->filled = 0;
 	dh->nodeid = ino;
 	pthread_mutex_init(&dh->lock, NULL);
+	pthread_cond_init(&dh->stream_cond, NULL);
+	pthread_cond_init(&dh->async_cond, NULL);
 
 	llfi->fh = (uintptr_t) dh;
 
@@ -3395,6 +4651,8 @@ static void fuse_lib_opendir(fuse_req_t req, fuse_ino_t ino,
 		dh->fh = fi.fh;
 		llfi->cache_readdir = fi.cache_readdir;
 		llfi->keep_cache = fi.keep_cache;
+		if (!err && f->conf.readdir_cache)
+			open_dir_cache(f, ino, path, dh, llfi);
 	}
 	if (!err) {
 		if (fuse_reply_open(req, llfi) == -ENOENT) {
@@ -3402,11 +4660,15 @@ static void fuse_lib_opendir(fuse_req_t req, fuse_ino_t ino,
 			   must be cancelled */
 			fuse_fs_releasedir(f->fs, path, &fi);
 			pthread_mutex_destroy(&dh->lock);
+			pthread_cond_destroy(&dh->stream_cond);
+			pthread_cond_destroy(&dh->async_cond);
 			free(dh);
 		}
 	} else {
 		reply_err(req, err);
 		pthread_mutex_destroy(&dh->lock);
+		pthread_cond_destroy(&dh->stream_cond);
+		pthread_cond_destroy(&dh->async_cond);
 		free(dh);
 	}
 	free_path(f, ino, path);
@@ -3438,7 +4700,7 @@ static int extend_contents(struct fuse_dh *dh, unsigned minsize)
 }
 
 static int fuse_add_direntry_to_dh(struct fuse_dh *dh, const char *name,
-				   struct stat *st)
+				   struct stat *st, int attr_valid)
 {
 	struct fuse_direntry *de;
 
@@ -3454,6 +4716,7 @@ static int fuse_add_direntry_to_dh(struct fuse_dh *dh, const char *name,
 		return -1;
 	}
 	de->stat = *st;
+	de->attr_valid = attr_valid;
 	de->next = NULL;
 
 	*dh->last = de;
@@ -3477,6 +4740,25 @@ static fuse_ino_t lookup_nodeid(struct fuse *f, fuse_ino_t parent,
 	return res;
 }
 
+static void fill_dir_stat(struct fuse_dh *dh, const char *name,
+			  const struct stat *statp, struct stat *stbuf)
+{
+	if (statp)
+		*stbuf = *statp;
+	else {
+		memset(stbuf, 0, sizeof(*stbuf));
+		stbuf->st_ino = FUSE_UNKNOWN_INO;
+	}
+
+	if (!dh->fuse->conf.use_ino) {
+		stbuf->st_ino = FUSE_UNKNOWN_INO;
+		if (dh->fuse->conf.readdir_ino) {
+			stbuf->st_ino = (ino_t)
+				lookup_nodeid(dh->fuse, dh->nodeid, name);
+		}
+	}
+}
+
 static int fill_dir(void *dh_, const char *name, const struct stat *statp,
 		    off_t off, enum fuse_fill_dir_flags flags)
 {
@@ -3488,20 +4770,7 @@ static int fill_dir(void *dh_, const char *name, const struct stat *statp,
 		return 1;
 	}
 
-	if (statp)
-		stbuf = *statp;
-	else {
-		memset(&stbuf, 0, sizeof(stbuf));
-		stbuf.st_ino = FUSE_UNKNOWN_INO;
-	}
-
-	if (!dh->fuse->conf.use_ino) {
-		stbuf.st_ino = FUSE_UNKNOWN_INO;
-		if (dh->fuse->conf.readdir_ino) {
-			stbuf.st_ino = (ino_t)
-				lookup_nodeid(dh->fuse, dh->nodeid, name);
-		}
-	}
+	fill_dir_stat(dh, name, statp, &stbuf);
 
 	if (off) {
 		size_t newlen;
@@ -3530,7 +4799,7 @@ static int fill_dir(void *dh_, const char *name, const struct stat *statp,
 	} else {
 		dh->filled = 1;
 
-		if (fuse_add_direntry_to_dh(dh, name, &stbuf) == -1)
+		if (fuse_add_direntry_to_dh(dh, name, &stbuf, 0) == -1)
 			return 1;
 	}
 	return 0;
@@ -3542,6 +4811,29 @@ static int is_dot_or_dotdot(const char *name)
 				  (name[1] == '.' && name[2] == '\0'));
 }
 
+static void fill_dir_plus_attr(struct fuse_dh *dh, const char *name,
+			       const struct stat *statp,
+			       enum fuse_fill_dir_flags flags,
+			       struct fuse_entry_param *e)
+{
+	struct fuse *f = dh->fuse;
+
+	if (statp && (flags & FUSE_FILL_DIR_PLUS)) {
+		e->attr = *statp;
+	} else {
+		e->attr.st_ino = FUSE_UNKNOWN_INO;
+		if (statp) {
+			e->attr.st_mode = statp->st_mode;
+			if (f->conf.use_ino)
+				e->attr.st_ino = statp->st_ino;
+		}
+		if (!f->conf.use_ino && f->conf.readdir_ino) {
+			e->attr.st_ino = (ino_t)
+				lookup_nodeid(f, dh->nodeid, name);
+		}
+	}
+}
+
 static int fill_dir_plus(void *dh_, const char *name, const struct stat *statp,
 			 off_t off, enum fuse_fill_dir_flags flags)
 {
@@ -3558,20 +4850,7 @@ static int fill_dir_plus(void *dh_, const char *name, const struct stat *statp,
 		return 1;
 	}
 
-	if (statp && (flags & FUSE_FILL_DIR_PLUS)) {
-		e.attr = *statp;
-	} else {
-		e.attr.st_ino = FUSE_UNKNOWN_INO;
-		if (statp) {
-			e.attr.st_mode = statp->st_mode;
-			if (f->conf.use_ino)
-				e.attr.st_ino = statp->st_ino;
-		}
-		if (!f->conf.use_ino && f->conf.readdir_ino) {
-			e.attr.st_ino = (ino_t)
-				lookup_nodeid(f, dh->nodeid, name);
-		}
-	}
+	fill_dir_plus_attr(dh, name, statp, flags, &e);
 
 	if (off) {
 		size_t newlen;
@@ -3608,118 +4887,702 @@ static int fill_dir_plus(void *dh_, const char *name, const struct stat *statp,
 	} else {
 		dh->filled = 1;
 
-		if (fuse_add_direntry_to_dh(dh, name, &e.attr) == -1)
+		if (fuse_add_direntry_to_dh(dh, name, &e.attr,
+					    statp && (flags & FUSE_FILL_DIR_PLUS)) == -1)
 			return 1;
 	}
 
-	return 0;
-}
+	return 0;
+}
+
+static void readdir_fill_init(fuse_req_t req, size_t size,
+			      struct fuse_dh *dh)
+{
+	free_dh_entries(dh->fuse, dh);
+	dh->last = &dh->first;
+	dh->len = 0;
+	dh->error = 0;
+	dh->needlen = size;
+	dh->filled = 0;
+	dh->req = req;
+}
+
+static int readdir_fill_finish(struct fuse *f, fuse_ino_t ino, char *path,
+			       struct fuse_dh *dh,
+			       enum fuse_readdir_flags flags, int use_cache,
+			       uint64_t epoch, int err)
+{
+	dh->req = NULL;
+	if (!err)
+		err = dh->error;
+	if (err)
+		dh->filled = 0;
+	free_path(f, ino, path);
+	if (!err && dh->filled && use_cache)
+		set_dir_cache(f, ino, dh, flags, epoch);
+	return err;
+}
+
+static int readdir_fill(struct fuse *f, fuse_req_t req, fuse_ino_t ino,
+			size_t size, off_t off, struct fuse_dh *dh,
+			struct fuse_file_info *fi,
+			enum fuse_readdir_flags flags)
+{
+	int use_cache = dh->mtime_valid && !off;
+	uint64_t epoch = 0;
+	char *path;
+	int err;
+
+	if (use_cache) {
+		if (get_dir_cache(f, ino, dh, flags))
+			return 0;
+
+		pthread_mutex_lock(&f->lock);
+		epoch = f->dir_epoch;
+		pthread_mutex_unlock(&f->lock);
+	}
+
+	if (f->fs->op.readdir)
+		err = get_path_nullok(f, ino, &path);
+	else
+		err = get_path(f, ino, &path);
+	if (!err) {
+		struct fuse_intr_data d;
+		fuse_fill_dir_t filler = fill_dir;
+
+		if (flags & FUSE_READDIR_PLUS)
+			filler = fill_dir_plus;
+
+		readdir_fill_init(req, size, dh);
+		fuse_prepare_interrupt(f, req, &d);
+		err = fuse_fs_readdir(f->fs, path, dh, filler, off, fi, flags);
+		fuse_finish_interrupt(f, req, &d);
+		err = readdir_fill_finish(f, ino, path, dh, flags, use_cache,
+					  epoch, err);
+	}
+	return err;
+}
+
+/*
+ * Attribute prefetch for readdirplus (-o readdirplus_prefetch=N)
+ *
+ * If the filesystem doesn't pass attributes to the filler, entries
+ * would go to the kernel without them, and each would be looked up
+ * separately later.  Instead the entries that fit into the reply are
+ * looked up by a pool of N worker threads, so that the getattr calls
+ * for one reply run in parallel.  The pool is started on first use,
+ * since the filesystem may still fork after fuse_new().
+ */
+struct prefetch_item {
+	const char *name;
+	int lookup;
+	int err;
+	struct fuse_entry_param e;
+};
+
+struct prefetch_batch {
+	struct list_head list;
+	fuse_ino_t parent;
+	struct fuse_context ctx;
+	struct prefetch_item *items;
+	int count;
+	int next;
+	int done;
+};
+
+/* Called with pool->lock held, returns 0 if the batch has no more work */
+static int prefetch_one(struct fuse *f, struct prefetch_batch *b,
+			struct fuse_context_i *c)
+{
+	struct prefetch_pool *pool = &f->prefetch;
+	struct prefetch_item *item;
+	char *path;
+
+	while (b->next < b->count && !b->items[b->next].lookup)
+		b->next++;
+	if (b->next == b->count) {
+		if (!list_empty(&b->list)) {
+			list_del(&b->list);
+			init_list_head(&b->list);
+		}
+		return 0;
+	}
+	item = &b->items[b->next++];
+	pthread_mutex_unlock(&pool->lock);
+
+	c->ctx = b->ctx;
+	item->err = get_path_name(f, b->parent, item->name, &path);
+	if (!item->err) {
+		item->err = lookup_path(f, b->parent, item->name, path,
+					&item->e, NULL);
+		free_path(f, b->parent, path);
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	b->done++;
+	pthread_cond_broadcast(&pool->done_cond);
+	return 1;
+}
+
+static void *prefetch_worker(void *data)
+{
+	struct fuse *f = (struct fuse *) data;
+	struct prefetch_pool *pool = &f->prefetch;
+	struct fuse_context_i *c = fuse_create_context(f);
+
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->exit) {
+		struct prefetch_batch *b;
+
+		if (list_empty(&pool->batches)) {
+			pthread_cond_wait(&pool->cond, &pool->lock);
+			continue;
+		}
+		b = list_entry(pool->batches.next, struct prefetch_batch, list);
+		prefetch_one(f, b, c);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+/* Called with pool->lock held */
+static void prefetch_start(struct fuse *f)
+{
+	struct prefetch_pool *pool = &f->prefetch;
+	int n = f->conf.readdirplus_prefetch;
+	int i;
+
+	pool->started = 1;
+	pool->threads = calloc(n, sizeof(pthread_t));
+	if (!pool->threads)
+		return;
+
+	for (i = 0; i < n; i++) {
+		if (fuse_start_thread(&pool->threads[i], prefetch_worker, f))
+			break;
+	}
+	pool->nthreads = i;
+}
+
+static void prefetch_stop(struct fuse *f)
+{
+	struct prefetch_pool *pool = &f->prefetch;
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->exit = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+	free(pool->threads);
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+}
+
+static void prefetch_attrs(struct fuse *f, fuse_ino_t parent,
+			   struct prefetch_item *items, int count)
+{
+	struct prefetch_pool *pool = &f->prefetch;
+	struct prefetch_batch b = {
+		.parent = parent,
+		.ctx = *fuse_get_context(),
+		.items = items,
+		.count = count,
+	};
+	int todo = 0;
+	int i;
+
+	for (i = 0; i < count; i++)
+		todo += items[i].lookup;
+
+	pthread_mutex_lock(&pool->lock);
+	if (!pool->started)
+		prefetch_start(f);
+	if (!pool->nthreads) {
+		/* Couldn't start any workers, do it ourselves */
+		init_list_head(&b.list);
+		while (prefetch_one(f, &b, fuse_get_context_internal()));
+	} else {
+		list_add_tail(&b.list, &pool->batches);
+		pthread_cond_broadcast(&pool->cond);
+	}
+	while (b.done < todo)
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+	if (!list_empty(&b.list))
+		list_del(&b.list);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * A file with more than one link can be changed through a name in
+ * another directory, which doesn't drop this directory's cached
+ * listing.  Its attributes from the listing are therefore not sent,
+ * and the kernel looks it up instead.
+ */
+static int dir_cache_stale(struct fuse_dh *dh, const struct fuse_direntry *de)
+{
+	return dh->dir && !S_ISDIR(de->stat.st_mode) && de->stat.st_nlink > 1;
+}
+
+static int readdir_fill_prefetch(fuse_req_t req, struct fuse_dh *dh,
+				 struct fuse_direntry *de, off_t pos)
+{
+	struct fuse *f = dh->fuse;
+	struct prefetch_item *items;
+	struct fuse_direntry *d;
+	unsigned len = 0;
+	int count = 0;
+	int todo = 0;
+	int i;
+	int res;
+
+	/* The size of an entry doesn't depend on its attributes */
+	for (d = de; d; d = d->next) {
+		unsigned thislen = fuse_add_direntry_plus(req, NULL, 0, d->name,
+							  NULL, 0);
+		if (len + thislen > dh->needlen)
+			break;
+		len += thislen;
+		count++;
+	}
+	if (!count)
+		return 0;
+
+	items = calloc(count, sizeof(struct prefetch_item));
+	if (!items)
+		return -ENOMEM;
+
+	for (d = de, i = 0; i < count; d = d->next, i++) {
+		items[i].name = d->name;
+		if (!d->attr_valid && !is_dot_or_dotdot(d->name)) {
+			items[i].lookup = 1;
+			todo++;
+		}
+	}
+	if (todo)
+		prefetch_attrs(f, dh->nodeid, items, count);
+
+	for (d = de, i = 0; i < count; d = d->next, i++) {
+		struct fuse_entry_param e = {
+			.ino = 0,
+			.attr = d->stat,
+		};
+
+		if (items[i].lookup) {
+			/* Let the kernel look up entries that failed */
+			if (!items[i].err)
+				e = items[i].e;
+		} else if (!is_dot_or_dotdot(d->name) &&
+			   !dir_cache_stale(dh, d)) {
+			res = do_lookup(f, dh->nodeid, d->name, &e);
+			if (res) {
+				dh->error = res;
+				free(items);
+				return 1;
+			}
+		}
+		dh->len += fuse_add_direntry_plus(req, dh->contents + dh->len,
+						  dh->needlen - dh->len,
+						  d->name, &e, ++pos);
+	}
+	free(items);
+
+	return 0;
+}
+
+static int readdir_fill_from_list(fuse_req_t req, struct fuse_dh *dh,
+				  off_t off, enum fuse_readdir_flags flags)
+{
+	off_t pos;
+	struct fuse_direntry *de = dh->first;
+	int res;
+
+	dh->len = 0;
+
+	if (extend_contents(dh, dh->needlen) == -1)
+		return dh->error;
+
+	for (pos = 0; pos < off; pos++) {
+		if (!de)
+			break;
+
+		de = de->next;
+	}
+	if ((flags & FUSE_READDIR_PLUS) && dh->fuse->conf.readdirplus_prefetch)
+		return readdir_fill_prefetch(req, dh, de, pos);
+
+	while (de) {
+		char *p = dh->contents + dh->len;
+		unsigned rem = dh->needlen - dh->len;
+		unsigned thislen;
+		unsigned newlen;
+		pos++;
+
+		if (flags & FUSE_READDIR_PLUS) {
+			struct fuse_entry_param e = {
+				.ino = 0,
+				.attr = de->stat,
+			};
+
+			if (!is_dot_or_dotdot(de->name) &&
+			    !dir_cache_stale(dh, de)) {
+				res = do_lookup(dh->fuse, dh->nodeid,
+						de->name, &e);
+				if (res) {
+					dh->error = res;
+					return 1;
+				}
+			}
+
+			thislen = fuse_add_direntry_plus(req, p, rem,
+							 de->name, &e, pos);
+		} else {
+			thislen = fuse_add_direntry(req, p, rem,
+						    de->name, &de->stat, pos);
+		}
+		newlen = dh->len + thislen;
+		if (newlen > dh->needlen)
+			break;
+		dh->len = newlen;
+		de = de->next;
+	}
+	return 0;
+}
+
+/*
+ * Streaming readdir (-o readdir_stream)
+ *
+ * Instead of collecting the whole directory before the first reply, the
+ * filesystem's readdir is run in a separate thread per directory
+ * handle.  Its filler puts entries straight into the reply buffer, and
+ * when that is full it waits until the next READDIR request provides a
+ * new one.  Memory used per handle is thus bounded by the size of a
+ * single reply.  Entries are numbered in the order the filesystem
+ * returns them, and these numbers are passed to the kernel as offsets.
+ * If a request asks for an offset other than the next one (e.g. after
+ * rewinddir or seekdir), readdir is restarted and entries are skipped
+ * up to that offset.  Filesystems that pass their own offsets to the
+ * filler are instead restarted at the requested offset, and their
+ * offsets are passed on unchanged.
+ */
+static int fill_dir_stream(void *dh_, const char *name,
+			   const struct stat *statp, off_t off,
+			   enum fuse_fill_dir_flags flags)
+{
+	struct fuse_dh *dh = (struct fuse_dh *) dh_;
+	struct fuse_entry_param e = {
+		.ino = 0,
+	};
+	struct stat stbuf;
+	off_t pos;
+	size_t len;
+	int plus = dh->stream_flags & FUSE_READDIR_PLUS;
+	int res;
+
+	if ((flags & ~FUSE_FILL_DIR_PLUS) != 0) {
+		dh->error = -EIO;
+		return 1;
+	}
+
+	if (off) {
+		/* readdir was started at stream_skip */
+		pos = off;
+	} else {
+		pos = ++dh->stream_next;
+		if (pos <= dh->stream_skip)
+			return 0;
+	}
+
+	if (plus) {
+		fill_dir_plus_attr(dh, name, statp, flags, &e);
+		len = fuse_add_direntry_plus(NULL, NULL, 0, name, NULL, 0);
+	} else {
+		fill_dir_stat(dh, name, statp, &stbuf);
+		len = fuse_add_direntry(NULL, NULL, 0, name, NULL, 0);
+	}
+
+	pthread_mutex_lock(&dh->lock);
+	while (!dh->stream_cancel &&
+	       (dh->stream_state != STREAM_FILL ||
+		dh->len + len > dh->needlen)) {
+		if (dh->stream_state == STREAM_FILL) {
+			/* Doesn't fit, hand the buffer to the request */
+			if (dh->len == 0) {
+				dh->error = -EIO;
+				dh->stream_cancel = 1;
+				break;
+			}
+			dh->stream_state = STREAM_FULL;
+			pthread_cond_broadcast(&dh->stream_cond);
+		}
+		pthread_cond_wait(&dh->stream_cond, &dh->lock);
+	}
+	if (dh->stream_cancel) {
+		pthread_mutex_unlock(&dh->lock);
+		return 1;
+	}
+
+	if (plus) {
+		if (statp && (flags & FUSE_FILL_DIR_PLUS) &&
+		    !is_dot_or_dotdot(name)) {
+			res = do_lookup(dh->fuse, dh->nodeid, name, &e);
+			if (res) {
+				dh->error = res;
+				dh->stream_cancel = 1;
+				pthread_mutex_unlock(&dh->lock);
+				return 1;
+			}
+		}
+		dh->len += fuse_add_direntry_plus(dh->req, dh->contents + dh->len,
+						  dh->needlen - dh->len, name,
+						  &e, pos);
+	} else {
+		dh->len += fuse_add_direntry(dh->req, dh->contents + dh->len,
+					     dh->needlen - dh->len, name,
+					     &stbuf, pos);
+	}
+	dh->stream_pos = pos;
+	pthread_mutex_unlock(&dh->lock);
+
+	return 0;
+}
+
+static void *readdir_stream_thread(void *dh_)
+{
+	struct fuse_dh *dh = (struct fuse_dh *) dh_;
+	struct fuse *f = dh->fuse;
+	struct fuse_context_i *c = fuse_create_context(f);
+	int err;
+
+	/* Run as the process that opened the directory */
+	c->ctx = dh->stream_ctx;
+
+	err = fuse_fs_readdir(f->fs, dh->stream_path, dh, fill_dir_stream,
+			      dh->stream_skip, &dh->stream_fi,
+			      dh->stream_flags);
+
+	pthread_mutex_lock(&dh->lock);
+	if (!dh->error)
+		dh->error = err;
+	dh->stream_state = STREAM_DONE;
+	pthread_cond_broadcast(&dh->stream_cond);
+	pthread_mutex_unlock(&dh->lock);
+
+	return NULL;
+}
+
+/* Called with dh->lock held */
+static void readdir_stream_stop(struct fuse_dh *dh)
+{
+	if (dh->stream_state == STREAM_NONE)
+		return;
+
+	dh->stream_cancel = 1;
+	pthread_cond_broadcast(&dh->stream_cond);
+	pthread_mutex_unlock(&dh->lock);
+	pthread_join(dh->stream_thread, NULL);
+	pthread_mutex_lock(&dh->lock);
+
+	dh->stream_state = STREAM_NONE;
+	free(dh->stream_path);
+	dh->stream_path = NULL;
+}
+
+/* Called with dh->lock held */
+static int readdir_stream_start(struct fuse *f, fuse_ino_t ino, off_t off,
+				struct fuse_dh *dh, struct fuse_file_info *fi,
+				enum fuse_readdir_flags flags)
+{
+	char *path;
+	int err;
+
+	/*
+	 * Don't keep the path locked while the reader thread waits for
+	 * requests, since that would block renames in the directory.
+	 */
+	if (f->fs->op.readdir)
+		err = get_path_nullok(f, ino, &path);
+	else
+		err = get_path(f, ino, &path);
+	if (err)
+		return err;
+
+	dh->stream_path = NULL;
+	if (path) {
+		dh->stream_path = strdup(path);
+		free_path(f, ino, path);
+		if (!dh->stream_path)
+			return -ENOMEM;
+	}
+
+	dh->stream_fi = *fi;
+	dh->stream_flags = flags;
+	dh->stream_ctx = *fuse_get_context();
+	dh->stream_skip = off;
+	dh->stream_next = 0;
+	dh->stream_pos = off;
+	dh->stream_cancel = 0;
+	dh->error = 0;
+	dh->stream_state = STREAM_FULL;
 
-static void free_direntries(struct fuse_direntry *de)
-{
-	while (de) {
-		struct fuse_direntry *next = de->next;
-		free(de->name);
-		free(de);
-		de = next;
+	err = fuse_start_thread(&dh->stream_thread, readdir_stream_thread, dh);
+	if (err) {
+		dh->stream_state = STREAM_NONE;
+		free(dh->stream_path);
+		dh->stream_path = NULL;
+		return -EIO;
 	}
+	return 0;
 }
 
-static int readdir_fill(struct fuse *f, fuse_req_t req, fuse_ino_t ino,
-			size_t size, off_t off, struct fuse_dh *dh,
-			struct fuse_file_info *fi,
-			enum fuse_readdir_flags flags)
+static void readdir_stream(fuse_req_t req, fuse_ino_t ino, size_t size,
+			   off_t off, struct fuse_dh *dh,
+			   struct fuse_file_info *fi,
+			   enum fuse_readdir_flags flags)
 {
-	char *path;
+	struct fuse *f = dh->fuse;
 	int err;
 
-	if (f->fs->op.readdir)
-		err = get_path_nullok(f, ino, &path);
-	else
-		err = get_path(f, ino, &path);
-	if (!err) {
-		struct fuse_intr_data d;
-		fuse_fill_dir_t filler = fill_dir;
+	if (dh->stream_state != STREAM_NONE &&
+	    (off != dh->stream_pos || flags != dh->stream_flags))
+		readdir_stream_stop(dh);
 
-		if (flags & FUSE_READDIR_PLUS)
-			filler = fill_dir_plus;
+	if (dh->stream_state == STREAM_NONE) {
+		err = readdir_stream_start(f, ino, off, dh, fi, flags);
+		if (err) {
+			reply_err(req, err);
+			return;
+		}
+	}
 
-		free_direntries(dh->first);
-		dh->first = NULL;
-		dh->last = &dh->first;
-		dh->len = 0;
-		dh->error = 0;
-		dh->needlen = size;
-		dh->filled = 0;
+	dh->len = 0;
+	dh->needlen = size;
+	if (extend_contents(dh, size) == -1) {
+		reply_err(req, dh->error);
+		return;
+	}
+
+	if (dh->stream_state == STREAM_FULL) {
 		dh->req = req;
-		fuse_prepare_interrupt(f, req, &d);
-		err = fuse_fs_readdir(f->fs, path, dh, filler, off, fi, flags);
-		fuse_finish_interrupt(f, req, &d);
+		dh->stream_state = STREAM_FILL;
+		pthread_cond_broadcast(&dh->stream_cond);
+		while (dh->stream_state == STREAM_FILL)
+			pthread_cond_wait(&dh->stream_cond, &dh->lock);
 		dh->req = NULL;
-		if (!err)
-			err = dh->error;
-		if (err)
-			dh->filled = 0;
-		free_path(f, ino, path);
 	}
-	return err;
+
+	if (dh->len == 0 && dh->error)
+		reply_err(req, dh->error);
+	else
+		fuse_reply_buf(req, dh->contents, dh->len);
 }
 
-static int readdir_fill_from_list(fuse_req_t req, struct fuse_dh *dh,
-				  off_t off, enum fuse_readdir_flags flags)
+static void readdir_reply(fuse_req_t req, struct fuse_dh *dh, size_t size,
+			  off_t off, enum fuse_readdir_flags flags)
 {
-	off_t pos;
-	struct fuse_direntry *de = dh->first;
-	int res;
+	int err;
 
-	dh->len = 0;
+	if (dh->filled) {
+		dh->needlen = size;
+		err = readdir_fill_from_list(req, dh, off, flags);
+		if (err) {
+			reply_err(req, err);
+			return;
+		}
+	}
+	fuse_reply_buf(req, dh->contents, dh->len);
+}
 
-	if (extend_contents(dh, dh->needlen) == -1)
-		return dh->error;
+static void readdir_async_complete(struct fuse_async *a, int err)
+{
+	struct fuse_dh *dh = a->dh;
 
-	for (pos = 0; pos < off; pos++) {
-		if (!de)
-			break;
+	pthread_mutex_lock(&dh->lock);
+	err = readdir_fill_finish(a->f, a->ino, a->path, dh, a->flags,
+				  a->use_cache, a->epoch, err);
+	if (err)
+		reply_err(a->req, err);
+	else
+		readdir_reply(a->req, dh, a->size, a->off, a->flags);
+	dh->async_busy = 0;
+	pthread_cond_broadcast(&dh->async_cond);
+	pthread_mutex_unlock(&dh->lock);
+}
 
-		de = de->next;
-	}
-	while (de) {
-		char *p = dh->contents + dh->len;
-		unsigned rem = dh->needlen - dh->len;
-		unsigned thislen;
-		unsigned newlen;
-		pos++;
+/*
+ * Like readdir_fill(), but only prepares the asynchronous call in *ap,
+ * which the caller starts with readdir_async_start() after releasing
+ * dh->lock.  Until the operation has completed, dh is marked busy.
+ */
+static int readdir_fill_async(struct fuse *f, fuse_req_t req, fuse_ino_t ino,
+			      size_t size, off_t off, struct fuse_dh *dh,
+			      struct fuse_file_info *fi,
+			      enum fuse_readdir_flags flags,
+			      struct fuse_async **ap)
+{
+	int use_cache = dh->mtime_valid && !off;
+	struct fuse_async *a;
+	uint64_t epoch = 0;
+	char *path;
+	int err;
 
-		if (flags & FUSE_READDIR_PLUS) {
-			struct fuse_entry_param e = {
-				.ino = 0,
-				.attr = de->stat,
-			};
+	if (use_cache) {
+		if (get_dir_cache(f, ino, dh, flags))
+			return 0;
 
-			if (!is_dot_or_dotdot(de->name)) {
-				res = do_lookup(dh->fuse, dh->nodeid,
-						de->name, &e);
-				if (res) {
-					dh->error = res;
-					return 1;
-				}
-			}
+		pthread_mutex_lock(&f->lock);
+		epoch = f->dir_epoch;
+		pthread_mutex_unlock(&f->lock);
+	}
 
-			thislen = fuse_add_direntry_plus(req, p, rem,
-							 de->name, &e, pos);
-		} else {
-			thislen = fuse_add_direntry(req, p, rem,
-						    de->name, &de->stat, pos);
-		}
-		newlen = dh->len + thislen;
-		if (newlen > dh->needlen)
-			break;
-		dh->len = newlen;
-		de = de->next;
+	err = get_path_nullok(f, ino, &path);
+	if (err)
+		return err;
+
+	a = fuse_async_new(f, req, ino, path, readdir_async_complete, 0);
+	if (a == NULL) {
+		free_path(f, ino, path);
+		return -ENOMEM;
 	}
+	a->size = size;
+	a->off = off;
+	a->fi = *fi;
+	a->epoch = epoch;
+	a->dh = dh;
+	a->flags = flags;
+	a->use_cache = use_cache;
+
+	readdir_fill_init(req, size, dh);
+	dh->async_busy = 1;
+	*ap = a;
 	return 0;
 }
 
+static void readdir_async_start(struct fuse_async *a)
+{
+	struct fuse_fs *fs = a->f->fs;
+	fuse_fill_dir_t filler = fill_dir;
+	int res;
+
+	if (a->flags & FUSE_READDIR_PLUS)
+		filler = fill_dir_plus;
+
+	fuse_get_context()->private_data = fs->user_data;
+	if (fs->debug) {
+		fuse_log(FUSE_LOG_DEBUG, "readdir%s_async[%llu] from %llu\n",
+			(a->flags & FUSE_READDIR_PLUS) ? "plus" : "",
+			(unsigned long long) a->fi.fh,
+			(unsigned long long) a->off);
+	}
+	res = fs->op.readdir_async(a->path, a->dh, filler, a->off, &a->fi,
+				   a->flags, a);
+	fuse_async_started(a, res);
+}
+
 static void fuse_readdir_common(fuse_req_t req, fuse_ino_t ino, size_t size,
 				off_t off, struct fuse_file_info *llfi,
 				enum fuse_readdir_flags flags)
@@ -3730,27 +5593,39 @@ static void fuse_readdir_common(fuse_req_t req, fuse_ino_t ino, size_t size,
 	int err;
 
 	pthread_mutex_lock(&dh->lock);
+	while (dh->async_busy)
+		pthread_cond_wait(&dh->async_cond, &dh->lock);
+	if (f->conf.readdir_stream) {
+		readdir_stream(req, ino, size, off, dh, &fi, flags);
+		goto out;
+	}
+
 	/* According to SUS, directory contents need to be refreshed on
 	   rewinddir() */
 	if (!off)
 		dh->filled = 0;
 
 	if (!dh->filled) {
-		err = readdir_fill(f, req, ino, size, off, dh, &fi, flags);
+		struct fuse_async *a = NULL;
+
+		if (f->fs->op.readdir_async)
+			err = readdir_fill_async(f, req, ino, size, off, dh,
+						 &fi, flags, &a);
+		else
+			err = readdir_fill(f, req, ino, size, off, dh, &fi,
+					   flags);
 		if (err) {
 			reply_err(req, err);
 			goto out;
 		}
-	}
-	if (dh->filled) {
-		dh->needlen = size;
-		err = readdir_fill_from_list(req, dh, off, flags);
-		if (err) {
-			reply_err(req, err);
-			goto out;
+		if (a) {
+			/* The filesystem may complete this right away */
+			pthread_mutex_unlock(&dh->lock);
+			readdir_async_start(a);
+			return;
 		}
 	}
-	fuse_reply_buf(req, dh->contents, dh->len);
+	readdir_reply(req, dh, size, off, flags);
 out:
 	pthread_mutex_unlock(&dh->lock);
 }
@@ -3784,9 +5659,14 @@ static void fuse_lib_releasedir(fuse_req_t req, fuse_ino_t ino,
 	free_path(f, ino, path);
 
 	pthread_mutex_lock(&dh->lock);
+	readdir_stream_stop(dh);
+	while (dh->async_busy)
+		pthread_cond_wait(&dh->async_cond, &dh->lock);
 	pthread_mutex_unlock(&dh->lock);
 	pthread_mutex_destroy(&dh->lock);
-	free_direntries(dh->first);
+	pthread_cond_destroy(&dh->stream_cond);
+	pthread_cond_destroy(&dh->async_cond);
+	free_dh_entries(f, dh);
 	free(dh->contents);
 	free(dh);
 	reply_err(req, 0);
@@ -3852,6 +5732,8 @@ static void fuse_lib_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
 		err = fuse_fs_setxattr(f->fs, path, name, value, size, flags);
 		fuse_finish_interrupt(f, req, &d);
 		free_path(f, ino, path);
+		if (!err)
+			invalidate_attr(f, ino, NULL);
 	}
 	reply_err(req, err);
 }
@@ -3957,39 +5839,166 @@ static void fuse_lib_removexattr(fuse_req_t req, fuse_ino_t ino,
 		err = fuse_fs_removexattr(f->fs, path, name);
 		fuse_finish_interrupt(f, req, &d);
 		free_path(f, ino, path);
+		if (!err)
+			invalidate_attr(f, ino, NULL);
 	}
 	reply_err(req, err);
 }
 
-static struct lock *locks_conflict(struct node *node, const struct lock *lock)
+/*
+ * The POSIX locks of a node are kept in an interval tree: a treap
+ * ordered by start offset, where each lock also records the largest
+ * end offset in its subtree.  Locks of one owner never overlap, but
+ * locks of different owners may, so the subtree maximum is what allows
+ * skipping subtrees that can't touch a given range.
+ */
+static int lock_cmp(const struct lock *a, const struct lock *b)
 {
-	struct lock *l;
+	if (a->start != b->start)
+		return a->start < b->start ? -1 : 1;
+	if (a != b)
+		return (uintptr_t) a < (uintptr_t) b ? -1 : 1;
+	return 0;
+}
 
-	for (l = node->locks; l; l = l->next)
-		if (l->owner != lock->owner &&
-		    lock->start <= l->end && l->start <= lock->end &&
-		    (l->type == F_WRLCK || lock->type == F_WRLCK))
-			break;
+static void lock_update(struct lock *l)
+{
+	l->maxend = l->end;
+	if (l->left && l->left->maxend > l->maxend)
+		l->maxend = l->left->maxend;
+	if (l->right && l->right->maxend > l->maxend)
+		l->maxend = l->right->maxend;
+}
+
+static struct lock *lock_tree_merge(struct lock *a, struct lock *b)
+{
+	if (a == NULL)
+		return b;
+	if (b == NULL)
+		return a;
+	if (a->prio > b->prio) {
+		a->right = lock_tree_merge(a->right, b);
+		lock_update(a);
+		return a;
+	} else {
+		b->left = lock_tree_merge(a, b->left);
+		lock_update(b);
+		return b;
+	}
+}
+
+static struct lock *lock_tree_insert(struct lock *root, struct lock *lock)
+{
+	struct lock *x;
+
+	if (root == NULL) {
+		lock->left = lock->right = NULL;
+		lock_update(lock);
+		return lock;
+	}
+	if (lock_cmp(lock, root) < 0) {
+		root->left = lock_tree_insert(root->left, lock);
+		if (root->left->prio > root->prio) {
+			x = root->left;
+			root->left = x->right;
+			x->right = root;
+			lock_update(root);
+			root = x;
+		}
+	} else {
+		root->right = lock_tree_insert(root->right, lock);
+		if (root->right->prio > root->prio) {
+			x = root->right;
+			root->right = x->left;
+			x->left = root;
+			lock_update(root);
+			root = x;
+		}
+	}
+	lock_update(root);
+	return root;
+}
+
+static struct lock *lock_tree_delete(struct lock *root, struct lock *lock)
+{
+	int cmp = lock_cmp(lock, root);
+
+	if (cmp == 0)
+		return lock_tree_merge(root->left, root->right);
+	if (cmp < 0)
+		root->left = lock_tree_delete(root->left, lock);
+	else
+		root->right = lock_tree_delete(root->right, lock);
+	lock_update(root);
+	return root;
+}
+
+static void insert_lock(struct node *node, struct lock *lock)
+{
+	/* Cheap pseudo-random priority, that's all a treap needs */
+	lock->prio = (unsigned int) (((uintptr_t) lock * 2654435761u) >> 8);
+	node->locks = lock_tree_insert(node->locks, lock);
+}
+
+static void delete_lock(struct node *node, struct lock *lock)
+{
+	node->locks = lock_tree_delete(node->locks, lock);
+}
+
+static struct lock *lock_tree_conflict(struct lock *l, const struct lock *lock)
+{
+	struct lock *found;
+
+	if (l == NULL || l->maxend < lock->start)
+		return NULL;
+
+	found = lock_tree_conflict(l->left, lock);
+	if (found)
+		return found;
+	if (lock->end < l->start)
+		return NULL;
+
+	if (l->owner != lock->owner &&
+	    lock->start <= l->end &&
+	    (l->type == F_WRLCK || lock->type == F_WRLCK))
+		return l;
 
-	return l;
+	return lock_tree_conflict(l->right, lock);
 }
 
-static void delete_lock(struct lock **lockp)
+static struct lock *locks_conflict(struct node *node, const struct lock *lock)
 {
-	struct lock *l = *lockp;
-	*lockp = l->next;
-	free(l);
+	return lock_tree_conflict(node->locks, lock);
 }
 
-static void insert_lock(struct lock **pos, struct lock *lock)
+/*
+ * Append the locks of owner that overlap or are adjacent to
+ * [start, end] to the list at *tailp, in order of their start offset
+ */
+static void locks_collect(struct lock *l, uint64_t owner, off_t start,
+			  off_t end, struct lock ***tailp)
 {
-	lock->next = *pos;
-	*pos = lock;
+	if (l == NULL || l->maxend < start - 1)
+		return;
+
+	locks_collect(l->left, owner, start, end, tailp);
+	if (end < l->start - 1)
+		return;
+
+	if (l->owner == owner && start - 1 <= l->end) {
+		l->next = NULL;
+		**tailp = l;
+		*tailp = &l->next;
+	}
+	locks_collect(l->right, owner, start, end, tailp);
 }
 
 static int locks_insert(struct node *node, struct lock *lock)
 {
-	struct lock **lp;
+	struct lock *list = NULL;
+	struct lock **tail = &list;
+	struct lock *l;
+	struct lock *next;
 	struct lock *newl1 = NULL;
 	struct lock *newl2 = NULL;
 
@@ -4005,54 +6014,52 @@ static int locks_insert(struct node *node, struct lock *lock)
 		}
 	}
 
-	for (lp = &node->locks; *lp;) {
-		struct lock *l = *lp;
-		if (l->owner != lock->owner)
-			goto skip;
+	locks_collect(node->locks, lock->owner, lock->start, lock->end, &tail);
+
+	for (l = list; l; l = l->next) {
+		if (l->type == lock->type &&
+		    l->start <= lock->start && lock->end <= l->end)
+			goto out;
+	}
+
+	for (l = list; l; l = next) {
+		next = l->next;
 
 		if (lock->type == l->type) {
-			if (l->end < lock->start - 1)
-				goto skip;
-			if (lock->end < l->start - 1)
-				break;
-			if (l->start <= lock->start && lock->end <= l->end)
-				goto out;
 			if (l->start < lock->start)
 				lock->start = l->start;
 			if (lock->end < l->end)
 				lock->end = l->end;
 			goto delete;
 		} else {
-			if (l->end < lock->start)
-				goto skip;
-			if (lock->end < l->start)
-				break;
+			if (l->end < lock->start || lock->end < l->start)
+				continue;
 			if (lock->start <= l->start && l->end <= lock->end)
 				goto delete;
-			if (l->end <= lock->end) {
-				l->end = lock->start - 1;
-				goto skip;
+
+			/* Locks are keyed by start offset, so re-insert */
+			delete_lock(node, l);
+			if (l->start < lock->start && lock->end < l->end) {
+				*newl2 = *l;
+				newl2->start = lock->end + 1;
+				insert_lock(node, newl2);
+				newl2 = NULL;
 			}
-			if (lock->start <= l->start) {
+			if (l->start < lock->start)
+				l->end = lock->start - 1;
+			else
 				l->start = lock->end + 1;
-				break;
-			}
-			*newl2 = *l;
-			newl2->start = lock->end + 1;
-			l->end = lock->start - 1;
-			insert_lock(&l->next, newl2);
-			newl2 = NULL;
+			insert_lock(node, l);
+			continue;
 		}
-	skip:
-		lp = &l->next;
-		continue;
 
 	delete:
-		delete_lock(lp);
+		delete_lock(node, l);
+		free(l);
 	}
 	if (lock->type != F_UNLCK) {
 		*newl1 = *lock;
-		insert_lock(lp, newl1);
+		insert_lock(node, newl1);
 		newl1 = NULL;
 	}
 out:
@@ -4340,6 +6347,8 @@ static void fuse_lib_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
 		err = fuse_fs_fallocate(f->fs, path, mode, offset, length, fi);
 		fuse_finish_interrupt(f, req, &d);
 		free_path(f, ino, path);
+		if (!err)
+			invalidate_attr(f, ino, NULL);
 	}
 	reply_err(req, err);
 }
@@ -4374,6 +6383,8 @@ static void fuse_lib_copy_file_range(fuse_req_t req, fuse_ino_t nodeid_in,
 				      fi_out, off_out, len, flags);
 	fuse_finish_interrupt(f, req, &d);
 
+	if (res > 0)
+		invalidate_attr(f, nodeid_out, NULL);
 	if (res >= 0)
 		fuse_reply_write(req, res);
 	else
@@ -4429,40 +6440,83 @@ static int clean_delay(struct fuse *f)
 int fuse_clean_cache(struct fuse *f)
 {
 	struct node_lru *lnode;
-	struct list_head *curr, *next;
 	struct node *node;
 	struct timespec now;
+	struct timespec start, end;
+	uint64_t hold_ns;
+	int batch;
+	bool done = false;
 
-	pthread_mutex_lock(&f->lock);
+	/* With "noforget" nodes are only evicted by the node budget */
+	if (f->conf.remember < 0)
+		return clean_delay(f);
 
 	curr_time(&now);
 
-	for (curr = f->lru_table.next; curr != &f->lru_table; curr = next) {
-		double age;
-
-		next = curr->next;
-		lnode = list_entry(curr, struct node_lru, lru);
-		node = &lnode->node;
-
-		age = diff_timespec(&now, &lnode->forget_time);
-		if (age <= f->conf.remember)
-			break;
+	/*
+	 * Expire nodes in bounded batches and drop the lock in between, so
+	 * that a large number of nodes expiring at the same time doesn't
+	 * stall all other operations.  Batches always restart at the head
+	 * of the LRU list, nodes that can't be forgotten yet are moved to
+	 * the tail, so they don't need to be skipped again.
+	 */
+	while (!done) {
+		pthread_mutex_lock(&f->lock);
+		curr_time(&start);
+		for (batch = CLEAN_BATCH_SIZE; batch; batch--) {
+			double age;
 
-		assert(node->nlookup == 1);
+			if (list_empty(&f->lru_table)) {
+				done = true;
+				break;
+			}
+			lnode = list_entry(f->lru_table.next, struct node_lru, lru);
+			node = &lnode->node;
 
-		/* Don't forget active directories */
-		if (node->refctr > 1)
-			continue;
+			age = diff_timespec(&now, &lnode->forget_time);
+			if (age <= f->conf.remember) {
+				done = true;
+				break;
+			}
 
-		node->nlookup = 0;
-		unhash_name(f, node);
-		unref_node(f, node);
+			/* Don't forget active directories */
+			if (node->refctr > 1 || node->treelock)
+				set_forget_time(f, node);
+			else
+				forget_lru_node(f, node);
+		}
+		curr_time(&end);
+		hold_ns = (end.tv_sec - start.tv_sec) * 1000000000ULL +
+			end.tv_nsec - start.tv_nsec;
+		if (hold_ns > f->clean_max_hold_ns)
+			f->clean_max_hold_ns = hold_ns;
+		f->clean_batches++;
+		pthread_mutex_unlock(&f->lock);
 	}
-	pthread_mutex_unlock(&f->lock);
+	release_empty_slabs(f);
 
 	return clean_delay(f);
 }
 
+void fuse_get_stats(struct fuse *f, struct fuse_stats *stats)
+{
+	pthread_mutex_lock(&f->lock);
+	stats->nodes = f->nodes;
+	stats->name_bytes = f->name_bytes;
+	stats->evictions = f->evictions;
+	stats->forgets = f->forgets;
+	stats->forget_batches = f->forget_batches;
+	stats->attr_hits = f->attr_hits;
+	stats->attr_misses = f->attr_misses;
+	stats->neg_entries = f->neg_table.use;
+	stats->neg_hits = f->neg_table.hits;
+	stats->dir_hits = f->dir_hits;
+	stats->reclaimed = f->reclaim.freed;
+	stats->clean_batches = f->clean_batches;
+	stats->clean_max_hold_ns = f->clean_max_hold_ns;
+	pthread_mutex_unlock(&f->lock);
+}
+
 static struct fuse_lowlevel_ops fuse_path_ops = {
 	.init = fuse_lib_init,
 	.destroy = fuse_lib_destroy,
@@ -4575,7 +6629,7 @@ int fuse_loop(struct fuse *f)
 	if (!f)
 		return -1;
 
-	if (lru_enabled(f))
+	if (f->conf.remember > 0)
 		return fuse_session_loop_remember(f);
 
 	return fuse_session_loop(f->se);
@@ -4650,7 +6704,7 @@ struct fuse_context *fuse_get_context(void)
 int fuse_getgroups(int size, gid_t list[])
 {
 	struct fuse_context_i *c = fuse_get_context_internal();
-	if (!c)
+	if (!c || !c->req)
 		return -EINVAL;
 
 	return fuse_req_getgroups(c->req, size, list);
@@ -4660,19 +6714,48 @@ int fuse_interrupted(void)
 {
 	struct fuse_context_i *c = fuse_get_context_internal();
 
-	if (c)
+	if (c && c->req)
 		return fuse_req_interrupted(c->req);
 	else
 		return 0;
 }
 
+static void invalidate_negative_path(struct fuse *f, const char *path)
+{
+	fuse_ino_t ino;
+	char *buf;
+	const char *dir = "";
+	char *name;
+
+	if (f->neg_table.array == NULL)
+		return;
+
+	buf = strdup(path);
+	if (buf == NULL)
+		return;
+
+	name = strrchr(buf, '/');
+	if (name) {
+		*name++ = '\0';
+		dir = buf;
+	} else {
+		name = buf;
+	}
+	if (*name && lookup_path_in_cache(f, dir, &ino) == 0)
+		invalidate_negative(f, ino, name);
+	free(buf);
+}
+
 int fuse_invalidate_path(struct fuse *f, const char *path) {
 	fuse_ino_t ino;
 	int err = lookup_path_in_cache(f, path, &ino);
+	if (err == -ENOENT)
+		invalidate_negative_path(f, path);
 	if (err) {
 		return err;
 	}
 
+	invalidate_attr(f, ino, NULL);
 	return fuse_lowlevel_notify_inval_inode(f->se, ino, 0, 0);
 }
 
@@ -4704,6 +6787,14 @@ static const struct fuse_opt fuse_lib_opts[] = {
 	FUSE_LIB_OPT("negative_timeout=%lf",  negative_timeout, 0),
 	FUSE_LIB_OPT("noforget",              remember, -1),
 	FUSE_LIB_OPT("remember=%u",           remember, 0),
+	FUSE_LIB_OPT("max_nodes=%u",          max_nodes, 0),
+	FUSE_LIB_OPT("max_node_mem=%lu",      max_node_mem, 0),
+	FUSE_LIB_OPT("attr_cache",            attr_cache, 1),
+	FUSE_LIB_OPT("neg_cache_timeout=%lf", neg_cache_timeout, 0),
+	FUSE_LIB_OPT("neg_cache_size=%u",     neg_cache_size, 0),
+	FUSE_LIB_OPT("readdir_stream",        readdir_stream, 1),
+	FUSE_LIB_OPT("readdir_cache",         readdir_cache, 1),
+	FUSE_LIB_OPT("readdirplus_prefetch=%u", readdirplus_prefetch, 0),
 	FUSE_LIB_OPT("modules=%s",	      modules, 0),
 	FUSE_LIB_OPT("parallel_direct_write=%d", parallel_direct_writes, 0),
 	FUSE_OPT_END
@@ -4756,6 +6847,14 @@ void fuse_lib_help(struct fuse_args *args)
 "    -o ac_attr_timeout=T   auto cache timeout for attributes (attr_timeout)\n"
 "    -o noforget            never forget cached inodes\n"
 "    -o remember=T          remember cached inodes for T seconds (0s)\n"
+"    -o max_nodes=N         max number of remembered inodes (unlimited)\n"
+"    -o max_node_mem=N      max memory used by remembered inodes (unlimited)\n"
+"    -o attr_cache          cache attributes in the library (off)\n"
+"    -o neg_cache_timeout=T library cache timeout for missing names (0.0s)\n"
+"    -o neg_cache_size=N    max number of cached missing names (1024)\n"
+"    -o readdir_stream      stream directories instead of buffering them (off)\n"
+"    -o readdir_cache       cache directory listings while mtime is unchanged (off)\n"
+"    -o readdirplus_prefetch=N  look up to N entries in parallel for readdirplus (0)\n"
 "    -o modules=M1[:M2...]  names of modules to push onto filesystem stack\n");
 
 
@@ -4899,7 +6998,7 @@ static void *fuse_prune_nodes(void *fuse)
 
 int fuse_start_cleanup_thread(struct fuse *f)
 {
-	if (lru_enabled(f))
+	if (f->conf.remember > 0)
 		return fuse_start_thread(&f->prune_thread, fuse_prune_nodes, f);
 
 	return 0;
@@ -4907,7 +7006,7 @@ int fuse_start_cleanup_thread(struct fuse *f)
 
 void fuse_stop_cleanup_thread(struct fuse *f)
 {
-	if (lru_enabled(f)) {
+	if (f->conf.remember > 0) {
 		pthread_mutex_lock(&f->lock);
 		pthread_cancel(f->prune_thread);
 		pthread_mutex_unlock(&f->lock);
@@ -4943,6 +7042,7 @@ struct fuse *_fuse_new_317(struct fuse_args *args,
 	f->conf.entry_timeout = 1.0;
 	f->conf.attr_timeout = 1.0;
 	f->conf.negative_timeout = 0.0;
+	f->conf.neg_cache_size = 1024;
 	f->conf.intr_signal = FUSE_DEFAULT_INTR_SIGNAL;
 
 	/* Parse options */
@@ -4981,6 +7081,7 @@ struct fuse *_fuse_new_317(struct fuse_args *args,
 	f->pagesize = getpagesize();
 	init_list_head(&f->partial_slabs);
 	init_list_head(&f->full_slabs);
+	init_list_head(&f->empty_slabs);
 	init_list_head(&f->lru_table);
 
 	if (f->conf.modules) {
@@ -5027,12 +7128,19 @@ struct fuse *_fuse_new_317(struct fuse_args *args,
 	if (node_table_init(&f->id_table) == -1)
 		goto out_free_name_table;
 
+	init_list_head(&f->neg_table.lru);
+
 	pthread_mutex_init(&f->lock, NULL);
+	pthread_mutex_init(&f->prefetch.lock, NULL);
+	pthread_cond_init(&f->prefetch.cond, NULL);
+	pthread_cond_init(&f->prefetch.done_cond, NULL);
+	init_list_head(&f->prefetch.batches);
+	pthread_cond_init(&f->reclaim.cond, NULL);
 
 	root = alloc_node(f);
 	if (root == NULL) {
 		fuse_log(FUSE_LOG_ERR, "fuse: memory allocation failed\n");
-		goto out_free_id_table;
+		goto out_free_neg_table;
 	}
 	if (lru_enabled(f)) {
 		struct node_lru *lnode = node_lru(root);
@@ -5048,7 +7156,8 @@ struct fuse *_fuse_new_317(struct fuse_args *args,
 
 	return f;
 
-out_free_id_table:
+out_free_neg_table:
+	neg_table_destroy(&f->neg_table);
 	free(f->id_table.array);
 out_free_name_table:
 	free(f->name_table.array);
@@ -5148,6 +7257,9 @@ void fuse_destroy(struct fuse *f)
 	if (f->conf.intr && f->intr_installed)
 		fuse_restore_intr_signal(f->conf.intr_signal);
 
+	prefetch_stop(f);
+	reclaim_stop(f);
+
 	if (f->fs) {
 		fuse_create_context(f);
 
@@ -5176,12 +7288,14 @@ void fuse_destroy(struct fuse *f)
 			f->id_table.use--;
 		}
 	}
+	release_empty_slabs(f);
 	assert(list_empty(&f->partial_slabs));
 	assert(list_empty(&f->full_slabs));
 
 	while (fuse_modules) {
 		fuse_put_module(fuse_modules);
 	}
+	neg_table_destroy(&f->neg_table);
 	free(f->id_table.array);
 	free(f->name_table.array);
 	pthread_mutex_destroy(&f->lock);
@@ -20,6 +20,10 @@ struct fuse_req {
 	struct fuse_chan *ch;
 	int interrupted;
 	unsigned int ioctl_64bit : 1;
+	unsigned int has_supp_group : 1;
+	unsigned int nr_supp_groups;
+	gid_t supp_group;
+	struct fuse_ra_job *ra_job;
 	union {
 		struct {
 			uint64_t unique;
@@ -38,7 +42,97 @@ struct fuse_notify_req {
 	void (*reply)(struct fuse_notify_req *, fuse_req_t, fuse_ino_t,
 		      const void *, const struct fuse_buf *);
 	struct fuse_notify_req *next;
-	struct fuse_notify_req *prev;
+};
+
+#define FUSE_GROUPS_CACHE_SIZE 64
+
+struct fuse_groups_entry {
+	pid_t pid;
+	int pidfd;
+	unsigned long long start_time;
+	struct timespec expires;
+	int ngroups;
+	gid_t *groups;
+};
+
+struct fuse_notify_item {
+	struct fuse_notify_item *next;
+	struct fuse_notify_item *hash_next;
+	int code;
+	fuse_ino_t ino;
+	fuse_ino_t child;
+	off_t off;
+	off_t len;
+	size_t namelen;
+	char name[];
+};
+
+struct fuse_notify_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_cond_t idle_cond;
+	pthread_t thread;
+	int started;
+	int exit;
+	int busy;
+	unsigned int max;
+	struct fuse_notify_item *head;
+	struct fuse_notify_item **tail;
+	struct fuse_notify_item **hash;
+	size_t hash_size;
+	struct fuse_notify_stats stats;
+};
+
+#define FUSE_RA_STREAMS 64
+
+struct fuse_ra_stream {
+	fuse_ino_t ino;
+	uint64_t fh;
+	uint64_t gen;
+	off_t next;
+	off_t ahead;
+	size_t window;
+	int eof;
+};
+
+struct fuse_ra_job {
+	struct fuse_ra_job *next;
+	fuse_ino_t ino;
+	uint64_t fh;
+	uint64_t gen;
+	int flags;
+	off_t off;
+	size_t size;
+	struct fuse_ctx ctx;
+};
+
+struct fuse_ra {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_cond_t done_cond;
+	pthread_t thread;
+	int started;
+	int exit;
+	size_t max_window;
+	size_t min_window;
+	size_t max_mem;
+	size_t inflight;
+	uint64_t gen;
+	uint64_t invals;
+	struct fuse_prefetch_stats stats;
+	struct fuse_ra_job *head;
+	struct fuse_ra_job **tail;
+	struct fuse_ra_job *running;
+	struct fuse_ra_stream streams[FUSE_RA_STREAMS];
+};
+
+struct fuse_backing {
+	struct fuse_backing *next;
+	fuse_ino_t ino;
+	int backing_id;
+	size_t nfh;
+	size_t fh_size;
+	uint64_t *fh;
 };
 
 struct fuse_session {
@@ -62,9 +156,20 @@ struct fuse_session {
 	pthread_key_t pipe_key;
 	int broken_splice_nonblock;
 	uint64_t notify_ctr;
-	struct fuse_notify_req notify_list;
+	struct fuse_notify_req **notify_hash;
+	size_t notify_hash_size;
+	size_t notify_count;
 	size_t bufsize;
 	int error;
+	double groups_timeout;
+	pthread_mutex_t groups_lock;
+	struct fuse_groups_entry groups_cache[FUSE_GROUPS_CACHE_SIZE];
+	struct fuse_notify_queue nq;
+	struct fuse_ra ra;
+	pthread_mutex_t backing_lock;
+	struct fuse_backing **backing_hash;
+	size_t backing_hash_size;
+	struct fuse_passthrough_stats backing_stats;
 
 	/* This is useful if any kind of ABI incompatibility is found at
 	 * a later version, to 'fix' it at run time.
@@ -28,6 +28,9 @@
 #include <assert.h>
 #include <sys/file.h>
 #include <sys/ioctl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/syscall.h>
 
 #ifndef F_LINUX_SPECIFIC_BASE
 #define F_LINUX_SPECIFIC_BASE       1024
@@ -215,6 +218,11 @@ static int fuse_send_msg(struct fuse_session *se, struct fuse_chan *ch,
 }
 
 
+static void ra_complete(fuse_req_t req, struct fuse_bufvec *bufv,
+			enum fuse_buf_copy_flags flags);
+static void ra_complete_iov(fuse_req_t req, int error, struct iovec *iov,
+			    int count);
+
 int fuse_send_reply_iov_nofree(fuse_req_t req, int error, struct iovec *iov,
 			       int count)
 {
@@ -230,6 +238,11 @@ int fuse_send_reply_iov_nofree(fuse_req_t req, int error, struct iovec *iov,
 		error = -ERANGE;
 	}
 
+	if (req->ra_job) {
+		ra_complete_iov(req, error, iov + 1, count - 1);
+		return 0;
+	}
+
 	out.unique = req->unique;
 	out.error = error;
 
@@ -502,6 +515,154 @@ int fuse_passthrough_close(fuse_req_t req, int backing_id)
 	return ret;
 }
 
+/*
+ * Shared backing files, indexed by inode.  Each entry records the file
+ * handles of the open files using it, so that do_release() can drop
+ * their references.
+ */
+static struct fuse_backing **backing_slot(struct fuse_session *se,
+					  fuse_ino_t ino)
+{
+	struct fuse_backing **bp;
+
+	bp = &se->backing_hash[(ino * 0x9e3779b97f4a7c15ULL >> 32) &
+			       (se->backing_hash_size - 1)];
+	for (; *bp != NULL; bp = &(*bp)->next) {
+		if ((*bp)->ino == ino)
+			break;
+	}
+	return bp;
+}
+
+static int backing_resize(struct fuse_session *se)
+{
+	struct fuse_backing **old = se->backing_hash;
+	size_t old_size = se->backing_hash_size;
+	struct fuse_backing *b;
+
+	se->backing_hash_size = old_size ? old_size * 2 : 64;
+	se->backing_hash = calloc(se->backing_hash_size, sizeof(old[0]));
+	if (se->backing_hash == NULL) {
+		se->backing_hash = old;
+		se->backing_hash_size = old_size;
+		return -1;
+	}
+	for (size_t i = 0; i < old_size; i++) {
+		while ((b = old[i]) != NULL) {
+			old[i] = b->next;
+			b->next = NULL;
+			*backing_slot(se, b->ino) = b;
+		}
+	}
+	free(old);
+	return 0;
+}
+
+static int backing_add_fh(struct fuse_backing *b, uint64_t fh)
+{
+	if (b->nfh == b->fh_size) {
+		size_t size = b->fh_size ? b->fh_size * 2 : 4;
+		uint64_t *newfh = realloc(b->fh, size * sizeof(b->fh[0]));
+
+		if (newfh == NULL)
+			return -1;
+		b->fh = newfh;
+		b->fh_size = size;
+	}
+	b->fh[b->nfh++] = fh;
+	return 0;
+}
+
+int fuse_passthrough_open_inode(fuse_req_t req, fuse_ino_t ino, int fd,
+				struct fuse_file_info *fi)
+{
+	struct fuse_session *se = req->se;
+	struct fuse_backing **bp, *b;
+	int backing_id = 0;
+
+	pthread_mutex_lock(&se->backing_lock);
+	if (se->backing_stats.active >= se->backing_hash_size &&
+	    backing_resize(se) == -1)
+		goto out;
+
+	bp = backing_slot(se, ino);
+	b = *bp;
+	if (b == NULL) {
+		b = calloc(1, sizeof(*b));
+		if (b == NULL)
+			goto out;
+		b->ino = ino;
+		b->backing_id = fuse_passthrough_open(req, fd);
+		if (!b->backing_id) {
+			se->backing_stats.errors++;
+			free(b);
+			goto out;
+		}
+		*bp = b;
+		se->backing_stats.active++;
+		se->backing_stats.opened++;
+	} else {
+		se->backing_stats.shared++;
+	}
+
+	if (backing_add_fh(b, fi->fh) == -1) {
+		if (b->nfh == 0) {
+			fuse_passthrough_close(req, b->backing_id);
+			*bp = b->next;
+			free(b);
+			se->backing_stats.active--;
+		}
+		goto out;
+	}
+	se->backing_stats.refs++;
+	backing_id = fi->backing_id = b->backing_id;
+out:
+	pthread_mutex_unlock(&se->backing_lock);
+	return backing_id;
+}
+
+/* Drop the reference of file handle @fh, if it has one */
+static void backing_release(fuse_req_t req, fuse_ino_t ino, uint64_t fh)
+{
+	struct fuse_session *se = req->se;
+	struct fuse_backing **bp, *b;
+
+	pthread_mutex_lock(&se->backing_lock);
+	if (!se->backing_stats.active)
+		goto out;
+
+	bp = backing_slot(se, ino);
+	b = *bp;
+	if (b == NULL)
+		goto out;
+	for (size_t i = 0; i < b->nfh; i++) {
+		if (b->fh[i] == fh) {
+			b->fh[i] = b->fh[--b->nfh];
+			se->backing_stats.refs--;
+			break;
+		}
+	}
+	if (b->nfh == 0) {
+		if (fuse_passthrough_close(req, b->backing_id) < 0)
+			se->backing_stats.errors++;
+		*bp = b->next;
+		free(b->fh);
+		free(b);
+		se->backing_stats.active--;
+		se->backing_stats.closed++;
+	}
+out:
+	pthread_mutex_unlock(&se->backing_lock);
+}
+
+void fuse_passthrough_stats(struct fuse_session *se,
+			    struct fuse_passthrough_stats *stats)
+{
+	pthread_mutex_lock(&se->backing_lock);
+	*stats = se->backing_stats;
+	pthread_mutex_unlock(&se->backing_lock);
+}
+
 int fuse_reply_open(fuse_req_t req, const struct fuse_file_info *f)
 {
 	struct fuse_open_out arg;
@@ -914,6 +1075,12 @@ int fuse_reply_data(fuse_req_t req, struct fuse_bufvec *bufv,
 	struct fuse_out_header out;
 	int res;
 
+	if (req->ra_job) {
+		ra_complete(req, bufv, flags);
+		fuse_free_req(req);
+		return 0;
+	}
+
 	iov[0].iov_base = &out;
 	iov[0].iov_len = sizeof(struct fuse_out_header);
 
@@ -1206,6 +1373,393 @@ static void do_getattr(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 		fuse_reply_err(req, ENOSYS);
 }
 
+/*
+ * Sequential read prefetch (-o store_prefetch=N)
+ *
+ * Reads are tracked per (inode, file handle).  Once a stream is found
+ * to be sequential, the data following it is read from the filesystem
+ * by a separate thread, using requests that are not connected to the
+ * kernel, and pushed into the page cache with
+ * fuse_lowlevel_notify_store().  The window doubles on every
+ * sequential read, up to the configured maximum, and the amount of
+ * data being prefetched at any time is bounded by store_prefetch_mem.
+ *
+ * Requests that change the contents of a file (write, truncation,
+ * O_TRUNC open, fallocate and the destination of copy_file_range)
+ * move the stream to a new generation, so that data read before them
+ * is not stored afterwards.  A write can also be
+ * processed while a store is in progress.  Waiting for the store would
+ * deadlock, since the kernel keeps the written pages locked until the
+ * write is replied to.  Instead, the range is invalidated again if the
+ * store overlapped with any write or truncation.
+ *
+ * Prefetch is disabled with writeback caching, since stores would then
+ * replace dirty pages that the filesystem hasn't seen yet.
+ */
+
+static struct fuse_ra_stream *ra_stream(struct fuse_ra *ra, fuse_ino_t ino)
+{
+	return &ra->streams[ino % FUSE_RA_STREAMS];
+}
+
+static void ra_reset(struct fuse_ra *ra, struct fuse_ra_stream *s,
+		     fuse_ino_t ino, uint64_t fh, off_t end)
+{
+	s->ino = ino;
+	s->fh = fh;
+	s->gen = ++ra->gen;
+	s->next = end;
+	s->ahead = end;
+	s->window = 0;
+	s->eof = 0;
+}
+
+static void *ra_thread(void *data)
+{
+	struct fuse_session *se = data;
+	struct fuse_ra *ra = &se->ra;
+	struct fuse_ra_job *job;
+	struct fuse_file_info fi;
+	struct fuse_req *req;
+
+	pthread_mutex_lock(&ra->lock);
+	while (!ra->exit) {
+		job = ra->head;
+		if (job == NULL) {
+			pthread_cond_wait(&ra->cond, &ra->lock);
+			continue;
+		}
+		ra->head = job->next;
+		if (ra->head == NULL)
+			ra->tail = &ra->head;
+		job->next = ra->running;
+		ra->running = job;
+		pthread_mutex_unlock(&ra->lock);
+
+		req = fuse_ll_alloc_req(se);
+		if (req == NULL) {
+			pthread_mutex_lock(&ra->lock);
+			ra->stats.errors++;
+			ra->running = job->next;
+			ra->inflight -= job->size;
+			pthread_cond_broadcast(&ra->done_cond);
+			free(job);
+			continue;
+		}
+		req->ctx = job->ctx;
+		req->ra_job = job;
+		memset(&fi, 0, sizeof(fi));
+		fi.fh = job->fh;
+		fi.flags = job->flags;
+		se->op.read(req, job->ino, job->size, job->off, &fi);
+
+		pthread_mutex_lock(&ra->lock);
+		ra->stats.reads++;
+	}
+	pthread_mutex_unlock(&ra->lock);
+
+	return NULL;
+}
+
+/*
+ * Copy the reply into memory if it has file descriptor buffers, whose
+ * size is only an upper bound.  Returns the number of bytes read, or
+ * -errno.
+ */
+static ssize_t ra_copy_buf(struct fuse_bufvec *bufv, struct fuse_bufvec *mem,
+			   enum fuse_buf_copy_flags flags)
+{
+	size_t size = fuse_buf_size(bufv);
+	ssize_t res;
+	size_t i;
+
+	for (i = 0; i < bufv->count; i++)
+		if (bufv->buf[i].flags & FUSE_BUF_IS_FD)
+			break;
+	if (i == bufv->count)
+		return size;
+
+	mem->buf[0].mem = malloc(size);
+	if (mem->buf[0].mem == NULL)
+		return -ENOMEM;
+	mem->buf[0].size = size;
+	res = fuse_buf_copy(mem, bufv, flags);
+	if (res >= 0)
+		mem->buf[0].size = res;
+	mem->idx = 0;
+	mem->off = 0;
+	return res;
+}
+
+/* Called with the reply to a prefetch read; @bufv is NULL on error */
+static void ra_complete(fuse_req_t req, struct fuse_bufvec *bufv,
+			enum fuse_buf_copy_flags flags)
+{
+	struct fuse_session *se = req->se;
+	struct fuse_ra *ra = &se->ra;
+	struct fuse_ra_job *job = req->ra_job;
+	struct fuse_ra_job **jp;
+	struct fuse_ra_stream *s;
+	struct fuse_bufvec mem = FUSE_BUFVEC_INIT(0);
+	ssize_t size = -EIO;
+	uint64_t invals;
+	int store = 0;
+	int res;
+
+	req->ra_job = NULL;
+	if (bufv) {
+		size = ra_copy_buf(bufv, &mem, flags);
+		if (mem.buf[0].mem)
+			bufv = &mem;
+	}
+
+	pthread_mutex_lock(&ra->lock);
+	if (size < 0) {
+		ra->stats.errors++;
+		size = 0;
+	}
+	s = ra_stream(ra, job->ino);
+	if (s->ino == job->ino && s->fh == job->fh && s->gen == job->gen) {
+		store = size != 0;
+		if ((size_t) size < job->size) {
+			/* End of file or error: stop prefetching */
+			s->eof = 1;
+			if (s->ahead > job->off + size)
+				s->ahead = job->off + size;
+		}
+	} else {
+		ra->stats.discarded += size;
+	}
+	invals = ra->invals;
+	pthread_mutex_unlock(&ra->lock);
+
+	if (store) {
+		res = fuse_lowlevel_notify_store(se, job->ino, job->off, bufv,
+						 flags);
+
+		pthread_mutex_lock(&ra->lock);
+		if (res)
+			ra->stats.errors++;
+		else
+			ra->stats.stored += size;
+		/* The store may have overwritten newer data */
+		store = ra->invals == invals;
+		if (!store)
+			ra->stats.invalidated++;
+		pthread_mutex_unlock(&ra->lock);
+
+		if (!store)
+			fuse_lowlevel_notify_inval_inode(se, job->ino,
+							 job->off, size);
+	}
+	free(mem.buf[0].mem);
+
+	pthread_mutex_lock(&ra->lock);
+	for (jp = &ra->running; *jp != job; jp = &(*jp)->next);
+	*jp = job->next;
+	ra->inflight -= job->size;
+	pthread_cond_broadcast(&ra->done_cond);
+	pthread_mutex_unlock(&ra->lock);
+	free(job);
+}
+
+static void ra_complete_iov(fuse_req_t req, int error, struct iovec *iov,
+			    int count)
+{
+	struct fuse_bufvec *bufv = NULL;
+
+	if (!error) {
+		bufv = calloc(1, sizeof(*bufv) +
+			      count * sizeof(struct fuse_buf));
+		if (bufv != NULL) {
+			bufv->count = count;
+			for (int i = 0; i < count; i++) {
+				bufv->buf[i].mem = iov[i].iov_base;
+				bufv->buf[i].size = iov[i].iov_len;
+			}
+		}
+	}
+	ra_complete(req, bufv, 0);
+	free(bufv);
+}
+
+static void ra_queue(struct fuse_ra *ra, fuse_req_t req,
+		     struct fuse_ra_stream *s, off_t end, int flags)
+{
+	size_t chunk = req->se->bufsize - FUSE_BUFFER_HEADER_SIZE;
+	struct fuse_ra_job *job;
+
+	while (s->ahead < end) {
+		job = malloc(sizeof(*job));
+		if (job == NULL)
+			break;
+		job->next = NULL;
+		job->ino = s->ino;
+		job->fh = s->fh;
+		job->gen = s->gen;
+		job->flags = flags;
+		job->off = s->ahead;
+		job->size = end - s->ahead < (off_t) chunk ?
+			(size_t) (end - s->ahead) : chunk;
+		job->ctx = req->ctx;
+
+		*ra->tail = job;
+		ra->tail = &job->next;
+		ra->inflight += job->size;
+		s->ahead += job->size;
+	}
+	pthread_cond_signal(&ra->cond);
+}
+
+static void ra_track(fuse_req_t req, fuse_ino_t ino,
+		     const struct fuse_read_in *arg)
+{
+	struct fuse_session *se = req->se;
+	struct fuse_ra *ra = &se->ra;
+	struct fuse_ra_stream *s;
+	off_t off = arg->offset;
+	off_t end = off + arg->size;
+	off_t target;
+	size_t window;
+
+	if (!ra->max_window || se->conn.proto_minor < 15 ||
+	    (se->conn.want & FUSE_CAP_WRITEBACK_CACHE))
+		return;
+
+	pthread_mutex_lock(&ra->lock);
+	s = ra_stream(ra, ino);
+	if (s->ino != ino || s->fh != arg->fh) {
+		ra_reset(ra, s, ino, arg->fh, end);
+		goto out;
+	}
+	/*
+	 * Reads served from prefetched data don't reach us, so the next
+	 * read may start anywhere up to the end of the prefetched range.
+	 */
+	window = s->window > arg->size ? s->window : arg->size;
+	if (off > s->ahead || end + (off_t) window < s->next) {
+		ra_reset(ra, s, ino, arg->fh, end);
+		goto out;
+	}
+	if (end <= s->next)
+		goto out;
+	s->next = end;
+	if (s->ahead < end)
+		s->ahead = end;
+
+	if (!s->window)
+		s->window = ra->min_window > arg->size ?
+			ra->min_window : arg->size;
+	else
+		s->window *= 2;
+	if (s->window > ra->max_window)
+		s->window = ra->max_window;
+
+	if (s->eof || s->ahead - s->next >= (off_t) s->window / 2)
+		goto out;
+
+	target = s->next + s->window;
+	if (target - s->ahead > (off_t) (ra->max_mem - ra->inflight))
+		target = s->ahead + (ra->max_mem - ra->inflight);
+	target &= ~((off_t) getpagesize() - 1);
+	if (target <= s->ahead)
+		goto out;
+
+	if (!ra->started) {
+		if (fuse_start_thread(&ra->thread, ra_thread, se) == -1)
+			goto out;
+		ra->started = 1;
+	}
+	if (se->debug)
+		fuse_log(FUSE_LOG_DEBUG, "prefetch: ino %llu, %lli-%lli\n",
+			 (unsigned long long) ino, (long long) s->ahead,
+			 (long long) target);
+	ra_queue(ra, req, s, target, arg->flags);
+out:
+	pthread_mutex_unlock(&ra->lock);
+}
+
+/* Discard prefetched data for @ino that is not yet in the kernel */
+static void ra_invalidate(struct fuse_session *se, fuse_ino_t ino)
+{
+	struct fuse_ra *ra = &se->ra;
+	struct fuse_ra_stream *s;
+
+	if (!ra->max_window)
+		return;
+
+	pthread_mutex_lock(&ra->lock);
+	ra->invals++;
+	s = ra_stream(ra, ino);
+	if (s->ino == ino)
+		ra_reset(ra, s, ino, s->fh, s->next);
+	pthread_mutex_unlock(&ra->lock);
+}
+
+/* Cancel queued reads of file handle @fh, and wait for running ones */
+static void ra_release(struct fuse_session *se, fuse_ino_t ino, uint64_t fh)
+{
+	struct fuse_ra *ra = &se->ra;
+	struct fuse_ra_job **jp, *job;
+	struct fuse_ra_stream *s;
+	int busy;
+
+	if (!ra->max_window)
+		return;
+
+	pthread_mutex_lock(&ra->lock);
+	for (jp = &ra->head; (job = *jp) != NULL;) {
+		if (job->ino == ino && job->fh == fh) {
+			*jp = job->next;
+			ra->inflight -= job->size;
+			free(job);
+		} else {
+			jp = &job->next;
+		}
+	}
+	ra->tail = jp;
+	do {
+		busy = 0;
+		for (job = ra->running; job != NULL; job = job->next)
+			if (job->ino == ino && job->fh == fh)
+				busy = 1;
+		if (busy)
+			pthread_cond_wait(&ra->done_cond, &ra->lock);
+	} while (busy);
+	s = ra_stream(ra, ino);
+	if (s->ino == ino && s->fh == fh)
+		s->ino = 0;
+	pthread_mutex_unlock(&ra->lock);
+}
+
+/* Called before the filesystem's destroy handler */
+static void ra_stop(struct fuse_session *se)
+{
+	struct fuse_ra *ra = &se->ra;
+	struct fuse_ra_job *job;
+
+	if (ra->started) {
+		pthread_mutex_lock(&ra->lock);
+		ra->exit = 1;
+		pthread_cond_signal(&ra->cond);
+		pthread_mutex_unlock(&ra->lock);
+		pthread_join(ra->thread, NULL);
+	}
+	while ((job = ra->head) != NULL) {
+		ra->head = job->next;
+		free(job);
+	}
+	ra->tail = &ra->head;
+}
+
+void fuse_lowlevel_prefetch_stats(struct fuse_session *se,
+				  struct fuse_prefetch_stats *stats)
+{
+	pthread_mutex_lock(&se->ra.lock);
+	*stats = se->ra.stats;
+	pthread_mutex_unlock(&se->ra.lock);
+}
+
 static void do_setattr(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 {
 	struct fuse_setattr_in *arg = (struct fuse_setattr_in *) inarg;
@@ -1235,6 +1789,8 @@ static void do_setattr(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 			FUSE_SET_ATTR_MTIME_NOW |
 			FUSE_SET_ATTR_CTIME;
 
+		if (arg->valid & FUSE_SET_ATTR_SIZE)
+			ra_invalidate(req->se, nodeid);
 		req->se->op.setattr(req, nodeid, &stbuf, arg->valid, fi);
 	} else
 		fuse_reply_err(req, ENOSYS);
@@ -1385,6 +1941,9 @@ static void do_open(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 	memset(&fi, 0, sizeof(fi));
 	fi.flags = arg->flags;
 
+	/* With atomic_o_trunc the kernel drops the cached pages */
+	if (arg->flags & O_TRUNC)
+		ra_invalidate(req->se, nodeid);
 	if (req->se->op.open)
 		req->se->op.open(req, nodeid, &fi);
 	else if (req->se->conn.want & FUSE_CAP_NO_OPEN_SUPPORT)
@@ -1406,6 +1965,7 @@ static void do_read(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 			fi.lock_owner = arg->lock_owner;
 			fi.flags = arg->flags;
 		}
+		ra_track(req, nodeid, arg);
 		req->se->op.read(req, nodeid, arg->size, arg->offset, &fi);
 	} else
 		fuse_reply_err(req, ENOSYS);
@@ -1429,6 +1989,7 @@ static void do_write(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 		param = PARAM(arg);
 	}
 
+	ra_invalidate(req->se, nodeid);
 	if (req->se->op.write)
 		req->se->op.write(req, nodeid, param, arg->size,
 				 arg->offset, &fi);
@@ -1472,6 +2033,7 @@ static void do_write_buf(fuse_req_t req, fuse_ino_t nodeid, const void *inarg,
 	}
 	bufv.buf[0].size = arg->size;
 
+	ra_invalidate(se, nodeid);
 	se->op.write_buf(req, nodeid, &bufv, arg->offset, &fi);
 
 out:
@@ -1513,6 +2075,8 @@ static void do_release(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 		fi.flock_release = 1;
 		fi.lock_owner = arg->lock_owner;
 	}
+	ra_release(req->se, nodeid, arg->fh);
+	backing_release(req, nodeid, arg->fh);
 
 	if (req->se->op.release)
 		req->se->op.release(req, nodeid, &fi);
@@ -1921,6 +2485,7 @@ static void do_fallocate(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 	memset(&fi, 0, sizeof(fi));
 	fi.fh = arg->fh;
 
+	ra_invalidate(req->se, nodeid);
 	if (req->se->op.fallocate)
 		req->se->op.fallocate(req, nodeid, arg->mode, arg->offset, arg->length, &fi);
 	else
@@ -1938,7 +2503,7 @@ static void do_copy_file_range(fuse_req_t req, fuse_ino_t nodeid_in, const void
 	memset(&fi_out, 0, sizeof(fi_out));
 	fi_out.fh = arg->fh_out;
 
-
+	ra_invalidate(req->se, arg->nodeid_out);
 	if (req->se->op.copy_file_range)
 		req->se->op.copy_file_range(req, nodeid_in, arg->off_in,
 					    &fi_in, arg->nodeid_out,
@@ -2065,6 +2630,8 @@ void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 			se->conn.capable |= FUSE_CAP_EXPIRE_ONLY;
 		if (inargflags & FUSE_PASSTHROUGH)
 			se->conn.capable |= FUSE_CAP_PASSTHROUGH;
+		if (inargflags & FUSE_CREATE_SUPP_GROUP)
+			se->conn.capable |= FUSE_CAP_CREATE_SUPP_GROUP;
 	} else {
 		se->conn.max_readahead = 0;
 	}
@@ -2199,6 +2766,8 @@ void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 		outargflags |= FUSE_SETXATTR_EXT;
 	if (se->conn.want & FUSE_CAP_DIRECT_IO_ALLOW_MMAP)
 		outargflags |= FUSE_DIRECT_IO_ALLOW_MMAP;
+	if (se->conn.want & FUSE_CAP_CREATE_SUPP_GROUP)
+		outargflags |= FUSE_CREATE_SUPP_GROUP;
 	if (se->conn.want & FUSE_CAP_PASSTHROUGH) {
 		outargflags |= FUSE_PASSTHROUGH;
 		/*
@@ -2272,28 +2841,60 @@ static void do_destroy(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 	send_reply_ok(req, NULL, 0);
 }
 
-static void list_del_nreq(struct fuse_notify_req *nreq)
+/*
+ * Outstanding notifications that expect a reply are kept in a hash
+ * table indexed by their unique ID, which is taken from a counter, so
+ * the low bits are used directly.  Called with se->lock held.
+ */
+static int hash_add_nreq(struct fuse_session *se,
+			 struct fuse_notify_req *nreq)
 {
-	struct fuse_notify_req *prev = nreq->prev;
-	struct fuse_notify_req *next = nreq->next;
-	prev->next = next;
-	next->prev = prev;
-}
+	struct fuse_notify_req **hash, *next;
+	size_t size, i;
 
-static void list_add_nreq(struct fuse_notify_req *nreq,
-			  struct fuse_notify_req *next)
-{
-	struct fuse_notify_req *prev = next->prev;
-	nreq->next = next;
-	nreq->prev = prev;
-	prev->next = nreq;
-	next->prev = nreq;
+	if (se->notify_count >= se->notify_hash_size) {
+		size = se->notify_hash_size ? se->notify_hash_size * 2 : 64;
+		hash = calloc(size, sizeof(hash[0]));
+		if (hash == NULL)
+			return -ENOMEM;
+		for (i = 0; i < se->notify_hash_size; i++) {
+			for (next = se->notify_hash[i]; next != NULL;) {
+				struct fuse_notify_req *n = next;
+
+				next = n->next;
+				n->next = hash[n->unique & (size - 1)];
+				hash[n->unique & (size - 1)] = n;
+			}
+		}
+		free(se->notify_hash);
+		se->notify_hash = hash;
+		se->notify_hash_size = size;
+	}
+	i = nreq->unique & (se->notify_hash_size - 1);
+	nreq->next = se->notify_hash[i];
+	se->notify_hash[i] = nreq;
+	se->notify_count++;
+
+	return 0;
 }
 
-static void list_init_nreq(struct fuse_notify_req *nreq)
+static struct fuse_notify_req *hash_del_nreq(struct fuse_session *se,
+					     uint64_t unique)
 {
-	nreq->next = nreq;
-	nreq->prev = nreq;
+	struct fuse_notify_req **np, *nreq;
+
+	if (!se->notify_hash_size)
+		return NULL;
+
+	np = &se->notify_hash[unique & (se->notify_hash_size - 1)];
+	for (; (nreq = *np) != NULL; np = &nreq->next) {
+		if (nreq->unique == unique) {
+			*np = nreq->next;
+			se->notify_count--;
+			return nreq;
+		}
+	}
+	return NULL;
 }
 
 static void do_notify_reply(fuse_req_t req, fuse_ino_t nodeid,
@@ -2301,20 +2902,18 @@ static void do_notify_reply(fuse_req_t req, fuse_ino_t nodeid,
 {
 	struct fuse_session *se = req->se;
 	struct fuse_notify_req *nreq;
-	struct fuse_notify_req *head;
 
 	pthread_mutex_lock(&se->lock);
-	head = &se->notify_list;
-	for (nreq = head->next; nreq != head; nreq = nreq->next) {
-		if (nreq->unique == req->unique) {
-			list_del_nreq(nreq);
-			break;
-		}
-	}
+	nreq = hash_del_nreq(se, req->unique);
 	pthread_mutex_unlock(&se->lock);
 
-	if (nreq != head)
+	if (nreq != NULL) {
 		nreq->reply(nreq, req, nodeid, inarg, buf);
+	} else {
+		if (buf->flags & FUSE_BUF_IS_FD)
+			fuse_ll_clear_pipe(se);
+		fuse_reply_none(req);
+	}
 }
 
 static int send_notify_iov(struct fuse_session *se, int notify_code,
@@ -2463,6 +3062,334 @@ int fuse_lowlevel_notify_delete(struct fuse_session *se,
 	return send_notify_iov(se, FUSE_NOTIFY_DELETE, iov, 3);
 }
 
+/*
+ * Asynchronous notification queue
+ *
+ * Items are kept in FIFO order and, for coalescing, in a hash table
+ * keyed by inode (INVAL_INODE) or by parent and name (INVAL_ENTRY and
+ * DELETE).  A single thread, started on first use, writes them to the
+ * kernel.
+ */
+
+static size_t notify_hash(const struct fuse_notify_queue *nq,
+			  const struct fuse_notify_item *it)
+{
+	uint64_t hash = it->ino * 0x9e3779b97f4a7c15ULL;
+
+	for (size_t i = 0; i < it->namelen; i++)
+		hash = (hash ^ (unsigned char) it->name[i]) * 0x100000001b3ULL;
+
+	return (hash ^ (hash >> 32)) & (nq->hash_size - 1);
+}
+
+static int notify_same_key(const struct fuse_notify_item *a,
+			   const struct fuse_notify_item *b)
+{
+	if ((a->code == FUSE_NOTIFY_INVAL_INODE) !=
+	    (b->code == FUSE_NOTIFY_INVAL_INODE))
+		return 0;
+
+	return a->ino == b->ino && a->namelen == b->namelen &&
+		memcmp(a->name, b->name, a->namelen) == 0;
+}
+
+static void notify_unhash(struct fuse_notify_queue *nq,
+			  struct fuse_notify_item *it)
+{
+	struct fuse_notify_item **itp = &nq->hash[notify_hash(nq, it)];
+
+	for (; *itp != NULL; itp = &(*itp)->hash_next) {
+		if (*itp == it) {
+			*itp = it->hash_next;
+			break;
+		}
+	}
+}
+
+/* Merge the byte range of @it into @old; offset < 0 means attributes only */
+static void notify_merge_range(struct fuse_notify_item *old,
+			       const struct fuse_notify_item *it)
+{
+	off_t end, old_end;
+
+	if (it->off < 0)
+		return;
+	if (old->off < 0) {
+		old->off = it->off;
+		old->len = it->len;
+		return;
+	}
+	end = it->len <= 0 ? -1 : it->off + it->len;
+	old_end = old->len <= 0 ? -1 : old->off + old->len;
+	if (it->off < old->off)
+		old->off = it->off;
+	if (end == -1 || old_end == -1)
+		old->len = 0;
+	else
+		old->len = (end > old_end ? end : old_end) - old->off;
+}
+
+/*
+ * Try to merge @it into a pending item with the same key.  Returns 1 if
+ * nothing needs to be queued.
+ */
+static int notify_coalesce(struct fuse_notify_queue *nq,
+			   struct fuse_notify_item *it)
+{
+	struct fuse_notify_item *old = nq->hash[notify_hash(nq, it)];
+
+	for (; old != NULL; old = old->hash_next) {
+		if (!notify_same_key(old, it))
+			continue;
+
+		switch (it->code) {
+		case FUSE_NOTIFY_INVAL_INODE:
+			notify_merge_range(old, it);
+			return 1;
+
+		case FUSE_NOTIFY_INVAL_ENTRY:
+			/* A pending deletion invalidates the entry as well */
+			return 1;
+
+		case FUSE_NOTIFY_DELETE:
+			if (old->code == FUSE_NOTIFY_INVAL_ENTRY) {
+				old->code = FUSE_NOTIFY_DELETE;
+				old->child = it->child;
+				return 1;
+			}
+			if (old->child == it->child)
+				return 1;
+			break;
+		}
+	}
+	return 0;
+}
+
+static int notify_send_item(struct fuse_session *se,
+			    const struct fuse_notify_item *it)
+{
+	switch (it->code) {
+	case FUSE_NOTIFY_INVAL_INODE:
+		return fuse_lowlevel_notify_inval_inode(se, it->ino, it->off,
+							it->len);
+	case FUSE_NOTIFY_INVAL_ENTRY:
+		return fuse_lowlevel_notify_inval_entry(se, it->ino, it->name,
+							it->namelen);
+	default:
+		return fuse_lowlevel_notify_delete(se, it->ino, it->child,
+						   it->name, it->namelen);
+	}
+}
+
+static void *notify_thread(void *data)
+{
+	struct fuse_session *se = data;
+	struct fuse_notify_queue *nq = &se->nq;
+	struct fuse_notify_item *it;
+	int res;
+
+	pthread_mutex_lock(&nq->lock);
+	while (!nq->exit) {
+		it = nq->head;
+		if (it == NULL) {
+			pthread_cond_broadcast(&nq->idle_cond);
+			pthread_cond_wait(&nq->cond, &nq->lock);
+			continue;
+		}
+		nq->head = it->next;
+		if (nq->head == NULL)
+			nq->tail = &nq->head;
+		notify_unhash(nq, it);
+		nq->stats.pending--;
+		nq->busy = 1;
+		pthread_mutex_unlock(&nq->lock);
+
+		res = notify_send_item(se, it);
+		free(it);
+
+		pthread_mutex_lock(&nq->lock);
+		nq->busy = 0;
+		if (res == 0)
+			nq->stats.sent++;
+		else
+			nq->stats.errors++;
+	}
+	pthread_mutex_unlock(&nq->lock);
+
+	return NULL;
+}
+
+static int notify_queue_start(struct fuse_session *se)
+{
+	struct fuse_notify_queue *nq = &se->nq;
+	size_t size = 16;
+
+	while (size < nq->max)
+		size <<= 1;
+	nq->hash = calloc(size, sizeof(nq->hash[0]));
+	if (nq->hash == NULL)
+		return -ENOMEM;
+	nq->hash_size = size;
+
+	if (fuse_start_thread(&nq->thread, notify_thread, se) == -1) {
+		free(nq->hash);
+		nq->hash = NULL;
+		return -EIO;
+	}
+	nq->started = 1;
+
+	return 0;
+}
+
+/*
+ * Called before the filesystem's destroy handler, so the thread doesn't
+ * send notifications for a filesystem that is going away.  Later
+ * notifications are rejected.
+ */
+static void notify_queue_stop(struct fuse_session *se)
+{
+	struct fuse_notify_queue *nq = &se->nq;
+	struct fuse_notify_item *it;
+
+	pthread_mutex_lock(&nq->lock);
+	nq->exit = 1;
+	pthread_cond_signal(&nq->cond);
+	pthread_cond_broadcast(&nq->idle_cond);
+	pthread_mutex_unlock(&nq->lock);
+	if (nq->started)
+		pthread_join(nq->thread, NULL);
+
+	while ((it = nq->head) != NULL) {
+		nq->head = it->next;
+		free(it);
+	}
+	nq->tail = &nq->head;
+	nq->stats.pending = 0;
+	free(nq->hash);
+	nq->hash = NULL;
+}
+
+static int notify_queue_add(struct fuse_session *se, int code,
+			    fuse_ino_t ino, fuse_ino_t child, off_t off,
+			    off_t len, const char *name, size_t namelen)
+{
+	struct fuse_notify_queue *nq = &se->nq;
+	struct fuse_notify_item *it;
+	size_t hash;
+	int res = 0;
+
+	it = malloc(sizeof(*it) + namelen + 1);
+	if (it == NULL)
+		return -ENOMEM;
+	it->next = NULL;
+	it->code = code;
+	it->ino = ino;
+	it->child = child;
+	it->off = off;
+	it->len = len;
+	it->namelen = namelen;
+	memcpy(it->name, name, namelen);
+	it->name[namelen] = '\0';
+
+	pthread_mutex_lock(&nq->lock);
+	if (nq->exit) {
+		res = -ENOTCONN;
+		goto out_free;
+	}
+	if (!nq->started) {
+		res = notify_queue_start(se);
+		if (res)
+			goto out_free;
+	}
+	if (notify_coalesce(nq, it)) {
+		nq->stats.coalesced++;
+		goto out_free;
+	}
+	if (nq->stats.pending >= nq->max) {
+		nq->stats.full++;
+		res = -EAGAIN;
+		goto out_free;
+	}
+
+	hash = notify_hash(nq, it);
+	it->hash_next = nq->hash[hash];
+	nq->hash[hash] = it;
+	*nq->tail = it;
+	nq->tail = &it->next;
+	nq->stats.queued++;
+	if (++nq->stats.pending > nq->stats.max_pending)
+		nq->stats.max_pending = nq->stats.pending;
+	pthread_cond_signal(&nq->cond);
+	pthread_mutex_unlock(&nq->lock);
+
+	return 0;
+
+out_free:
+	pthread_mutex_unlock(&nq->lock);
+	free(it);
+	return res;
+}
+
+int fuse_lowlevel_notify_inval_inode_async(struct fuse_session *se,
+					   fuse_ino_t ino, off_t off,
+					   off_t len)
+{
+	if (!se)
+		return -EINVAL;
+
+	if (se->conn.proto_minor < 12)
+		return -ENOSYS;
+
+	return notify_queue_add(se, FUSE_NOTIFY_INVAL_INODE, ino, 0, off, len,
+				"", 0);
+}
+
+int fuse_lowlevel_notify_inval_entry_async(struct fuse_session *se,
+					   fuse_ino_t parent,
+					   const char *name, size_t namelen)
+{
+	if (!se)
+		return -EINVAL;
+
+	if (se->conn.proto_minor < 12)
+		return -ENOSYS;
+
+	return notify_queue_add(se, FUSE_NOTIFY_INVAL_ENTRY, parent, 0, 0, 0,
+				name, namelen);
+}
+
+int fuse_lowlevel_notify_delete_async(struct fuse_session *se,
+				      fuse_ino_t parent, fuse_ino_t child,
+				      const char *name, size_t namelen)
+{
+	if (!se)
+		return -EINVAL;
+
+	if (se->conn.proto_minor < 18)
+		return -ENOSYS;
+
+	return notify_queue_add(se, FUSE_NOTIFY_DELETE, parent, child, 0, 0,
+				name, namelen);
+}
+
+void fuse_lowlevel_notify_flush(struct fuse_session *se)
+{
+	struct fuse_notify_queue *nq = &se->nq;
+
+	pthread_mutex_lock(&nq->lock);
+	while (nq->started && !nq->exit && (nq->head != NULL || nq->busy))
+		pthread_cond_wait(&nq->idle_cond, &nq->lock);
+	pthread_mutex_unlock(&nq->lock);
+}
+
+void fuse_lowlevel_notify_stats(struct fuse_session *se,
+				struct fuse_notify_stats *stats)
+{
+	pthread_mutex_lock(&se->nq.lock);
+	*stats = se->nq.stats;
+	pthread_mutex_unlock(&se->nq.lock);
+}
+
 int fuse_lowlevel_notify_store(struct fuse_session *se, fuse_ino_t ino,
 			       off_t offset, struct fuse_bufvec *bufv,
 			       enum fuse_buf_copy_flags flags)
@@ -2501,23 +3428,38 @@ int fuse_lowlevel_notify_store(struct fuse_session *se, fuse_ino_t ino,
 
 struct fuse_retrieve_req {
 	struct fuse_notify_req nreq;
+	fuse_retrieve_func_t func;
 	void *cookie;
+	fuse_ino_t ino;
+	off_t offset;
 };
 
+/*
+ * Called with the reply to a retrieve, or with a NULL @req for retrieves
+ * still outstanding when the session is destroyed.
+ */
 static void fuse_ll_retrieve_reply(struct fuse_notify_req *nreq,
 				   fuse_req_t req, fuse_ino_t ino,
 				   const void *inarg,
 				   const struct fuse_buf *ibuf)
 {
-	struct fuse_session *se = req->se;
 	struct fuse_retrieve_req *rreq =
 		container_of(nreq, struct fuse_retrieve_req, nreq);
 	const struct fuse_notify_retrieve_in *arg = inarg;
-	struct fuse_bufvec bufv = {
-		.buf[0] = *ibuf,
-		.count = 1,
-	};
+	struct fuse_session *se;
+	struct fuse_bufvec bufv;
 
+	if (req == NULL) {
+		if (rreq->func)
+			rreq->func(rreq->cookie, rreq->ino, rreq->offset,
+				   -ENOTCONN, NULL);
+		free(rreq);
+		return;
+	}
+
+	se = req->se;
+	bufv = FUSE_BUFVEC_INIT(0);
+	bufv.buf[0] = *ibuf;
 	if (!(bufv.buf[0].flags & FUSE_BUF_IS_FD))
 		bufv.buf[0].mem = PARAM(arg);
 
@@ -2526,12 +3468,17 @@ static void fuse_ll_retrieve_reply(struct fuse_notify_req *nreq,
 
 	if (bufv.buf[0].size < arg->size) {
 		fuse_log(FUSE_LOG_ERR, "fuse: retrieve reply: buffer size too small\n");
+		if (rreq->func)
+			rreq->func(rreq->cookie, ino, arg->offset, -EIO, NULL);
 		fuse_reply_none(req);
 		goto out;
 	}
 	bufv.buf[0].size = arg->size;
 
-	if (se->op.retrieve_reply) {
+	if (rreq->func) {
+		rreq->func(rreq->cookie, ino, arg->offset, 0, &bufv);
+		fuse_reply_none(req);
+	} else if (se->op.retrieve_reply) {
 		se->op.retrieve_reply(req, rreq->cookie, ino,
 					  arg->offset, &bufv);
 	} else {
@@ -2543,8 +3490,9 @@ out:
 		fuse_ll_clear_pipe(se);
 }
 
-int fuse_lowlevel_notify_retrieve(struct fuse_session *se, fuse_ino_t ino,
-				  size_t size, off_t offset, void *cookie)
+static int notify_retrieve(struct fuse_session *se, fuse_ino_t ino,
+			   size_t size, off_t offset,
+			   fuse_retrieve_func_t func, void *cookie)
 {
 	struct fuse_notify_retrieve_out outarg;
 	struct iovec iov[2];
@@ -2561,12 +3509,19 @@ int fuse_lowlevel_notify_retrieve(struct fuse_session *se, fuse_ino_t ino,
 	if (rreq == NULL)
 		return -ENOMEM;
 
-	pthread_mutex_lock(&se->lock);
+	rreq->func = func;
 	rreq->cookie = cookie;
-	rreq->nreq.unique = se->notify_ctr++;
+	rreq->ino = ino;
+	rreq->offset = offset;
 	rreq->nreq.reply = fuse_ll_retrieve_reply;
-	list_add_nreq(&rreq->nreq, &se->notify_list);
+	pthread_mutex_lock(&se->lock);
+	rreq->nreq.unique = se->notify_ctr++;
+	err = hash_add_nreq(se, &rreq->nreq);
 	pthread_mutex_unlock(&se->lock);
+	if (err) {
+		free(rreq);
+		return err;
+	}
 
 	outarg.notify_unique = rreq->nreq.unique;
 	outarg.nodeid = ino;
@@ -2580,14 +3535,33 @@ int fuse_lowlevel_notify_retrieve(struct fuse_session *se, fuse_ino_t ino,
 	err = send_notify_iov(se, FUSE_NOTIFY_RETRIEVE, iov, 2);
 	if (err) {
 		pthread_mutex_lock(&se->lock);
-		list_del_nreq(&rreq->nreq);
+		/* The reply may already have been processed */
+		if (hash_del_nreq(se, outarg.notify_unique) == NULL)
+			err = 0;
 		pthread_mutex_unlock(&se->lock);
-		free(rreq);
+		if (err)
+			free(rreq);
 	}
 
 	return err;
 }
 
+int fuse_lowlevel_notify_retrieve(struct fuse_session *se, fuse_ino_t ino,
+				  size_t size, off_t offset, void *cookie)
+{
+	return notify_retrieve(se, ino, size, offset, NULL, cookie);
+}
+
+int fuse_lowlevel_notify_retrieve_cb(struct fuse_session *se, fuse_ino_t ino,
+				     size_t size, off_t offset,
+				     fuse_retrieve_func_t func, void *cookie)
+{
+	if (!func)
+		return -EINVAL;
+
+	return notify_retrieve(se, ino, size, offset, func, cookie);
+}
+
 void *fuse_req_userdata(fuse_req_t req)
 {
 	return req->se->userdata;
@@ -2705,6 +3679,39 @@ void fuse_session_process_buf(struct fuse_session *se,
 	fuse_session_process_buf_int(se, buf, NULL);
 }
 
+/*
+ * With FUSE_CREATE_SUPP_GROUP the kernel appends the group of the
+ * parent directory to creating requests if the caller is a member of
+ * it through its supplementary groups.  Extensions are at the end of
+ * the request, in 8 byte units.
+ */
+static void parse_supp_group(struct fuse_req *req,
+			     const struct fuse_in_header *in)
+{
+	size_t extlen = in->total_extlen * 8;
+	const char *p = (const char *) in + in->len - extlen;
+	const char *end = (const char *) in + in->len;
+
+	req->has_supp_group = 1;
+	if (extlen > in->len - sizeof(struct fuse_in_header))
+		return;
+
+	while (end - p >= (ssize_t) sizeof(struct fuse_ext_header)) {
+		const struct fuse_ext_header *xh = (const void *) p;
+		const struct fuse_supp_groups *sg = (const void *) &xh[1];
+
+		if (xh->size < sizeof(*xh) || xh->size > (size_t) (end - p))
+			break;
+		if (xh->type == FUSE_EXT_GROUPS &&
+		    xh->size >= sizeof(*xh) + sizeof(*sg) + sizeof(uint32_t) &&
+		    sg->nr_groups >= 1) {
+			req->nr_supp_groups = 1;
+			req->supp_group = sg->groups[0];
+		}
+		p += xh->size;
+	}
+}
+
 void fuse_session_process_buf_int(struct fuse_session *se,
 				  const struct fuse_buf *buf, struct fuse_chan *ch)
 {
@@ -2830,6 +3837,11 @@ void fuse_session_process_buf_int(struct fuse_session *se,
 		in = mbuf;
 	}
 
+	if ((se->conn.want & FUSE_CAP_CREATE_SUPP_GROUP) &&
+	    (in->opcode == FUSE_CREATE || in->opcode == FUSE_MKNOD ||
+	     in->opcode == FUSE_MKDIR || in->opcode == FUSE_SYMLINK))
+		parse_supp_group(req, in);
+
 	inarg = (void *) &in[1];
 	if (in->opcode == FUSE_WRITE && se->op.write_buf)
 		do_write_buf(req, in->nodeid, inarg, buf);
@@ -2858,6 +3870,11 @@ static const struct fuse_opt fuse_ll_opts[] = {
 	LL_OPTION("-d", debug, 1),
 	LL_OPTION("--debug", debug, 1),
 	LL_OPTION("allow_root", deny_others, 1),
+	LL_OPTION("groups_cache_timeout=%lf", groups_timeout, 0),
+	LL_OPTION("notify_queue_size=%u", nq.max, 0),
+	LL_OPTION("store_prefetch=%zu", ra.max_window, 0),
+	LL_OPTION("store_prefetch_min=%zu", ra.min_window, 0),
+	LL_OPTION("store_prefetch_mem=%zu", ra.max_mem, 0),
 	FUSE_OPT_END
 };
 
@@ -2875,22 +3892,60 @@ void fuse_lowlevel_help(void)
 	printf(
 "    -o allow_other         allow access by all users\n"
 "    -o allow_root          allow access by root\n"
-"    -o auto_unmount        auto unmount on process termination\n");
+"    -o auto_unmount        auto unmount on process termination\n"
+"    -o groups_cache_timeout=T  cache supplementary groups for T seconds (0)\n"
+"    -o notify_queue_size=N max. number of queued notifications (4096)\n"
+"    -o store_prefetch=N    prefetch up to N bytes ahead of sequential reads (0)\n"
+"    -o store_prefetch_min=N  initial prefetch window (131072)\n"
+"    -o store_prefetch_mem=N  max. bytes being prefetched at a time (67108864)\n");
 }
 
 void fuse_session_destroy(struct fuse_session *se)
 {
 	struct fuse_ll_pipe *llp;
+	struct fuse_notify_req *nreq;
 
+	ra_stop(se);
+	notify_queue_stop(se);
 	if (se->got_init && !se->got_destroy) {
 		if (se->op.destroy)
 			se->op.destroy(se->userdata);
 	}
+	for (size_t i = 0; i < se->notify_hash_size; i++) {
+		while ((nreq = se->notify_hash[i]) != NULL) {
+			se->notify_hash[i] = nreq->next;
+			nreq->reply(nreq, NULL, 0, NULL, NULL);
+		}
+	}
+	free(se->notify_hash);
 	llp = pthread_getspecific(se->pipe_key);
 	if (llp != NULL)
 		fuse_ll_pipe_free(llp);
 	pthread_key_delete(se->pipe_key);
 	pthread_mutex_destroy(&se->lock);
+	for (int i = 0; i < FUSE_GROUPS_CACHE_SIZE; i++) {
+		if (se->groups_cache[i].pidfd != -1)
+			close(se->groups_cache[i].pidfd);
+		free(se->groups_cache[i].groups);
+	}
+	pthread_mutex_destroy(&se->groups_lock);
+	pthread_cond_destroy(&se->nq.idle_cond);
+	pthread_cond_destroy(&se->nq.cond);
+	pthread_mutex_destroy(&se->nq.lock);
+	pthread_cond_destroy(&se->ra.done_cond);
+	pthread_cond_destroy(&se->ra.cond);
+	pthread_mutex_destroy(&se->ra.lock);
+	for (size_t i = 0; i < se->backing_hash_size; i++) {
+		struct fuse_backing *b;
+
+		while ((b = se->backing_hash[i]) != NULL) {
+			se->backing_hash[i] = b->next;
+			free(b->fh);
+			free(b);
+		}
+	}
+	free(se->backing_hash);
+	pthread_mutex_destroy(&se->backing_lock);
 	free(se->cuse_data);
 	if (se->fd != -1)
 		close(se->fd);
@@ -3108,6 +4163,21 @@ struct fuse_session *_fuse_session_new_317(struct fuse_args *args,
 	se->fd = -1;
 	se->conn.max_write = UINT_MAX;
 	se->conn.max_readahead = UINT_MAX;
+	pthread_mutex_init(&se->groups_lock, NULL);
+	for (int i = 0; i < FUSE_GROUPS_CACHE_SIZE; i++)
+		se->groups_cache[i].pidfd = -1;
+	pthread_mutex_init(&se->nq.lock, NULL);
+	pthread_cond_init(&se->nq.cond, NULL);
+	pthread_cond_init(&se->nq.idle_cond, NULL);
+	se->nq.tail = &se->nq.head;
+	se->nq.max = 4096;
+	pthread_mutex_init(&se->backing_lock, NULL);
+	pthread_mutex_init(&se->ra.lock, NULL);
+	pthread_cond_init(&se->ra.cond, NULL);
+	pthread_cond_init(&se->ra.done_cond, NULL);
+	se->ra.tail = &se->ra.head;
+	se->ra.min_window = 128 * 1024;
+	se->ra.max_mem = 64 * 1024 * 1024;
 
 	/* Parse options */
 	if(fuse_opt_parse(args, se, fuse_ll_opts, NULL) == -1)
@@ -3147,7 +4217,6 @@ struct fuse_session *_fuse_session_new_317(struct fuse_args *args,
 
 	list_init_req(&se->list);
 	list_init_req(&se->interrupts);
-	list_init_nreq(&se->notify_list);
 	se->notify_ctr = 1;
 	pthread_mutex_init(&se->lock, NULL);
 
@@ -3323,17 +4392,19 @@ void fuse_session_unmount(struct fuse_session *se)
 }
 
 #ifdef linux
-int fuse_req_getgroups(fuse_req_t req, int size, gid_t list[])
+static int read_proc_groups(pid_t pid, gid_t **groupsp)
 {
 	char *buf;
 	size_t bufsize = 1024;
 	char path[128];
+	gid_t *groups = NULL;
+	int ngroups = 0;
 	int ret;
 	int fd;
-	unsigned long pid = req->ctx.pid;
 	char *s;
 
-	sprintf(path, "/proc/%lu/task/%lu/status", pid, pid);
+	sprintf(path, "/proc/%lu/task/%lu/status",
+		(unsigned long) pid, (unsigned long) pid);
 
 retry:
 	buf = malloc(bufsize);
@@ -3365,7 +4436,6 @@ retry:
 		goto out_free;
 
 	s += 8;
-	ret = 0;
 	while (1) {
 		char *end;
 		unsigned long val = strtoul(s, &end, 0);
@@ -3373,15 +4443,189 @@ retry:
 			break;
 
 		s = end;
-		if (ret < size)
-			list[ret] = val;
-		ret++;
+		if (ngroups % 32 == 0) {
+			gid_t *tmp = realloc(groups,
+					     (ngroups + 32) * sizeof(gid_t));
+			if (tmp == NULL) {
+				free(groups);
+				ret = -ENOMEM;
+				goto out_free;
+			}
+			groups = tmp;
+		}
+		groups[ngroups++] = val;
 	}
+	*groupsp = groups;
+	ret = ngroups;
 
 out_free:
 	free(buf);
 	return ret;
 }
+
+/*
+ * Supplementary group cache (-o groups_cache_timeout=T)
+ *
+ * Groups read from /proc are remembered per pid for T seconds in a
+ * small direct-mapped table.  To make sure that a hit is still the
+ * same process and not a new one that reused the pid, an entry keeps
+ * a pidfd of the process if possible, which becomes readable once the
+ * process exits.  Otherwise the start time of the process is compared,
+ * which is cheaper to read than the group list.
+ */
+static unsigned long long proc_start_time(pid_t pid)
+{
+	char buf[1024];
+	char path[128];
+	char *s;
+	int fd;
+	int res;
+	int i;
+
+	sprintf(path, "/proc/%lu/task/%lu/stat",
+		(unsigned long) pid, (unsigned long) pid);
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return 0;
+	res = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (res <= 0)
+		return 0;
+	buf[res] = '\0';
+
+	/* The start time is the 22nd field, the 2nd may contain spaces */
+	s = strrchr(buf, ')');
+	for (i = 2; s && i < 22; i++)
+		s = strchr(s + 1, ' ');
+	return s ? strtoull(s + 1, NULL, 10) : 0;
+}
+
+static int open_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+	/* PIDFD_THREAD (O_EXCL) is needed for threads other than the leader */
+	int fd = syscall(SYS_pidfd_open, pid, O_EXCL);
+	if (fd == -1)
+		fd = syscall(SYS_pidfd_open, pid, 0);
+	return fd;
+#else
+	(void) pid;
+	return -1;
+#endif
+}
+
+static int groups_cache_get(struct fuse_session *se, pid_t pid, int size,
+			    gid_t list[])
+{
+	struct fuse_groups_entry *ent =
+		&se->groups_cache[pid % FUSE_GROUPS_CACHE_SIZE];
+	unsigned long long start_time = 0;
+	struct timespec now;
+	int ret = -1;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&se->groups_lock);
+	if (ent->pid == pid &&
+	    (now.tv_sec < ent->expires.tv_sec ||
+	     (now.tv_sec == ent->expires.tv_sec &&
+	      now.tv_nsec < ent->expires.tv_nsec))) {
+		if (ent->pidfd != -1) {
+			struct pollfd pfd = { .fd = ent->pidfd,
+					      .events = POLLIN };
+
+			if (poll(&pfd, 1, 0) != 0)
+				goto out_unlock;
+		}
+		start_time = ent->start_time;
+		ret = ent->ngroups;
+		for (i = 0; i < ret && i < size; i++)
+			list[i] = ent->groups[i];
+	}
+out_unlock:
+	pthread_mutex_unlock(&se->groups_lock);
+
+	if (ret != -1 && start_time && proc_start_time(pid) != start_time)
+		return -1;
+	return ret;
+}
+
+static void groups_cache_set(struct fuse_session *se, pid_t pid, int pidfd,
+			     unsigned long long start_time, gid_t *groups,
+			     int ngroups)
+{
+	struct fuse_groups_entry *ent =
+		&se->groups_cache[pid % FUSE_GROUPS_CACHE_SIZE];
+	struct timespec now;
+	double timeout = se->groups_timeout;
+	int oldfd;
+	gid_t *oldgroups;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&se->groups_lock);
+	oldfd = ent->pidfd;
+	oldgroups = ent->groups;
+	ent->pid = pid;
+	ent->pidfd = pidfd;
+	ent->start_time = start_time;
+	ent->groups = groups;
+	ent->ngroups = ngroups;
+	ent->expires.tv_sec = now.tv_sec + (time_t) timeout;
+	ent->expires.tv_nsec = now.tv_nsec +
+		(long) ((timeout - (time_t) timeout) * 1000000000.0);
+	if (ent->expires.tv_nsec >= 1000000000) {
+		ent->expires.tv_sec++;
+		ent->expires.tv_nsec -= 1000000000;
+	}
+	pthread_mutex_unlock(&se->groups_lock);
+
+	if (oldfd != -1)
+		close(oldfd);
+	free(oldgroups);
+}
+
+int fuse_req_getgroups(fuse_req_t req, int size, gid_t list[])
+{
+	struct fuse_session *se = req->se;
+	pid_t pid = req->ctx.pid;
+	unsigned long long start_time = 0;
+	gid_t *groups = NULL;
+	int pidfd = -1;
+	int ret;
+	int i;
+
+	if (req->has_supp_group) {
+		if (req->nr_supp_groups && size > 0)
+			list[0] = req->supp_group;
+		return req->nr_supp_groups;
+	}
+
+	if (se->groups_timeout > 0) {
+		ret = groups_cache_get(se, pid, size, list);
+		if (ret >= 0)
+			return ret;
+
+		/* Identify the process before reading its groups */
+		pidfd = open_pidfd(pid);
+		if (pidfd == -1)
+			start_time = proc_start_time(pid);
+	}
+
+	ret = read_proc_groups(pid, &groups);
+	if (ret < 0) {
+		if (pidfd != -1)
+			close(pidfd);
+		return ret;
+	}
+	for (i = 0; i < ret && i < size; i++)
+		list[i] = groups[i];
+
+	if (se->groups_timeout > 0 && (pidfd != -1 || start_time != 0))
+		groups_cache_set(se, pid, pidfd, start_time, groups, ret);
+	else
+		free(groups);
+	return ret;
+}
 #else /* linux */
 /*
  * This is currently not implemented on other than Linux...
@@ -13,19 +13,42 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <string.h>
+#include <stdint.h>
 #include <errno.h>
 #include <iconv.h>
 #include <pthread.h>
 #include <locale.h>
 #include <langinfo.h>
 
+#define ICONV_NAME_CACHE_SIZE 256
+
+struct iconv_name {
+	char *name;
+	char *newname;
+};
+
+/* Conversion state of one thread */
+struct iconv_thread {
+	struct iconv *ic;
+	iconv_t tofs;
+	iconv_t fromfs;
+	struct iconv_thread *next;
+	struct iconv_thread *prev;
+	struct iconv_name names[ICONV_NAME_CACHE_SIZE];
+};
+
 struct iconv {
 	struct fuse_fs *next;
 	pthread_mutex_t lock;
 	char *from_code;
 	char *to_code;
+	const char *from;
+	char *to;
 	iconv_t tofs;
 	iconv_t fromfs;
+	int ascii_compat;
+	pthread_key_t key;
+	struct iconv_thread threads;
 };
 
 struct iconv_dh {
@@ -39,15 +62,100 @@ static struct iconv *iconv_get(void)
 	return fuse_get_context()->private_data;
 }
 
+static void iconv_thread_free(void *data)
+{
+	struct iconv_thread *it = data;
+	struct iconv *ic = it->ic;
+	int i;
+
+	pthread_mutex_lock(&ic->lock);
+	it->prev->next = it->next;
+	it->next->prev = it->prev;
+	pthread_mutex_unlock(&ic->lock);
+
+	iconv_close(it->tofs);
+	iconv_close(it->fromfs);
+	for (i = 0; i < ICONV_NAME_CACHE_SIZE; i++) {
+		free(it->names[i].name);
+		free(it->names[i].newname);
+	}
+	free(it);
+}
+
+/*
+ * Each thread gets its own pair of conversion descriptors, so that
+ * threads don't serialize on ic->lock.  If they can't be created, the
+ * shared descriptors are used under the lock.
+ */
+static struct iconv_thread *iconv_thread_get(struct iconv *ic)
+{
+	struct iconv_thread *it = pthread_getspecific(ic->key);
+
+	if (it)
+		return it;
+
+	it = calloc(1, sizeof(struct iconv_thread));
+	if (!it)
+		return NULL;
+
+	it->ic = ic;
+	it->tofs = iconv_open(ic->from, ic->to);
+	if (it->tofs == (iconv_t) -1)
+		goto out_free;
+	it->fromfs = iconv_open(ic->to, ic->from);
+	if (it->fromfs == (iconv_t) -1)
+		goto out_close_to;
+	if (pthread_setspecific(ic->key, it) != 0)
+		goto out_close_from;
+
+	pthread_mutex_lock(&ic->lock);
+	it->next = ic->threads.next;
+	it->prev = &ic->threads;
+	it->next->prev = it;
+	ic->threads.next = it;
+	pthread_mutex_unlock(&ic->lock);
+
+	return it;
+
+out_close_from:
+	iconv_close(it->fromfs);
+out_close_to:
+	iconv_close(it->tofs);
+out_free:
+	free(it);
+	return NULL;
+}
+
+/* Check eight bytes at a time for any byte with the high bit set */
+static int is_ascii(const char *s, size_t len)
+{
+	const unsigned char *p = (const unsigned char *) s;
+	uint64_t acc = 0;
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		uint64_t word;
+
+		memcpy(&word, p + i, 8);
+		acc |= word;
+	}
+	for (; i < len; i++)
+		acc |= p[i];
+
+	return (acc & 0x8080808080808080ULL) == 0;
+}
+
 static int iconv_convpath(struct iconv *ic, const char *path, char **newpathp,
 			  int fromfs)
 {
+	struct iconv_thread *it;
 	size_t pathlen;
 	size_t newpathlen;
 	char *newpath;
 	size_t plen;
 	char *p;
 	size_t res;
+	iconv_t cd;
 	int err;
 
 	if (path == NULL) {
@@ -56,6 +164,14 @@ static int iconv_convpath(struct iconv *ic, const char *path, char **newpathp,
 	}
 
 	pathlen = strlen(path);
+	if (ic->ascii_compat && is_ascii(path, pathlen)) {
+		newpath = strdup(path);
+		if (!newpath)
+			return -ENOMEM;
+		*newpathp = newpath;
+		return 0;
+	}
+
 	newpathlen = pathlen * 4;
 	newpath = malloc(newpathlen + 1);
 	if (!newpath)
@@ -63,10 +179,15 @@ static int iconv_convpath(struct iconv *ic, const char *path, char **newpathp,
 
 	plen = newpathlen;
 	p = newpath;
-	pthread_mutex_lock(&ic->lock);
+	it = iconv_thread_get(ic);
+	if (it) {
+		cd = fromfs ? it->fromfs : it->tofs;
+	} else {
+		pthread_mutex_lock(&ic->lock);
+		cd = fromfs ? ic->fromfs : ic->tofs;
+	}
 	do {
-		res = iconv(fromfs ? ic->fromfs : ic->tofs, (char **) &path,
-			    &pathlen, &p, &plen);
+		res = iconv(cd, (char **) &path, &pathlen, &p, &plen);
 		if (res == (size_t) -1) {
 			char *tmp;
 			size_t inc;
@@ -88,18 +209,63 @@ static int iconv_convpath(struct iconv *ic, const char *path, char **newpathp,
 			newpath = tmp;
 		}
 	} while (res == (size_t) -1);
-	pthread_mutex_unlock(&ic->lock);
+	if (!it)
+		pthread_mutex_unlock(&ic->lock);
 	*p = '\0';
 	*newpathp = newpath;
 	return 0;
 
 err:
-	iconv(fromfs ? ic->fromfs : ic->tofs, NULL, NULL, NULL, NULL);
-	pthread_mutex_unlock(&ic->lock);
+	iconv(cd, NULL, NULL, NULL, NULL);
+	if (!it)
+		pthread_mutex_unlock(&ic->lock);
 	free(newpath);
 	return err;
 }
 
+/*
+ * Directory entries are converted through a small per-thread cache,
+ * since the same names tend to be listed again and again.
+ */
+static const char *iconv_convname(struct iconv *ic, const char *name,
+				  char **tofree)
+{
+	struct iconv_thread *it;
+	struct iconv_name *ent;
+	unsigned int hash = 0;
+	const char *s;
+	char *newname;
+
+	*tofree = NULL;
+	if (ic->ascii_compat && is_ascii(name, strlen(name)))
+		return name;
+
+	it = iconv_thread_get(ic);
+	if (!it) {
+		if (iconv_convpath(ic, name, tofree, 1) != 0)
+			return NULL;
+		return *tofree;
+	}
+
+	for (s = name; *s; s++)
+		hash = hash * 31 + (unsigned char) *s;
+	ent = &it->names[hash % ICONV_NAME_CACHE_SIZE];
+	if (ent->name && strcmp(ent->name, name) == 0)
+		return ent->newname;
+
+	if (iconv_convpath(ic, name, &newname, 1) != 0)
+		return NULL;
+	free(ent->name);
+	free(ent->newname);
+	ent->newname = newname;
+	ent->name = strdup(name);
+	if (!ent->name) {
+		ent->newname = NULL;
+		*tofree = newname;
+	}
+	return newname;
+}
+
 static int iconv_getattr(const char *path, struct stat *stbuf,
 			 struct fuse_file_info *fi)
 {
@@ -163,11 +329,14 @@ static int iconv_dir_fill(void *buf, const char *name,
 			  enum fuse_fill_dir_flags flags)
 {
 	struct iconv_dh *dh = buf;
-	char *newname;
+	const char *newname;
+	char *tofree;
 	int res = 0;
-	if (iconv_convpath(dh->ic, name, &newname, 1) == 0) {
+
+	newname = iconv_convname(dh->ic, name, &tofree);
+	if (newname) {
 		res = dh->prev_filler(dh->prev_buf, newname, stbuf, off, flags);
-		free(newname);
+		free(tofree);
 	}
 	return res;
 }
@@ -582,11 +751,15 @@ static void iconv_destroy(void *data)
 {
 	struct iconv *ic = data;
 	fuse_fs_destroy(ic->next);
+	while (ic->threads.next != &ic->threads)
+		iconv_thread_free(ic->threads.next);
+	pthread_key_delete(ic->key);
 	iconv_close(ic->tofs);
 	iconv_close(ic->fromfs);
 	pthread_mutex_destroy(&ic->lock);
 	free(ic->from_code);
 	free(ic->to_code);
+	free(ic->to);
 	free(ic);
 }
 
@@ -668,6 +841,28 @@ static int iconv_opt_proc(void *data, const char *arg, int key,
 	return 1;
 }
 
+/* Check whether ASCII strings are the same in both encodings */
+static int iconv_ascii_compat(iconv_t cd)
+{
+	char in[128];
+	char out[128 * 4];
+	char *inp = in;
+	char *outp = out;
+	size_t inlen = sizeof(in) - 1;
+	size_t outlen = sizeof(out);
+	size_t res;
+	int i;
+
+	for (i = 1; i < 128; i++)
+		in[i - 1] = i;
+	res = iconv(cd, &inp, &inlen, &outp, &outlen);
+	iconv(cd, NULL, NULL, NULL, NULL);
+
+	return res != (size_t) -1 && inlen == 0 &&
+		outp - out == sizeof(in) - 1 &&
+		memcmp(in, out, sizeof(in) - 1) == 0;
+}
+
 static struct fuse_fs *iconv_new(struct fuse_args *args,
 				 struct fuse_fs *next[])
 {
@@ -694,8 +889,17 @@ static struct fuse_fs *iconv_new(struct fuse_args *args,
 	from = ic->from_code ? ic->from_code : "UTF-8";
 	to = ic->to_code ? ic->to_code : "";
 	/* FIXME: detect charset equivalence? */
-	if (!to[0])
+	if (!to[0]) {
 		old = setlocale(LC_CTYPE, "");
+		/* Per-thread descriptors are opened later, in any locale */
+		to = nl_langinfo(CODESET);
+	}
+	ic->from = from;
+	ic->to = strdup(to);
+	if (!ic->to) {
+		fuse_log(FUSE_LOG_ERR, "fuse-iconv: memory allocation failed\n");
+		goto out_free;
+	}
 	ic->tofs = iconv_open(from, to);
 	if (ic->tofs == (iconv_t) -1) {
 		fuse_log(FUSE_LOG_ERR, "fuse-iconv: cannot convert from %s to %s\n",
@@ -703,7 +907,7 @@ static struct fuse_fs *iconv_new(struct fuse_args *args,
 		goto out_free;
 	}
 	ic->fromfs = iconv_open(to, from);
-	if (ic->tofs == (iconv_t) -1) {
+	if (ic->fromfs == (iconv_t) -1) {
 		fuse_log(FUSE_LOG_ERR, "fuse-iconv: cannot convert from %s to %s\n",
 			from, to);
 		goto out_iconv_close_to;
@@ -713,13 +917,25 @@ static struct fuse_fs *iconv_new(struct fuse_args *args,
 		old = NULL;
 	}
 
+	ic->ascii_compat = iconv_ascii_compat(ic->tofs) &&
+		iconv_ascii_compat(ic->fromfs);
+	if (pthread_key_create(&ic->key, iconv_thread_free) != 0) {
+		fuse_log(FUSE_LOG_ERR, "fuse-iconv: failed to create thread specific key\n");
+		goto out_iconv_close_from;
+	}
+	pthread_mutex_init(&ic->lock, NULL);
+	ic->threads.next = ic->threads.prev = &ic->threads;
+
 	ic->next = next[0];
 	fs = fuse_fs_new(&iconv_oper, sizeof(iconv_oper), ic);
 	if (!fs)
-		goto out_iconv_close_from;
+		goto out_key_delete;
 
 	return fs;
 
+out_key_delete:
+	pthread_key_delete(ic->key);
+	pthread_mutex_destroy(&ic->lock);
 out_iconv_close_from:
 	iconv_close(ic->fromfs);
 out_iconv_close_to:
@@ -727,6 +943,7 @@ out_iconv_close_to:
 out_free:
 	free(ic->from_code);
 	free(ic->to_code);
+	free(ic->to);
 	free(ic);
 	if (old) {
 		setlocale(LC_CTYPE, old);
@@ -14,12 +14,19 @@
 #include <stddef.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 
 struct subdir {
 	char *base;
 	size_t baselen;
 	int rellinks;
 	struct fuse_fs *next;
+	pthread_key_t key;
+};
+
+struct subdir_buf {
+	char *path[2];
+	size_t size[2];
 };
 
 static struct subdir *subdir_get(void)
@@ -27,39 +34,109 @@ static struct subdir *subdir_get(void)
 	return fuse_get_context()->private_data;
 }
 
-static int subdir_addpath(struct subdir *d, const char *path, char **newpathp)
+/*
+ * Prefixed paths are built in per-thread buffers that already contain
+ * the base directory, so that no memory is allocated per operation.
+ * Operations taking two paths use the second buffer for the other one.
+ */
+static struct subdir_buf *subdir_buf_get(struct subdir *d)
 {
-	char *newpath = NULL;
+	struct subdir_buf *b = pthread_getspecific(d->key);
+	int i;
 
-	if (path != NULL) {
-		unsigned newlen = d->baselen + strlen(path);
+	if (b)
+		return b;
 
-		newpath = malloc(newlen + 2);
-		if (!newpath)
-			return -ENOMEM;
+	b = calloc(1, sizeof(struct subdir_buf));
+	if (!b)
+		return NULL;
+
+	for (i = 0; i < 2; i++) {
+		b->size[i] = d->baselen + 256;
+		b->path[i] = malloc(b->size[i]);
+		if (!b->path[i])
+			goto out_free;
+		memcpy(b->path[i], d->base, d->baselen);
+	}
+	if (pthread_setspecific(d->key, b) != 0)
+		goto out_free;
+
+	return b;
+
+out_free:
+	free(b->path[0]);
+	free(b->path[1]);
+	free(b);
+	return NULL;
+}
+
+static void subdir_buf_free(void *data)
+{
+	struct subdir_buf *b = data;
+
+	free(b->path[0]);
+	free(b->path[1]);
+	free(b);
+}
 
-		if (path[0] == '/')
-			path++;
-		strcpy(newpath, d->base);
-		strcpy(newpath + d->baselen, path);
-		if (!newpath[0])
-			strcpy(newpath, ".");
+static void subdir_buf_free_current(struct subdir *d)
+{
+	struct subdir_buf *b = pthread_getspecific(d->key);
+
+	if (b) {
+		pthread_setspecific(d->key, NULL);
+		subdir_buf_free(b);
 	}
-	*newpathp = newpath;
+}
+
+static int subdir_addpath_buf(struct subdir *d, int i, const char *path,
+			      char **newpathp)
+{
+	struct subdir_buf *b;
+	size_t len;
+
+	if (path == NULL) {
+		*newpathp = NULL;
+		return 0;
+	}
+
+	b = subdir_buf_get(d);
+	if (!b)
+		return -ENOMEM;
+
+	if (path[0] == '/')
+		path++;
+	len = strlen(path);
+	if (d->baselen + len + 2 > b->size[i]) {
+		size_t newsize = (d->baselen + len + 2) * 2;
+		char *tmp = realloc(b->path[i], newsize);
+
+		if (!tmp)
+			return -ENOMEM;
+		b->path[i] = tmp;
+		b->size[i] = newsize;
+	}
+	memcpy(b->path[i] + d->baselen, path, len + 1);
+	if (!b->path[i][0])
+		strcpy(b->path[i], ".");
+	*newpathp = b->path[i];
 
 	return 0;
 }
 
+static int subdir_addpath(struct subdir *d, const char *path, char **newpathp)
+{
+	return subdir_addpath_buf(d, 0, path, newpathp);
+}
+
 static int subdir_getattr(const char *path, struct stat *stbuf,
 			  struct fuse_file_info *fi)
 {
 	struct subdir *d = subdir_get();
 	char *newpath;
 	int err = subdir_addpath(d, path, &newpath);
-	if (!err) {
+	if (!err)
 		err = fuse_fs_getattr(d->next, newpath, stbuf, fi);
-		free(newpath);
-	}
 	return err;
 }
 
@@ -68,10 +145,8 @@ static int subdir_access(const char *path, int mask)
 	struct subdir *d = subdir_get();
 	char *newpath;
 	int err = subdir_addpath(d, path, &newpath);
-	if (!err) {
+	if (!err)
 		err = fuse_fs_access(d->next, newpath, mask);
-		free(newpath);
-	}
 	return err;
 }
 
@@ -148,7 +223,6 @@ static int subdir_readlink(const char *path, char *buf, size_t size)
 		err = fuse_fs_readlink(d->next, newpath, buf, size);
 		if (!err && d->rellinks)
 			transform_symlink(d, newpath, buf, size);
-		free(newpath);
 	}
 	return err;
 }
@@ -158,10 +232,8 @@ static int subdir_opendir(const char *path, struct fuse_file_info *fi)
 	struct subdir *d = subdir_get();
 	char *newpath;
 	int err = subdir_addpath(d, path, &newpath);
-	if (!err) {
+	if (!err)
 		err = fuse_fs_opendir(d->next, newpath, fi);
-		free(newpath);
-	}
 	return err;
 }
 
@@ -173,11 +245,9 @@ static int subdir_readdir(const char *path, void *buf,
 	struct subdir *d = subdir_get();
 	char *newpath;
 	int err = subdir_addpath(d, path, &newpath);
-	if (!err) {
+	if (!err)
 		err = fuse_fs_readdir(d->next, newpath, buf, filler, offset,
 				      fi, flags);
-		free(newpath);
-	}
 	return err;
 }
 
@@ -186,10 +256,8 @@ static int subdir_releasedir(const char *path, struct fuse_file_info *fi)
 	struct subdir *d = subdir_get();
 	char *newpath;
 	int err = subdir_addpath(d, path, &newpath);
-	if (!err) {
+	if (!err)
 		err = fuse_fs_releasedir(d->next, newpath, fi);
-		free(newpath);
-	}
 	return err;
 }
 
@@ -198,10 +266,8 @@ static int subdir_mknod(const char *path, mode_t mode, dev_t rdev)
 	struct subdir *d = subdir_get();
 	char *newpath;
 	int err = subdir_addpath(d, path, &newpath);
-	if (!err) {
+	if (!err)
 		err = fuse_fs_mknod(d->next, newpath, mode, rdev);
-		free(newpath);
-	}
 	return err;
 }
 
@@ -210,10 +276,8 @@ static int subdir_mkdir(const char *path, mode_t mode)
 	struct subdir *d = subdir_get();
 	char *newpath;
 	int err = subdir_addpath(d, path, &newpath);
-	if (!err) {
+	if (!err)
 		err = fuse_fs_mkdir(d->next, newpath, mode);
-		free(newpath);
-	}
 	return err;
 }
 
@@ -222,10 +286,8 @@ static int subdir_unlink(const char *path)
 	struct subdir *d = subdir_get();
 	char *newpath;
 	int err = subdir_addpath(d, path, &newpath);
-	if (!err) {
+	if (!err)
 		err = fuse_fs_unlink(d->next, newpath);
-		free(newpath);
-	}
 	return err;
 }
 
@@ -234,10 +296,8 @@ static int subdir_rmdir(const char *path)
 	struct subdir *d = subdir_get();
 	char *newpath;
 	int err = subdir_addpath(d, path, &newpath);
-	if (!err) {
+	if (!err)
 		err = fuse_fs_rmdir(d->next, newpath);
-		free(newpath);
-	}
 	return err;
 }
 
@@ -246,10 +306,8 @@ static int subdir_symlink(const char *from, const char *path)
 	struct subdir *d = subdir_get();
 	char *newpath;
 	int err = subdir_addpath(d, path, &newpath);
-	if (!err) {
+	if (!err)
 		err = fuse_fs_symlink(d->next, from, newpath);
-		free(newpath);
-	}
 	return err;
 }
 
@@ -260,12 +318,9 @@ static int subdir_rename(const char *from, const char *to, unsigned int flags)
 	char *newto;
 	int err = subdir_addpath(d, from, &newfrom);
 	if (!err) {
-		err = subdir_addpath(d, to, &newto);
-		if (!err) {
+		err = subdir_addpath_buf(d, 1, to, &newto);
+		if (!err)
 			err = fuse_fs_rename(d->next, newfrom, newto, flags);
-			free(newto);
-		}
-		free(newfrom);
 	}
 	return err;
 }
@@ -277,12 +332,9 @@ static int subdir_link(const char *from, const char *to)
 	char *newto;
 	int err = subdir_addpath(d, from, &newfrom);
 	if (!err) {
-		err = subdir_addpath(d, to, &newto);
-		if (!err) {
+		err = subdir_addpath_buf(d, 1, to, &newto);
+		if (!err)
 			err = fuse_fs_link(d->next, newfrom, newto);
-			free(newto);
-		}
-		free(newfrom);
 	}
 	return err;
 }
@@ -293,10 +345,8 @@ static int subdir_chmod(const char *path, mode_t mode,
 	struct subdir *d = subdir_get();
 	char *newpath;
 	int err = subdir_addpath(d, path, &newpath);
-	if (!err) {
+	if (!err)
 		err = fuse_fs_chmod(d->next, newpath, mode, fi);
-		free(newpath);
-	}
 	return err;
 }
 
@@ -306,10 +356,8 @@ static int subdir_chown(const char *path, uid_t uid, gid_t gid,
 	struct subdir *d = subdir_get();
 	char *newpath;
 	int err = subdir_addpath(d, path, &newpath);
-	if (!err) {
+	if (!err)
 		err = fuse_fs_chown(d->next, newpath, uid, gid, fi);
-		free(newpath);
-	}
 	return err;
 }
 
@@ -319,10 +367,8 @@ static int subdir_truncate(const char *path, off_t size,
 	struct subdir *d = subdir_get();
 	char *newpath;
 	int err = subdir_addpath(d, path, &newpath);
-	if (!err) {
+	if (!err)
 		err = fuse_fs_truncate(d->next, newpath, size, fi);
-		free(newpath);
-	}
 	return err;
 }
 
@@ -332,10 +378,8 @@ static int subdir_utimens(const char *path, const struct timespec ts[2],
 	struct subdir *d = subdir_get();
 	char *newpath;
 	int err = subdir_addpath(d, path, &newpath);
-	if (!err) {
+	if (!err)
 		err = fuse_fs_utimens(d->next, newpath, ts, fi);
-		free(newpath);
-	}
 	return err;
 }
 
@@ -345,10 +389,8 @@ static int subdir_create(const char *path, mode_t mode,
 	struct subdir *d = subdir_get();
 	char *newpath;
 	int err = subdir_addpath(d, path, &newpath);
-	if (!err) {
+	if (!err)
 		err = fuse_fs_create(d->next, newpath, mode, fi);
-		free(newpath);
-	}
 	return err;
 }
 
@@ -357,10 +399,8 @@ static int subdir_open(const char *path, struct fuse_file_info *fi)
 	struct subdir *d = subdir_get();
 	char *newpath;
 	int err = subdir_addpath(d, path, &newpath);
-	if (!err) {
+	if (!err)
 		err = fuse_fs_open(d->next, newpath, fi);
-		free(newpath);
-	}
 	return err;
 }
 
@@ -370,10 +410,8 @@ static int subdir_read_buf(const char *path, struct fuse_bufvec **bufp,
 	struct subdir *d = subdir_get();
 	char *newpath;
 	int err = subdir_addpath(d, path, &newpath);
-	if (!err) {
+	if (!err)
 		err = fuse_fs_read_buf(d->next, newpath, bufp, size, offset, fi);
-		free(newpath);
-	}
 	return err;
 }
 
@@ -383,10 +421,8 @@ static int subdir_write_buf(const char *path, struct fuse_bufvec *buf,
 	struct subdir *d = subdir_get();
 	char *newpath;
 	int err = subdir_addpath(d, path, &newpath);
-	if (!err) {
+	if (!err)
 		err = fuse_fs_write_buf(d->next, newpath, buf, offset, fi);
-		free(newpath);
-	}
 	return err;
 }
 
@@ -395,10 +431,8 @@ static int subdir_statfs(const char *path, struct statvfs *stbuf)
 	struct subdir *d = subdir_get();
 	char *newpath;
 	int err = subdir_addpath(d, path, &newpath);
-	if (!err) {
+	if (!err)
 		err = fuse_fs_statfs(d->next, newpath, stbuf);
-		free(newpath);
-	}
 	return err;
 }
 
@@ -407,10 +441,8 @@ static int subdir_flush(const char *path, struct fuse_file_info *fi)
 	struct subdir *d = subdir_get();
 	char *newpath;
 	int err = subdir_addpath(d, path, &newpath);
-	if (!err) {
+	if (!err)
 		err = fuse_fs_flush(d->next, newpath, fi);
-		free(newpath);
-	}
 	return err;
 }
 
@@ -419,10 +451,8 @@ static int subdir_release(const char *path, struct fuse_file_info *fi)
 	struct subdir *d = subdir_get();
 	char *newpath;
 	int err = subdir_addpath(d, path, &newpath);
-	if (!err) {
+	if (!err)
 		err = fuse_fs_release(d->next, newpath, fi);
-		free(newpath);
-	}
 	return err;
 }
 
@@ -432,10 +462,8 @@ static int subdir_fsync(const char *path, int isdatasync,
 	struct subdir *d = subdir_get();
 	char *newpath;
 	int err = subdir_addpath(d, path, &newpath);
-	if (!err) {
+	if (!err)
 		err = fuse_fs_fsync(d->next, newpath, isdatasync, fi);
-		free(newpath);
-	}
 	return err;
 }
 
@@ -445,10 +473,8 @@ static int subdir_fsyncdir(const char *path, int isdatasync,
 	struct subdir *d = subdir_get();
 	char *newpath;
 	int err = subdir_addpath(d, path, &newpath);
-	if (!err) {
+	if (!err)
 		err = fuse_fs_fsyncdir(d->next, newpath, isdatasync, fi);
-		free(newpath);
-	}
 	return err;
 }
 
@@ -458,11 +484,9 @@ static int subdir_setxattr(const char *path, const char *name,
 	struct subdir *d = subdir_get();
 	char *newpath;
 	int err = subdir_addpath(d, path, &newpath);
-	if (!err) {
+	if (!err)
 		err = fuse_fs_setxattr(d->next, newpath, name, value, size,
 				       flags);
-		free(newpath);
-	}
 	return err;
 }
 
@@ -472,10 +496,8 @@ static int subdir_getxattr(const char *path, const char *name, char *value,
 	struct subdir *d = subdir_get();
 	char *newpath;
 	int err = subdir_addpath(d, path, &newpath);
-	if (!err) {
+	if (!err)
 		err = fuse_fs_getxattr(d->next, newpath, name, value, size);
-		free(newpath);
-	}
 	return err;
 }
 
@@ -484,10 +506,8 @@ static int subdir_listxattr(const char *path, char *list, size_t size)
 	struct subdir *d = subdir_get();
 	char *newpath;
 	int err = subdir_addpath(d, path, &newpath);
-	if (!err) {
+	if (!err)
 		err = fuse_fs_listxattr(d->next, newpath, list, size);
-		free(newpath);
-	}
 	return err;
 }
 
@@ -496,10 +516,8 @@ static int subdir_removexattr(const char *path, const char *name)
 	struct subdir *d = subdir_get();
 	char *newpath;
 	int err = subdir_addpath(d, path, &newpath);
-	if (!err) {
+	if (!err)
 		err = fuse_fs_removexattr(d->next, newpath, name);
-		free(newpath);
-	}
 	return err;
 }
 
@@ -509,10 +527,8 @@ static int subdir_lock(const char *path, struct fuse_file_info *fi, int cmd,
 	struct subdir *d = subdir_get();
 	char *newpath;
 	int err = subdir_addpath(d, path, &newpath);
-	if (!err) {
+	if (!err)
 		err = fuse_fs_lock(d->next, newpath, fi, cmd, lock);
-		free(newpath);
-	}
 	return err;
 }
 
@@ -521,10 +537,8 @@ static int subdir_flock(const char *path, struct fuse_file_info *fi, int op)
 	struct subdir *d = subdir_get();
 	char *newpath;
 	int err = subdir_addpath(d, path, &newpath);
-	if (!err) {
+	if (!err)
 		err = fuse_fs_flock(d->next, newpath, fi, op);
-		free(newpath);
-	}
 	return err;
 }
 
@@ -533,10 +547,8 @@ static int subdir_bmap(const char *path, size_t blocksize, uint64_t *idx)
 	struct subdir *d = subdir_get();
 	char *newpath;
 	int err = subdir_addpath(d, path, &newpath);
-	if (!err) {
+	if (!err)
 		err = fuse_fs_bmap(d->next, newpath, blocksize, idx);
-		free(newpath);
-	}
 	return err;
 }
 
@@ -546,10 +558,8 @@ static off_t subdir_lseek(const char *path, off_t off, int whence,
 	struct subdir *ic = subdir_get();
 	char *newpath;
 	int res = subdir_addpath(ic, path, &newpath);
-	if (!res) {
+	if (!res)
 		res = fuse_fs_lseek(ic->next, newpath, off, whence, fi);
-		free(newpath);
-	}
 	return res;
 }
 
@@ -567,6 +577,8 @@ static void subdir_destroy(void *data)
 {
 	struct subdir *d = data;
 	fuse_fs_destroy(d->next);
+	subdir_buf_free_current(d);
+	pthread_key_delete(d->key);
 	free(d->base);
 	free(d);
 }
@@ -675,11 +687,17 @@ static struct fuse_fs *subdir_new(struct fuse_args *args,
 	}
 	d->baselen = strlen(d->base);
 	d->next = next[0];
+	if (pthread_key_create(&d->key, subdir_buf_free) != 0) {
+		fuse_log(FUSE_LOG_ERR, "fuse-subdir: failed to create thread specific key\n");
+		goto out_free;
+	}
 	fs = fuse_fs_new(&subdir_oper, sizeof(subdir_oper), d);
 	if (!fs)
-		goto out_free;
+		goto out_key_delete;
 	return fs;
 
+out_key_delete:
+	pthread_key_delete(d->key);
 out_free:
 	free(d->base);
 	free(d);
@@ -0,0 +1,196 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv2.
+  See the file COPYING.
+*/
+
+/*
+ * Lookup/forget storm: runs threads that stat random files in a
+ * directory and create and unlink files of their own, so that the file
+ * system sees a stream of LOOKUP and FORGET requests for many
+ * different inodes.  Prints the throughput with one thread and with
+ * the requested number of threads.
+ *
+ * Meant to be run against a file system mounted without entry and
+ * attribute caching, e.g. passthrough_hp --nocache.
+ *
+ * With -c, that many additional files are created and looked up
+ * before measuring, so that the file system has to find the inodes of
+ * the working set among a larger number of known inodes.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+static const char *dir;
+static int nfiles = 1000;
+static int ncached;
+static double seconds = 2;
+static volatile int stop;
+
+struct worker {
+	pthread_t thread;
+	int id;
+	unsigned long ops;
+	int err;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *storm(void *data)
+{
+	struct worker *w = data;
+	unsigned int seed = w->id;
+	char path[4096];
+	struct stat st;
+	int fd;
+
+	while (!stop) {
+		int r = rand_r(&seed);
+
+		if (r % 8 == 0) {
+			snprintf(path, sizeof(path), "%s/t%d-%d", dir, w->id,
+				 r % 16);
+			fd = open(path, O_CREAT | O_WRONLY, 0644);
+			if (fd == -1 || close(fd) == -1 || unlink(path) == -1) {
+				w->err = errno;
+				break;
+			}
+		} else {
+			snprintf(path, sizeof(path), "%s/f%d", dir,
+				 r % nfiles);
+			if (stat(path, &st) == -1) {
+				w->err = errno;
+				break;
+			}
+		}
+		w->ops++;
+	}
+	return NULL;
+}
+
+static int create_files(const char *prefix, int count, int lookup)
+{
+	char path[4096];
+	struct stat st;
+	int fd;
+
+	for (int i = 0; i < count; i++) {
+		snprintf(path, sizeof(path), "%s/%s%d", dir, prefix, i);
+		fd = open(path, O_CREAT | O_WRONLY, 0644);
+		if (fd == -1 || close(fd) == -1 ||
+		    (lookup && stat(path, &st) == -1)) {
+			perror(path);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void remove_files(const char *prefix, int count)
+{
+	char path[4096];
+
+	for (int i = 0; i < count; i++) {
+		snprintf(path, sizeof(path), "%s/%s%d", dir, prefix, i);
+		unlink(path);
+	}
+}
+
+static int run(int nthreads)
+{
+	struct worker *w = calloc(nthreads, sizeof(*w));
+	unsigned long ops = 0;
+	double start, elapsed;
+	int err = 0;
+
+	if (w == NULL) {
+		perror("calloc");
+		return 1;
+	}
+	stop = 0;
+	start = now();
+	for (int i = 0; i < nthreads; i++) {
+		w[i].id = i;
+		if (pthread_create(&w[i].thread, NULL, storm, &w[i]) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	usleep(seconds * 1e6);
+	stop = 1;
+	for (int i = 0; i < nthreads; i++) {
+		pthread_join(w[i].thread, NULL);
+		ops += w[i].ops;
+		if (w[i].err)
+			err = w[i].err;
+	}
+	elapsed = now() - start;
+	free(w);
+
+	if (err) {
+		fprintf(stderr, "lookup_storm: %s\n", strerror(err));
+		return 1;
+	}
+	printf("%3d threads: %10.0f ops/s\n", nthreads, ops / elapsed);
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-t threads] [-f files] [-c cached] "
+		"[-s seconds] dir\n", prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int nthreads = 8;
+	int opt, res;
+
+	while ((opt = getopt(argc, argv, "t:f:c:s:")) != -1) {
+		switch (opt) {
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'f':
+			nfiles = atoi(optarg);
+			break;
+		case 'c':
+			ncached = atoi(optarg);
+			break;
+		case 's':
+			seconds = atof(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || nthreads < 1 || nfiles < 1 || ncached < 0)
+		usage(argv[0]);
+	dir = argv[optind];
+
+	res = create_files("f", nfiles, 0) || create_files("c", ncached, 1);
+	if (!res)
+		res = run(1);
+	if (!res && nthreads > 1)
+		res = run(nthreads);
+
+	remove_files("f", nfiles);
+	remove_files("c", ncached);
+	return res;
+}
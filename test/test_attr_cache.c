@@ -0,0 +1,229 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv2.
+  See the file COPYING.
+*/
+
+/*
+ * Checks that modifications done through the filesystem invalidate
+ * the attribute cache of the high-level library (-o attr_cache):
+ * truncation by open(O_TRUNC), and the link count of the other names
+ * of a hard-linked file after link and unlink.
+ *
+ * The filesystem mirrors <srcdir>.  Attributes are read with
+ * AT_STATX_FORCE_SYNC, so that they come from the library rather than
+ * from the kernel's cache.
+ *
+ * Usage: test_attr_cache <srcdir> <mountpoint>
+ */
+
+#define FUSE_USE_VERSION FUSE_MAKE_VERSION(3, 17)
+
+#define _GNU_SOURCE
+
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+static const char *src_dir;
+
+static void src_path(char *buf, size_t size, const char *path)
+{
+	snprintf(buf, size, "%s%s", src_dir, path);
+}
+
+static void *tfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+	(void) conn;
+
+	cfg->attr_cache = 1;
+	cfg->attr_timeout = 60;
+	cfg->entry_timeout = 0;
+	cfg->negative_timeout = 0;
+	return NULL;
+}
+
+static int tfs_getattr(const char *path, struct stat *stbuf,
+		       struct fuse_file_info *fi)
+{
+	char buf[4096];
+
+	(void) fi;
+	src_path(buf, sizeof(buf), path);
+	if (lstat(buf, stbuf) == -1)
+		return -errno;
+	return 0;
+}
+
+static int tfs_truncate(const char *path, off_t size,
+			struct fuse_file_info *fi)
+{
+	char buf[4096];
+	int res;
+
+	if (fi)
+		res = ftruncate(fi->fh, size);
+	else {
+		src_path(buf, sizeof(buf), path);
+		res = truncate(buf, size);
+	}
+	if (res == -1)
+		return -errno;
+	return 0;
+}
+
+static int tfs_open(const char *path, struct fuse_file_info *fi)
+{
+	char buf[4096];
+	int fd;
+
+	src_path(buf, sizeof(buf), path);
+	fd = open(buf, fi->flags);
+	if (fd == -1)
+		return -errno;
+	fi->fh = fd;
+	return 0;
+}
+
+static int tfs_release(const char *path, struct fuse_file_info *fi)
+{
+	(void) path;
+	close(fi->fh);
+	return 0;
+}
+
+static int tfs_link(const char *from, const char *to)
+{
+	char buf1[4096], buf2[4096];
+
+	src_path(buf1, sizeof(buf1), from);
+	src_path(buf2, sizeof(buf2), to);
+	if (link(buf1, buf2) == -1)
+		return -errno;
+	return 0;
+}
+
+static int tfs_unlink(const char *path)
+{
+	char buf[4096];
+
+	src_path(buf, sizeof(buf), path);
+	if (unlink(buf) == -1)
+		return -errno;
+	return 0;
+}
+
+static const struct fuse_operations tfs_oper = {
+	.init		= tfs_init,
+	.getattr	= tfs_getattr,
+	.truncate	= tfs_truncate,
+	.open		= tfs_open,
+	.release	= tfs_release,
+	.link		= tfs_link,
+	.unlink		= tfs_unlink,
+};
+
+static void *run_fs(void *data)
+{
+	struct fuse *f = data;
+
+	fuse_loop(f);
+	return NULL;
+}
+
+static struct statx check_stat(const char *mnt, const char *name)
+{
+	char path[4096];
+	struct statx stx;
+
+	snprintf(path, sizeof(path), "%s/%s", mnt, name);
+	if (statx(AT_FDCWD, path, AT_STATX_FORCE_SYNC,
+		  STATX_SIZE | STATX_NLINK, &stx) == -1) {
+		perror(path);
+		exit(1);
+	}
+	return stx;
+}
+
+static void test_fs(const char *mnt)
+{
+	char path[4096], path2[4096];
+	char data[100];
+	int fd;
+
+	memset(data, 'x', sizeof(data));
+	src_path(path, sizeof(path), "/a");
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	assert(fd != -1);
+	assert(write(fd, data, sizeof(data)) == sizeof(data));
+	close(fd);
+
+	/* Truncating open */
+	assert(check_stat(mnt, "a").stx_size == sizeof(data));
+	snprintf(path, sizeof(path), "%s/a", mnt);
+	fd = open(path, O_WRONLY | O_TRUNC);
+	assert(fd != -1);
+	close(fd);
+	assert(check_stat(mnt, "a").stx_size == 0);
+
+	/* Link: the cached link count of "b" must not survive */
+	snprintf(path2, sizeof(path2), "%s/b", mnt);
+	assert(link(path, path2) == 0);
+	assert(check_stat(mnt, "a").stx_nlink == 2);
+	assert(check_stat(mnt, "b").stx_nlink == 2);
+	snprintf(path2, sizeof(path2), "%s/c", mnt);
+	assert(link(path, path2) == 0);
+	assert(check_stat(mnt, "b").stx_nlink == 3);
+	assert(check_stat(mnt, "c").stx_nlink == 3);
+
+	/* Unlink: same for "a" and "b" */
+	assert(check_stat(mnt, "a").stx_nlink == 3);
+	assert(unlink(path2) == 0);
+	assert(check_stat(mnt, "a").stx_nlink == 2);
+	assert(check_stat(mnt, "b").stx_nlink == 2);
+
+	snprintf(path2, sizeof(path2), "%s/b", mnt);
+	assert(unlink(path2) == 0);
+	assert(unlink(path) == 0);
+}
+
+int main(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+	const char *mnt;
+	pthread_t fs_thread;
+	struct fuse *f;
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s <srcdir> <mountpoint>\n", argv[0]);
+		return 1;
+	}
+	src_dir = argv[1];
+	mnt = argv[2];
+
+	assert(fuse_opt_add_arg(&args, argv[0]) == 0);
+#ifndef __FreeBSD__
+	assert(fuse_opt_add_arg(&args, "-oauto_unmount") == 0);
+#endif
+	f = fuse_new(&args, &tfs_oper, sizeof(tfs_oper), NULL);
+	assert(f != NULL);
+	assert(fuse_mount(f, mnt) == 0);
+	assert(pthread_create(&fs_thread, NULL, run_fs, f) == 0);
+
+	test_fs(mnt);
+
+	fuse_exit(f);
+	fuse_unmount(f);
+	pthread_join(fs_thread, NULL);
+	fuse_destroy(f);
+	fuse_opt_free_args(&args);
+
+	printf("Test completed successfully.\n");
+	return 0;
+}
@@ -45,9 +45,62 @@ def test_write_cache(tmpdir, writeback, output_checker):
     subprocess.check_call(cmdline, stdout=output_checker.fd, stderr=output_checker.fd)
 
 
-names = [ 'notify_inval_inode', 'invalidate_path' ]
+def test_lock_table(tmpdir, output_checker):
+    mnt_dir = str(tmpdir)
+    create_tmpdir(mnt_dir)
+    cmdline = [ pjoin(basename, 'test', 'test_lock_table'),
+                mnt_dir, '--locks=10000' ]
+    subprocess.check_call(cmdline, stdout=output_checker.fd, stderr=output_checker.fd)
+
+
+@pytest.mark.skipif(fuse_proto < (7,12),
+                    reason='not supported by running kernel')
+@pytest.mark.parametrize("options", ('noforget', 'remember=60'))
+def test_node_budget(tmpdir, options, output_checker):
+    mnt_dir = str(tmpdir)
+    create_tmpdir(mnt_dir)
+    cmdline = [ pjoin(basename, 'test', 'test_node_budget'),
+                mnt_dir, '-o', options ]
+    subprocess.check_call(cmdline, stdout=output_checker.fd, stderr=output_checker.fd)
+
+
+def test_forget_storm(tmpdir, output_checker):
+    mnt_dir = str(tmpdir)
+    create_tmpdir(mnt_dir)
+    cmdline = [ pjoin(basename, 'test', 'test_forget_storm'), mnt_dir ]
+    subprocess.check_call(cmdline, stdout=output_checker.fd, stderr=output_checker.fd)
+
+
+def test_attr_cache(tmpdir, output_checker):
+    mnt_dir = str(tmpdir.mkdir('mnt'))
+    src_dir = str(tmpdir.mkdir('src'))
+    cmdline = [ pjoin(basename, 'test', 'test_attr_cache'),
+                src_dir, mnt_dir ]
+    subprocess.check_call(cmdline, stdout=output_checker.fd, stderr=output_checker.fd)
+
+
+def test_neg_cache(tmpdir, output_checker):
+    mnt_dir = str(tmpdir.mkdir('mnt'))
+    src_dir = str(tmpdir.mkdir('src'))
+    cmdline = [ pjoin(basename, 'test', 'test_neg_cache'),
+                src_dir, mnt_dir ]
+    subprocess.check_call(cmdline, stdout=output_checker.fd, stderr=output_checker.fd)
+
+
+@pytest.mark.skipif(fuse_proto < (7,21),
+                    reason='not supported by running kernel')
+def test_readdir_cache(tmpdir, output_checker):
+    mnt_dir = str(tmpdir.mkdir('mnt'))
+    src_dir = str(tmpdir.mkdir('src'))
+    cmdline = [ pjoin(basename, 'test', 'test_readdir_cache'),
+                src_dir, mnt_dir ]
+    subprocess.check_call(cmdline, stdout=output_checker.fd, stderr=output_checker.fd)
+
+
+names = [ 'notify_inval_inode', 'notify_inval_inode --async',
+          'invalidate_path' ]
 if fuse_proto >= (7,15):
-    names.append('notify_store_retrieve')
+    names += [ 'notify_store_retrieve', 'notify_store_retrieve --callback' ]
 @pytest.mark.skipif(fuse_proto < (7,12),
                     reason='not supported by running kernel')
 @pytest.mark.parametrize("name", names)
@@ -55,9 +108,10 @@ if fuse_proto >= (7,15):
 def test_notify1(tmpdir, name, notify, output_checker):
     mnt_dir = str(tmpdir)
     create_tmpdir(mnt_dir)
+    name, *extra = name.split()
     cmdline = base_cmdline + \
               [ pjoin(basename, 'example', name),
-                '-f', '--update-interval=1', mnt_dir ]
+                '-f', '--update-interval=1', *extra, mnt_dir ]
     if not notify:
         cmdline.append('--no-notify')
     mount_process = subprocess.Popen(cmdline, stdout=output_checker.fd,
@@ -15,9 +15,12 @@ import shutil
 import filecmp
 import tempfile
 import time
+import threading
 import errno
+import re
 import sys
 import platform
+import ctypes
 from looseversion import LooseVersion
 from tempfile import NamedTemporaryFile
 from contextlib import contextmanager
@@ -114,6 +117,88 @@ def test_hello(tmpdir, name, options, cmdline_builder, output_checker):
     else:
         umount(mount_process, mnt_dir)
 
+@pytest.mark.skipif(not os.path.exists(pjoin(basename, 'example', 'hello_ll_coro')),
+                    reason='needs C++20 coroutine support')
+def test_hello_ll_coro(tmpdir, output_checker):
+    mnt_dir = str(tmpdir)
+    cmdline = base_cmdline + \
+              [ pjoin(basename, 'example', 'hello_ll_coro'),
+                '-f', '-s', '--delay=200', mnt_dir ]
+    mount_process = subprocess.Popen(cmdline, stdout=output_checker.fd,
+                                     stderr=output_checker.fd)
+    try:
+        wait_for_mount(mount_process, mnt_dir)
+        assert os.listdir(mnt_dir) == [ 'hello' ]
+        filename = pjoin(mnt_dir, 'hello')
+        with pytest.raises(IOError) as exc_info:
+            open(filename, 'r+')
+        assert exc_info.value.errno == errno.EACCES
+
+        # Reads wait 200 ms for the backend, but suspended handlers do
+        # not block the (single) session loop thread, so concurrent
+        # reads complete together.
+        results = []
+        def read_hello():
+            with open(filename, 'r') as fh:
+                results.append(fh.read())
+        threads = [ threading.Thread(target=read_hello) for _ in range(16) ]
+        start = time.time()
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        assert results == [ 'Hello World!\n' ] * 16
+        assert time.time() - start < 16 * 0.2
+    except:
+        cleanup(mount_process, mnt_dir)
+        raise
+    else:
+        umount(mount_process, mnt_dir)
+
+def test_hello_async(tmpdir, output_checker):
+    mnt_dir = str(tmpdir)
+    cmdline = base_cmdline + \
+              [ pjoin(basename, 'example', 'hello_async'),
+                '-f', '-s', '--delay=200', mnt_dir ]
+    mount_process = subprocess.Popen(cmdline, stdout=output_checker.fd,
+                                     stderr=output_checker.fd)
+    try:
+        wait_for_mount(mount_process, mnt_dir)
+        assert sorted(os.listdir(mnt_dir)) == [ 'hello', 'scratch' ]
+        assert os.stat(pjoin(mnt_dir, 'hello')).st_size == 13
+        with pytest.raises(FileNotFoundError):
+            os.stat(pjoin(mnt_dir, 'missing'))
+
+        scratch = pjoin(mnt_dir, 'scratch')
+        data = os.urandom(10000)
+        with open(scratch, 'r+b') as fh:
+            fh.write(data)
+        assert os.stat(scratch).st_size == len(data)
+        with open(scratch, 'rb') as fh:
+            assert fh.read() == data
+
+        # Every operation waits 200 ms for the backend, but pending
+        # operations do not block the (single) session loop thread, so
+        # concurrent reads complete together.
+        filename = pjoin(mnt_dir, 'hello')
+        results = []
+        def read_hello():
+            with open(filename, 'r') as fh:
+                results.append(fh.read())
+        threads = [ threading.Thread(target=read_hello) for _ in range(16) ]
+        start = time.time()
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        assert results == [ 'Hello World!\n' ] * 16
+        assert time.time() - start < 16 * 0.2
+    except:
+        cleanup(mount_process, mnt_dir)
+        raise
+    else:
+        umount(mount_process, mnt_dir)
+
 @pytest.mark.parametrize("writeback", (False, True))
 @pytest.mark.parametrize("name", ('passthrough', 'passthrough_plus',
                            'passthrough_fh', 'passthrough_ll'))
@@ -192,8 +277,91 @@ def test_passthrough(short_tmpdir, name, debug, output_checker, writeback):
     else:
         umount(mount_process, mnt_dir)
 
+@pytest.mark.parametrize("options", ('noforget,max_nodes=16',
+                                     'remember=60,max_node_mem=4096',
+                                     'attr_cache',
+                                     'neg_cache_timeout=60,neg_cache_size=8',
+                                     'readdir_stream',
+                                     'readdir_cache',
+                                     'readdirplus_prefetch=4',
+                                     'modules=subdir,subdir=/'))
+def test_passthrough_hl_options(short_tmpdir, options, output_checker):
+    mnt_dir = str(short_tmpdir.mkdir('mnt'))
+    src_dir = str(short_tmpdir.mkdir('src'))
+
+    cmdline = base_cmdline + \
+              [ pjoin(basename, 'example', 'passthrough'),
+                '-f', mnt_dir, '-o', options ]
+    mount_process = subprocess.Popen(cmdline, stdout=output_checker.fd,
+                                     stderr=output_checker.fd)
+    try:
+        wait_for_mount(mount_process, mnt_dir)
+        work_dir = mnt_dir + src_dir
+
+        tst_readdir(src_dir, work_dir)
+        tst_readdir_big(src_dir, work_dir)
+        tst_open_read(src_dir, work_dir)
+        tst_open_write(src_dir, work_dir)
+        tst_create(work_dir)
+        tst_mkdir(work_dir)
+        tst_rmdir(work_dir, src_dir)
+        tst_unlink(work_dir, src_dir)
+        tst_symlink(work_dir)
+        tst_link(work_dir)
+        tst_open_unlink(work_dir)
+
+        # test_syscalls assumes that changes in source directory
+        # will be reflected immediately in mountpoint, which is not
+        # the case for names cached as non-existent.
+        if 'neg_cache_timeout' not in options:
+            subprocess.check_call([ os.path.join(basename, 'test', 'test_syscalls'),
+                                    work_dir, ':' + src_dir ])
+    except:
+        cleanup(mount_process, mnt_dir)
+        raise
+    else:
+        umount(mount_process, mnt_dir)
+
+def test_readdir_stream_offsets(short_tmpdir, output_checker):
+    # passthrough_fh passes telldir() offsets to the filler
+    mnt_dir = str(short_tmpdir.mkdir('mnt'))
+    src_dir = str(short_tmpdir.mkdir('src'))
+
+    cmdline = base_cmdline + \
+              [ pjoin(basename, 'example', 'passthrough_fh'),
+                '-f', mnt_dir, '-o', 'readdir_stream' ]
+    mount_process = subprocess.Popen(cmdline, stdout=output_checker.fd,
+                                     stderr=output_checker.fd)
+    try:
+        wait_for_mount(mount_process, mnt_dir)
+        work_dir = mnt_dir + src_dir
+
+        tst_readdir(src_dir, work_dir)
+        tst_readdir_big(src_dir, work_dir)
+        subprocess.check_call([ os.path.join(basename, 'test', 'test_syscalls'),
+                                work_dir, ':' + src_dir ])
+    except:
+        cleanup(mount_process, mnt_dir)
+        raise
+    else:
+        umount(mount_process, mnt_dir)
+
+def io_uring_available():
+    '''Check if an io_uring can be set up like passthrough_hp does'''
+    if sys.platform != 'linux':
+        return False
+    libc = ctypes.CDLL(None, use_errno=True)
+    params = ctypes.create_string_buffer(120) # struct io_uring_params
+    fd = libc.syscall(425, 1, params) # io_uring_setup
+    if fd < 0:
+        return False
+    os.close(fd)
+    features = int.from_bytes(params.raw[20:24], sys.byteorder)
+    return bool(features & 1) # IORING_FEAT_SINGLE_MMAP
+
+@pytest.mark.parametrize("io_uring", (False, True))
 @pytest.mark.parametrize("cache", (False, True))
-def test_passthrough_hp(short_tmpdir, cache, output_checker):
+def test_passthrough_hp(short_tmpdir, cache, io_uring, output_checker):
     mnt_dir = str(short_tmpdir.mkdir('mnt'))
     src_dir = str(short_tmpdir.mkdir('src'))
 
@@ -205,7 +373,13 @@ def test_passthrough_hp(short_tmpdir, cache, output_checker):
 
     if not cache:
         cmdline.append('--nocache')
-        
+
+    if io_uring:
+        # passthrough_hp fails to start if io_uring can't be set up
+        if not io_uring_available():
+            pytest.skip('io_uring not available')
+        cmdline += [ '--io-uring', '--nopassthrough' ]
+
     mount_process = subprocess.Popen(cmdline, stdout=output_checker.fd,
                                      stderr=output_checker.fd)
     try:
@@ -260,7 +434,165 @@ def test_passthrough_hp(short_tmpdir, cache, output_checker):
     else:
         umount(mount_process, mnt_dir)
 
-        
+def test_passthrough_hp_lookup_storm(short_tmpdir, output_checker):
+    mnt_dir = str(short_tmpdir.mkdir('mnt'))
+    src_dir = str(short_tmpdir.mkdir('src'))
+
+    cmdline = base_cmdline + \
+              [ pjoin(basename, 'example', 'passthrough_hp'),
+                src_dir, mnt_dir, '--foreground', '--nocache' ]
+    mount_process = subprocess.Popen(cmdline, stdout=output_checker.fd,
+                                     stderr=output_checker.fd)
+    try:
+        wait_for_mount(mount_process, mnt_dir)
+        subprocess.check_call([ pjoin(basename, 'test', 'lookup_storm'),
+                                '-t', '4', '-f', '200', '-s', '0.5', mnt_dir ],
+                              stdout=output_checker.fd,
+                              stderr=output_checker.fd)
+        assert os.listdir(src_dir) == []
+    except:
+        cleanup(mount_process, mnt_dir)
+        raise
+    else:
+        umount(mount_process, mnt_dir)
+
+def test_passthrough_ll_lookup_storm(short_tmpdir, output_checker):
+    mnt_dir = str(short_tmpdir.mkdir('mnt'))
+    src_dir = str(short_tmpdir.mkdir('src'))
+
+    cmdline = base_cmdline + \
+              [ pjoin(basename, 'example', 'passthrough_ll'), '-f',
+                '-o', 'cache=never,source=' + src_dir, mnt_dir ]
+    mount_process = subprocess.Popen(cmdline, stdout=output_checker.fd,
+                                     stderr=output_checker.fd)
+    try:
+        wait_for_mount(mount_process, mnt_dir)
+        subprocess.check_call([ pjoin(basename, 'test', 'lookup_storm'),
+                                '-t', '4', '-f', '200', '-c', '2000',
+                                '-s', '0.5', mnt_dir ],
+                              stdout=output_checker.fd,
+                              stderr=output_checker.fd)
+        assert os.listdir(src_dir) == []
+    except:
+        cleanup(mount_process, mnt_dir)
+        raise
+    else:
+        umount(mount_process, mnt_dir)
+
+# The large copy shows the throughput, but needs 4 GiB of disk space
+large_copy = os.environ.get('TEST_LARGE_COPY', 'no').lower().strip() \
+    not in ('no', 'false', '0')
+
+@pytest.mark.skipif(not hasattr(os, 'copy_file_range'),
+                    reason='needs os.copy_file_range')
+@pytest.mark.parametrize("size", (8 * 1024**2,
+    pytest.param(2 * 1024**3, marks=pytest.mark.skipif(
+        not large_copy, reason='set TEST_LARGE_COPY=yes to run'))))
+@pytest.mark.parametrize("name", ('passthrough_ll', 'passthrough_hp'))
+def test_copy_file_range(short_tmpdir, name, size, output_checker):
+    mnt_dir = str(short_tmpdir.mkdir('mnt'))
+    src_dir = str(short_tmpdir.mkdir('src'))
+
+    if name == 'passthrough_hp':
+        cmdline = base_cmdline + \
+                  [ pjoin(basename, 'example', name),
+                    src_dir, mnt_dir, '--foreground', '--nocache' ]
+        work_dir = mnt_dir
+    else:
+        cmdline = base_cmdline + \
+                  [ pjoin(basename, 'example', name), '-f', mnt_dir ]
+        work_dir = mnt_dir + src_dir
+    mount_process = subprocess.Popen(cmdline, stdout=output_checker.fd,
+                                     stderr=output_checker.fd)
+    try:
+        wait_for_mount(mount_process, mnt_dir)
+        tst_copy_file_range(src_dir, work_dir, size)
+    except:
+        cleanup(mount_process, mnt_dir)
+        raise
+    else:
+        umount(mount_process, mnt_dir)
+
+@pytest.mark.skipif(fuse_proto < (7,15),
+                    reason='not supported by running kernel')
+@pytest.mark.parametrize("writeback", (False, True))
+def test_store_prefetch(short_tmpdir, writeback, output_checker):
+    mnt_dir = str(short_tmpdir.mkdir('mnt'))
+    src_dir = str(short_tmpdir.mkdir('src'))
+
+    options = 'store_prefetch=1048576,store_prefetch_min=65536'
+    if writeback:
+        options += ',writeback'
+    cmdline = base_cmdline + \
+              [ pjoin(basename, 'example', 'passthrough_ll'), '-f', mnt_dir,
+                '-o', options ]
+    # passthrough_ll prints the prefetch statistics to stdout on exit
+    mount_process = subprocess.Popen(cmdline, stdout=subprocess.PIPE,
+                                     stderr=output_checker.fd,
+                                     universal_newlines=True)
+    try:
+        wait_for_mount(mount_process, mnt_dir)
+        work_dir = mnt_dir + src_dir
+
+        tst_open_read(src_dir, work_dir)
+        tst_open_write(src_dir, work_dir)
+        tst_truncate_fd(work_dir)
+
+        data = os.urandom(8 * 1024 * 1024)
+        with open(pjoin(src_dir, 'big'), 'wb') as fh:
+            fh.write(data)
+        with open(pjoin(work_dir, 'big'), 'rb') as fh:
+            for off in range(0, len(data), 65536):
+                assert fh.read(65536) == data[off:off+65536]
+            assert fh.read(65536) == b''
+
+        # Data written while prefetching must not be overwritten
+        patch = b'x' * 4096
+        data = data[:3*1024*1024] + patch + data[3*1024*1024+len(patch):]
+        with open(pjoin(work_dir, 'big'), 'r+b') as fh:
+            assert fh.read(1024 * 1024) == data[:1024*1024]
+            fh.seek(3 * 1024 * 1024)
+            fh.write(patch)
+            fh.seek(0)
+            assert fh.read() == data
+
+        # Same for copy_file_range() into the file and for O_TRUNC
+        # opens.  The targets lie within the prefetch window.
+        if hasattr(os, 'copy_file_range'):
+            patch = b'y' * 4096
+            data = data[:1088*1024] + patch + data[1088*1024+len(patch):]
+            with open(pjoin(src_dir, 'patch'), 'wb') as fh:
+                fh.write(patch)
+            with open(pjoin(work_dir, 'big'), 'r+b') as fh, \
+                 open(pjoin(work_dir, 'patch'), 'rb') as fh_in:
+                assert fh.read(1024 * 1024) == data[:1024*1024]
+                assert os.copy_file_range(fh_in.fileno(), fh.fileno(),
+                                          len(patch), 0,
+                                          1088 * 1024) == len(patch)
+                fh.seek(0)
+                assert fh.read() == data
+        with open(pjoin(work_dir, 'big'), 'rb') as fh:
+            assert fh.read(1024 * 1024) == data[:1024*1024]
+            with open(pjoin(work_dir, 'big'), 'wb') as fh_out:
+                fh_out.write(patch)
+            fh.seek(0)
+            assert fh.read() == patch
+    except:
+        cleanup(mount_process, mnt_dir)
+        raise
+    else:
+        umount(mount_process, mnt_dir)
+
+    stats = re.search(r'^prefetch: (\d+) reads, (\d+) bytes stored',
+                      mount_process.stdout.read(), re.MULTILINE)
+    if writeback:
+        # Stores could replace dirty pages, so prefetch is disabled
+        assert stats is None
+    else:
+        assert stats is not None
+        assert int(stats.group(2)) > 0
+
+
 @pytest.mark.skipif(fuse_proto < (7,11),
                     reason='not supported by running kernel')
 def test_ioctl(tmpdir, output_checker):
@@ -857,6 +1189,38 @@ def tst_passthrough(src_dir, mnt_dir):
     assert os.stat(src_name) == os.stat(mnt_name)
 
 
+def tst_copy_file_range(src_dir, mnt_dir, size):
+    chunk = os.urandom(1024 * 1024)
+    name_in = name_generator()
+    name_out = name_generator()
+    with open(pjoin(src_dir, name_in), 'wb') as fh:
+        for _ in range(size // len(chunk)):
+            fh.write(chunk)
+
+    start = time.time()
+    with open(pjoin(mnt_dir, name_in), 'rb') as fh_in, \
+         open(pjoin(mnt_dir, name_out), 'wb') as fh_out:
+        copied = 0
+        while copied < size:
+            res = os.copy_file_range(fh_in.fileno(), fh_out.fileno(),
+                                     size - copied)
+            assert res > 0
+            copied += res
+    elapsed = time.time() - start
+    print('copy_file_range: %d MiB in %.2f s (%.0f MiB/s)'
+          % (size // 1024**2, elapsed, size / 1024**2 / elapsed))
+
+    assert os.stat(pjoin(src_dir, name_out)).st_size == size
+    with open(pjoin(src_dir, name_out), 'rb') as fh:
+        while True:
+            data = fh.read(len(chunk))
+            if not data:
+                break
+            assert data == chunk
+    os.unlink(pjoin(mnt_dir, name_in))
+    os.unlink(pjoin(mnt_dir, name_out))
+
+
 def tst_xattr(path):
     os.setxattr(path, b'hello_ll_setxattr_name', b'hello_ll_setxattr_value')
     assert os.getxattr(path, b'hello_ll_getxattr_name') == b'hello_ll_getxattr_value'
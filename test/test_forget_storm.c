@@ -0,0 +1,151 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv2.
+  See the file COPYING.
+*/
+
+/*
+ * Forget storm: looks up many files, then makes the kernel drop all
+ * of their dentries at once (like drop_caches does), so that the
+ * inodes are forgotten with BATCH_FORGET requests.  Prints the forget
+ * throughput and checks with fuse_get_stats() that the forgets were
+ * batched and the nodes freed by the background reclaimer.
+ *
+ * Usage: test_forget_storm <mountpoint> [nfiles]
+ */
+
+#define FUSE_USE_VERSION FUSE_MAKE_VERSION(3, 17)
+
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+static int nfiles = 20000;
+
+static int tfs_getattr(const char *path, struct stat *stbuf,
+		       struct fuse_file_info *fi)
+{
+	int n;
+	char c;
+
+	(void) fi;
+
+	memset(stbuf, 0, sizeof(struct stat));
+	if (strcmp(path, "/") == 0) {
+		stbuf->st_mode = S_IFDIR | 0755;
+		stbuf->st_nlink = 2;
+	} else if (sscanf(path, "/f%d%c", &n, &c) == 1 &&
+		   n >= 0 && n < nfiles) {
+		stbuf->st_mode = S_IFREG | 0644;
+		stbuf->st_nlink = 1;
+	} else
+		return -ENOENT;
+
+	return 0;
+}
+
+static const struct fuse_operations tfs_oper = {
+	.getattr	= tfs_getattr,
+};
+
+static void *run_fs(void *data)
+{
+	struct fuse *f = data;
+
+	fuse_loop(f);
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+	struct fuse_stats stats;
+	struct fuse_session *se;
+	struct fuse *f;
+	pthread_t fs_thread;
+	const char *mnt;
+	char name[32];
+	char path[4096];
+	struct stat st;
+	double start;
+	int i;
+
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "usage: %s <mountpoint> [nfiles]\n", argv[0]);
+		return 1;
+	}
+	mnt = argv[1];
+	if (argc == 3)
+		nfiles = atoi(argv[2]);
+
+	assert(fuse_opt_add_arg(&args, argv[0]) == 0);
+#ifndef __FreeBSD__
+	assert(fuse_opt_add_arg(&args, "-oauto_unmount") == 0);
+#endif
+	f = fuse_new(&args, &tfs_oper, sizeof(tfs_oper), NULL);
+	assert(f != NULL);
+	assert(fuse_mount(f, mnt) == 0);
+	se = fuse_get_session(f);
+	assert(pthread_create(&fs_thread, NULL, run_fs, f) == 0);
+
+	for (i = 0; i < nfiles; i++) {
+		snprintf(path, sizeof(path), "%s/f%d", mnt, i);
+		if (stat(path, &st) == -1) {
+			perror(path);
+			return 1;
+		}
+	}
+	fuse_get_stats(f, &stats);
+	printf("after lookup: %llu nodes\n", (unsigned long long) stats.nodes);
+	assert(stats.nodes == (uint64_t) nfiles + 1);
+
+	/* Drop the dentries, so that the kernel forgets the inodes */
+	start = now();
+	for (i = 0; i < nfiles; i++) {
+		snprintf(name, sizeof(name), "f%d", i);
+		assert(fuse_lowlevel_notify_inval_entry(se, FUSE_ROOT_ID, name,
+							strlen(name)) == 0);
+	}
+
+	for (i = 0; i < 1000; i++) {
+		fuse_get_stats(f, &stats);
+		if (stats.nodes == 1)
+			break;
+		usleep(10000);
+	}
+	printf("after forget: %llu nodes, %llu forgets in %llu requests, "
+	       "%llu reclaimed, %.0f forgets/s\n",
+	       (unsigned long long) stats.nodes,
+	       (unsigned long long) stats.forgets,
+	       (unsigned long long) stats.forget_batches,
+	       (unsigned long long) stats.reclaimed,
+	       stats.forgets / (now() - start));
+	assert(stats.nodes == 1);
+	assert(stats.forgets == (uint64_t) nfiles);
+	assert(stats.forget_batches < stats.forgets);
+	assert(stats.reclaimed > 0);
+
+	fuse_exit(f);
+	fuse_unmount(f);
+	pthread_join(fs_thread, NULL);
+	fuse_destroy(f);
+	fuse_opt_free_args(&args);
+
+	printf("Test completed successfully.\n");
+	return 0;
+}
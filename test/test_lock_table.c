@@ -0,0 +1,310 @@
+/*
+  FUSE: Filesystem in Userspace
+
+  This program can be distributed under the terms of the GNU GPLv2.
+  See the file COPYING.
+*/
+
+/*
+ * Exercises the POSIX lock table kept by the high-level library.
+ *
+ * The file system accepts every lock request, so all conflict
+ * detection is done by the library.  The main process takes random
+ * byte-range locks and a child process (which is a different lock
+ * owner) checks with F_GETLK that the library reports exactly the
+ * merged and split ranges predicted by a simple per-byte model.
+ * Afterwards a large number of disjoint locks is taken and probed to
+ * measure the cost of F_SETLK/F_GETLK with many locks held.
+ */
+
+#define FUSE_USE_VERSION 31
+
+#define _GNU_SOURCE
+
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#ifndef __linux__
+#include <limits.h>
+#else
+#include <linux/limits.h>
+#endif
+
+#define FILE_NAME "lock_me"
+#define MODEL_SIZE 64
+#define RANDOM_OPS 500
+
+struct options {
+	int locks;
+} options = {
+	.locks = 10000,
+};
+
+static const struct fuse_opt option_spec[] = {
+	{ "--locks=%d", offsetof(struct options, locks), 1 },
+	FUSE_OPT_END
+};
+
+static int tfs_getattr(const char *path, struct stat *stbuf,
+		       struct fuse_file_info *fi)
+{
+	(void) fi;
+
+	memset(stbuf, 0, sizeof(struct stat));
+	if (strcmp(path, "/") == 0) {
+		stbuf->st_mode = S_IFDIR | 0755;
+		stbuf->st_nlink = 2;
+	} else if (strcmp(path, "/" FILE_NAME) == 0) {
+		stbuf->st_mode = S_IFREG | 0666;
+		stbuf->st_nlink = 1;
+	} else {
+		return -ENOENT;
+	}
+	return 0;
+}
+
+static int tfs_open(const char *path, struct fuse_file_info *fi)
+{
+	(void) fi;
+
+	if (strcmp(path, "/" FILE_NAME) != 0)
+		return -ENOENT;
+	return 0;
+}
+
+static int tfs_lock(const char *path, struct fuse_file_info *fi, int cmd,
+		    struct flock *lock)
+{
+	(void) path;
+	(void) fi;
+
+	if (cmd == F_GETLK)
+		lock->l_type = F_UNLCK;
+	return 0;
+}
+
+static const struct fuse_operations tfs_oper = {
+	.getattr	= tfs_getattr,
+	.open		= tfs_open,
+	.lock		= tfs_lock,
+};
+
+static void *run_fs(void *data)
+{
+	struct fuse *f = (struct fuse *) data;
+	fuse_loop(f);
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int set_lock(int fd, int cmd, short type, off_t start, off_t len)
+{
+	struct flock fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = start;
+	fl.l_len = len;
+	if (fcntl(fd, cmd, &fl) == -1)
+		return -errno;
+	if (cmd == F_GETLK && fl.l_type != F_UNLCK)
+		return 1;
+	return 0;
+}
+
+struct op {
+	short type;
+	int start;
+	int len;
+};
+
+/* Check from the child that F_GETLK agrees with the model */
+static void check_model(int fd, const short *model)
+{
+	for (int i = 0; i < MODEL_SIZE; i++) {
+		struct flock fl;
+		int start, end;
+
+		memset(&fl, 0, sizeof(fl));
+		fl.l_type = F_WRLCK;
+		fl.l_whence = SEEK_SET;
+		fl.l_start = i;
+		fl.l_len = 1;
+		assert(fcntl(fd, F_GETLK, &fl) == 0);
+		if (fl.l_type != model[i]) {
+			fprintf(stderr, "ERROR: byte %d: got type %d, expected %d\n",
+				i, fl.l_type, model[i]);
+			exit(1);
+		}
+		if (model[i] == F_UNLCK)
+			continue;
+
+		/* The reported lock must be a maximal run of one type */
+		for (start = i; start > 0 && model[start - 1] == model[i];
+		     start--);
+		for (end = i; end < MODEL_SIZE - 1 && model[end + 1] == model[i];
+		     end++);
+		if (fl.l_start != start || fl.l_start + fl.l_len - 1 != end) {
+			fprintf(stderr, "ERROR: byte %d: got range %lld-%lld, expected %d-%d\n",
+				i, (long long) fl.l_start,
+				(long long) (fl.l_start + fl.l_len - 1),
+				start, end);
+			exit(1);
+		}
+	}
+}
+
+static void test_semantics(const char *fname)
+{
+	static const short types[] = { F_RDLCK, F_WRLCK, F_UNLCK };
+	short model[MODEL_SIZE];
+	int to_child[2], to_parent[2];
+	struct op op;
+	pid_t pid;
+	int fd;
+	char c;
+
+	for (int i = 0; i < MODEL_SIZE; i++)
+		model[i] = F_UNLCK;
+	assert(pipe(to_child) == 0);
+	assert(pipe(to_parent) == 0);
+
+	pid = fork();
+	assert(pid != -1);
+	if (pid == 0) {
+		close(to_child[1]);
+		close(to_parent[0]);
+		fd = open(fname, O_RDWR);
+		assert(fd != -1);
+		while (read(to_child[0], &op, sizeof(op)) == sizeof(op)) {
+			for (int i = op.start; i < op.start + op.len; i++)
+				model[i] = op.type;
+			check_model(fd, model);
+			assert(write(to_parent[1], "", 1) == 1);
+		}
+		close(fd);
+		_exit(0);
+	}
+
+	fd = open(fname, O_RDWR);
+	assert(fd != -1);
+	srandom(1);
+	for (int cnt = 0; cnt < RANDOM_OPS; cnt++) {
+		op.type = types[random() % 3];
+		op.start = random() % MODEL_SIZE;
+		op.len = 1 + random() % (MODEL_SIZE - op.start);
+		if (op.len > 16 && random() % 4)
+			op.len = 1 + random() % 16;
+		assert(set_lock(fd, F_SETLK, op.type, op.start, op.len) == 0);
+		assert(write(to_child[1], &op, sizeof(op)) == sizeof(op));
+		assert(read(to_parent[0], &c, 1) == 1);
+	}
+	close(to_child[1]);
+	assert(waitpid(pid, NULL, 0) == pid);
+	close(to_child[0]);
+	close(to_parent[0]);
+	close(to_parent[1]);
+
+	/* Closing the file drops all locks of this owner */
+	close(fd);
+	fd = open(fname, O_RDWR);
+	assert(fd != -1);
+	assert(set_lock(fd, F_GETLK, F_WRLCK, 0, 0) == 0);
+	close(fd);
+	printf("semantics: %d random operations OK\n", RANDOM_OPS);
+}
+
+static void test_bench(const char *fname)
+{
+	int fd, status;
+	double t;
+	pid_t pid;
+
+	fd = open(fname, O_RDWR);
+	assert(fd != -1);
+
+	/* Disjoint locks with a gap between them, so nothing is merged */
+	t = now();
+	for (int i = 0; i < options.locks; i++)
+		assert(set_lock(fd, F_SETLK, F_WRLCK, 2 * i, 1) == 0);
+	printf("F_SETLK x %d: %.3f s\n", options.locks, now() - t);
+
+	pid = fork();
+	assert(pid != -1);
+	if (pid == 0) {
+		int cfd = open(fname, O_RDWR);
+		assert(cfd != -1);
+		t = now();
+		for (int i = 0; i < options.locks; i++) {
+			off_t off = random() % (2 * options.locks);
+			int res = set_lock(cfd, F_GETLK, F_RDLCK, off, 1);
+			assert((off % 2 == 0) == (res != 0));
+		}
+		printf("F_GETLK x %d: %.3f s\n", options.locks, now() - t);
+		close(cfd);
+		_exit(0);
+	}
+	assert(waitpid(pid, &status, 0) == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	t = now();
+	for (int i = 0; i < options.locks; i++)
+		assert(set_lock(fd, F_SETLK, F_UNLCK, 2 * i, 1) == 0);
+	printf("F_UNLCK x %d: %.3f s\n", options.locks, now() - t);
+	close(fd);
+}
+
+int main(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_cmdline_opts fuse_opts;
+	char fname[PATH_MAX];
+	pthread_t fs_thread;
+	struct fuse *f;
+
+	assert(fuse_opt_parse(&args, &options, option_spec, NULL) == 0);
+	assert(fuse_parse_cmdline(&args, &fuse_opts) == 0);
+#ifndef __FreeBSD__
+	assert(fuse_opt_add_arg(&args, "-oauto_unmount") == 0);
+#endif
+	f = fuse_new(&args, &tfs_oper, sizeof(tfs_oper), NULL);
+	assert(f != NULL);
+	assert(fuse_mount(f, fuse_opts.mountpoint) == 0);
+	assert(pthread_create(&fs_thread, NULL, run_fs, (void *) f) == 0);
+
+	assert(snprintf(fname, PATH_MAX, "%s/" FILE_NAME,
+			fuse_opts.mountpoint) > 0);
+	test_semantics(fname);
+	test_bench(fname);
+	free(fuse_opts.mountpoint);
+
+	fuse_exit(f);
+	fuse_unmount(f);
+	assert(pthread_join(fs_thread, NULL) == 0);
+	fuse_destroy(f);
+	fuse_opt_free_args(&args);
+
+	printf("Test completed successfully.\n");
+	return 0;
+}
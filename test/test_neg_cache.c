@@ -0,0 +1,251 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv2.
+  See the file COPYING.
+*/
+
+/*
+ * Checks the negative entry cache of the high-level library
+ * (-o neg_cache_timeout=T): repeated lookups of a missing name must
+ * not reach the filesystem, and creating the name with create, mknod,
+ * rename or link must drop the cached entry.
+ *
+ * The filesystem mirrors <srcdir> and counts the getattr calls for
+ * the missing name.  The kernel doesn't cache negative entries
+ * (negative_timeout=0), so every lookup reaches the library.
+ *
+ * Usage: test_neg_cache <srcdir> <mountpoint>
+ */
+
+#define FUSE_USE_VERSION FUSE_MAKE_VERSION(3, 17)
+
+#define _GNU_SOURCE
+
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+static const char *src_dir;
+static atomic_int missing_lookups;
+
+static void src_path(char *buf, size_t size, const char *path)
+{
+	snprintf(buf, size, "%s%s", src_dir, path);
+}
+
+static void *tfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+	(void) conn;
+
+	cfg->neg_cache_timeout = 60;
+	cfg->negative_timeout = 0;
+	cfg->entry_timeout = 0;
+	cfg->attr_timeout = 0;
+	return NULL;
+}
+
+static int tfs_getattr(const char *path, struct stat *stbuf,
+		       struct fuse_file_info *fi)
+{
+	char buf[4096];
+
+	(void) fi;
+	src_path(buf, sizeof(buf), path);
+	if (lstat(buf, stbuf) == -1) {
+		if (errno == ENOENT && strcmp(path, "/x") == 0)
+			missing_lookups++;
+		return -errno;
+	}
+	return 0;
+}
+
+static int tfs_create(const char *path, mode_t mode,
+		      struct fuse_file_info *fi)
+{
+	char buf[4096];
+	int fd;
+
+	src_path(buf, sizeof(buf), path);
+	fd = open(buf, fi->flags, mode);
+	if (fd == -1)
+		return -errno;
+	fi->fh = fd;
+	return 0;
+}
+
+static int tfs_release(const char *path, struct fuse_file_info *fi)
+{
+	(void) path;
+	close(fi->fh);
+	return 0;
+}
+
+static int tfs_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+	char buf[4096];
+
+	src_path(buf, sizeof(buf), path);
+	if (mknod(buf, mode, rdev) == -1)
+		return -errno;
+	return 0;
+}
+
+static int tfs_rename(const char *from, const char *to, unsigned int flags)
+{
+	char buf1[4096], buf2[4096];
+
+	if (flags)
+		return -EINVAL;
+	src_path(buf1, sizeof(buf1), from);
+	src_path(buf2, sizeof(buf2), to);
+	if (rename(buf1, buf2) == -1)
+		return -errno;
+	return 0;
+}
+
+static int tfs_link(const char *from, const char *to)
+{
+	char buf1[4096], buf2[4096];
+
+	src_path(buf1, sizeof(buf1), from);
+	src_path(buf2, sizeof(buf2), to);
+	if (link(buf1, buf2) == -1)
+		return -errno;
+	return 0;
+}
+
+static int tfs_unlink(const char *path)
+{
+	char buf[4096];
+
+	src_path(buf, sizeof(buf), path);
+	if (unlink(buf) == -1)
+		return -errno;
+	return 0;
+}
+
+static const struct fuse_operations tfs_oper = {
+	.init		= tfs_init,
+	.getattr	= tfs_getattr,
+	.create		= tfs_create,
+	.release	= tfs_release,
+	.mknod		= tfs_mknod,
+	.rename		= tfs_rename,
+	.link		= tfs_link,
+	.unlink		= tfs_unlink,
+};
+
+static void *run_fs(void *data)
+{
+	struct fuse *f = data;
+
+	fuse_loop(f);
+	return NULL;
+}
+
+/* Looks up the missing name twice, only the first may reach the fs */
+static void check_missing(const char *path)
+{
+	int before = missing_lookups;
+	struct stat st;
+
+	assert(stat(path, &st) == -1 && errno == ENOENT);
+	assert(stat(path, &st) == -1 && errno == ENOENT);
+	assert(missing_lookups <= before + 1);
+}
+
+static void check_created(const char *what, const char *path)
+{
+	struct stat st;
+
+	if (stat(path, &st) == -1) {
+		perror(what);
+		exit(1);
+	}
+	assert(unlink(path) == 0);
+	check_missing(path);
+}
+
+static void test_fs(struct fuse *f, const char *mnt)
+{
+	char path[4096], other[4096];
+	struct fuse_stats stats;
+	struct stat st;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/x", mnt);
+	snprintf(other, sizeof(other), "%s/y", mnt);
+
+	/* Repeated lookups are answered from the cache */
+	assert(stat(path, &st) == -1 && errno == ENOENT);
+	assert(missing_lookups == 1);
+	check_missing(path);
+	check_missing(path);
+	assert(missing_lookups == 1);
+	fuse_get_stats(f, &stats);
+	assert(stats.neg_entries == 1);
+	assert(stats.neg_hits >= 4);
+
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	assert(fd != -1);
+	close(fd);
+	check_created("create", path);
+
+	assert(mknod(path, S_IFREG | 0644, 0) == 0);
+	check_created("mknod", path);
+
+	fd = open(other, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	assert(fd != -1);
+	close(fd);
+	assert(rename(other, path) == 0);
+	check_created("rename", path);
+
+	fd = open(other, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	assert(fd != -1);
+	close(fd);
+	assert(link(other, path) == 0);
+	check_created("link", path);
+	assert(unlink(other) == 0);
+}
+
+int main(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+	const char *mnt;
+	pthread_t fs_thread;
+	struct fuse *f;
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s <srcdir> <mountpoint>\n", argv[0]);
+		return 1;
+	}
+	src_dir = argv[1];
+	mnt = argv[2];
+
+	assert(fuse_opt_add_arg(&args, argv[0]) == 0);
+#ifndef __FreeBSD__
+	assert(fuse_opt_add_arg(&args, "-oauto_unmount") == 0);
+#endif
+	f = fuse_new(&args, &tfs_oper, sizeof(tfs_oper), NULL);
+	assert(f != NULL);
+	assert(fuse_mount(f, mnt) == 0);
+	assert(pthread_create(&fs_thread, NULL, run_fs, f) == 0);
+
+	test_fs(f, mnt);
+
+	fuse_exit(f);
+	fuse_unmount(f);
+	pthread_join(fs_thread, NULL);
+	fuse_destroy(f);
+	fuse_opt_free_args(&args);
+
+	printf("Test completed successfully.\n");
+	return 0;
+}
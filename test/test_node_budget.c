@@ -0,0 +1,136 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv2.
+  See the file COPYING.
+*/
+
+/*
+ * Checks that the node budget (max_nodes) of the high-level library
+ * evicts remembered nodes: a directory with more entries than the
+ * budget is walked, the kernel is made to forget the entries, and the
+ * node count reported by fuse_get_stats() must drop to the budget.
+ *
+ * Usage: test_node_budget <mountpoint> -o noforget|remember=T
+ */
+
+#define FUSE_USE_VERSION FUSE_MAKE_VERSION(3, 17)
+
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define NFILES 256
+#define MAX_NODES 16
+
+static int tfs_getattr(const char *path, struct stat *stbuf,
+		       struct fuse_file_info *fi)
+{
+	int n;
+	char c;
+
+	(void) fi;
+
+	memset(stbuf, 0, sizeof(struct stat));
+	if (strcmp(path, "/") == 0) {
+		stbuf->st_mode = S_IFDIR | 0755;
+		stbuf->st_nlink = 2;
+	} else if (sscanf(path, "/f%d%c", &n, &c) == 1 &&
+		   n >= 0 && n < NFILES) {
+		stbuf->st_mode = S_IFREG | 0644;
+		stbuf->st_nlink = 1;
+	} else
+		return -ENOENT;
+
+	return 0;
+}
+
+static const struct fuse_operations tfs_oper = {
+	.getattr	= tfs_getattr,
+};
+
+static void *run_fs(void *data)
+{
+	struct fuse *f = data;
+
+	fuse_loop(f);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_cmdline_opts opts;
+	struct fuse_stats stats;
+	struct fuse_session *se;
+	struct fuse *f;
+	pthread_t fs_thread;
+	char name[32];
+	char path[4096];
+	struct stat st;
+	int i;
+
+	assert(fuse_parse_cmdline(&args, &opts) == 0);
+	if (opts.mountpoint == NULL) {
+		fprintf(stderr, "usage: %s <mountpoint> -o noforget|remember=T\n",
+			argv[0]);
+		return 1;
+	}
+#ifndef __FreeBSD__
+	assert(fuse_opt_add_arg(&args, "-oauto_unmount") == 0);
+#endif
+	snprintf(name, sizeof(name), "-omax_nodes=%d", MAX_NODES);
+	assert(fuse_opt_add_arg(&args, name) == 0);
+
+	f = fuse_new(&args, &tfs_oper, sizeof(tfs_oper), NULL);
+	assert(f != NULL);
+	assert(fuse_mount(f, opts.mountpoint) == 0);
+	se = fuse_get_session(f);
+	assert(pthread_create(&fs_thread, NULL, run_fs, f) == 0);
+
+	/* Every entry is looked up, so the budget is exceeded */
+	for (i = 0; i < NFILES; i++) {
+		snprintf(path, sizeof(path), "%s/f%d", opts.mountpoint, i);
+		if (stat(path, &st) == -1) {
+			perror(path);
+			return 1;
+		}
+	}
+	fuse_get_stats(f, &stats);
+	printf("after walk: %llu nodes\n", (unsigned long long) stats.nodes);
+	assert(stats.nodes > MAX_NODES);
+
+	/* Drop the dentries, so that the kernel forgets the inodes */
+	for (i = 0; i < NFILES; i++) {
+		snprintf(name, sizeof(name), "f%d", i);
+		assert(fuse_lowlevel_notify_inval_entry(se, FUSE_ROOT_ID, name,
+							strlen(name)) == 0);
+	}
+
+	for (i = 0; i < 100; i++) {
+		fuse_get_stats(f, &stats);
+		if (stats.nodes <= MAX_NODES)
+			break;
+		usleep(50000);
+	}
+	printf("after forget: %llu nodes, %llu evictions\n",
+	       (unsigned long long) stats.nodes,
+	       (unsigned long long) stats.evictions);
+	assert(stats.nodes <= MAX_NODES);
+	assert(stats.evictions > 0);
+
+	fuse_exit(f);
+	fuse_unmount(f);
+	pthread_join(fs_thread, NULL);
+	fuse_destroy(f);
+	free(opts.mountpoint);
+	fuse_opt_free_args(&args);
+
+	printf("Test completed successfully.\n");
+	return 0;
+}
@@ -0,0 +1,230 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv2.
+  See the file COPYING.
+*/
+
+/*
+ * Checks that a directory listing cached by the high-level library
+ * (-o readdir_cache) doesn't hand out stale attributes in READDIRPLUS
+ * replies after a file was changed through the filesystem.
+ *
+ * The filesystem mirrors <srcdir>, and readdir passes the attributes
+ * of all entries with FUSE_FILL_DIR_PLUS.  The kernel's copy of the
+ * directory is dropped with fuse_lowlevel_notify_inval_inode(), so
+ * that listing it again sends a READDIRPLUS request, whose attributes
+ * the kernel then uses for stat().
+ *
+ * Usage: test_readdir_cache <srcdir> <mountpoint>
+ */
+
+#define FUSE_USE_VERSION FUSE_MAKE_VERSION(3, 17)
+
+#define _GNU_SOURCE
+
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+static const char *src_dir;
+
+static void src_path(char *buf, size_t size, const char *path)
+{
+	snprintf(buf, size, "%s%s", src_dir, path);
+}
+
+static void *tfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+	/* Always use READDIRPLUS */
+	conn->want &= ~FUSE_CAP_READDIRPLUS_AUTO;
+
+	cfg->readdir_cache = 1;
+	cfg->attr_timeout = 60;
+	cfg->entry_timeout = 60;
+	return NULL;
+}
+
+static int tfs_getattr(const char *path, struct stat *stbuf,
+		       struct fuse_file_info *fi)
+{
+	char buf[4096];
+
+	(void) fi;
+	src_path(buf, sizeof(buf), path);
+	if (lstat(buf, stbuf) == -1)
+		return -errno;
+	return 0;
+}
+
+static int tfs_readdir(const char *path, void *dbuf, fuse_fill_dir_t filler,
+		       off_t offset, struct fuse_file_info *fi,
+		       enum fuse_readdir_flags flags)
+{
+	char buf[4096];
+	struct dirent *de;
+	struct stat st;
+	DIR *dp;
+
+	(void) offset;
+	(void) fi;
+	(void) flags;
+	src_path(buf, sizeof(buf), path);
+	dp = opendir(buf);
+	if (dp == NULL)
+		return -errno;
+	while ((de = readdir(dp)) != NULL) {
+		if (fstatat(dirfd(dp), de->d_name, &st,
+			    AT_SYMLINK_NOFOLLOW) == -1)
+			continue;
+		if (filler(dbuf, de->d_name, &st, 0, FUSE_FILL_DIR_PLUS))
+			break;
+	}
+	closedir(dp);
+	return 0;
+}
+
+static int tfs_truncate(const char *path, off_t size,
+			struct fuse_file_info *fi)
+{
+	char buf[4096];
+	int res;
+
+	if (fi)
+		res = ftruncate(fi->fh, size);
+	else {
+		src_path(buf, sizeof(buf), path);
+		res = truncate(buf, size);
+	}
+	if (res == -1)
+		return -errno;
+	return 0;
+}
+
+static int tfs_chmod(const char *path, mode_t mode,
+		     struct fuse_file_info *fi)
+{
+	char buf[4096];
+
+	(void) fi;
+	src_path(buf, sizeof(buf), path);
+	if (chmod(buf, mode) == -1)
+		return -errno;
+	return 0;
+}
+
+static const struct fuse_operations tfs_oper = {
+	.init		= tfs_init,
+	.getattr	= tfs_getattr,
+	.readdir	= tfs_readdir,
+	.truncate	= tfs_truncate,
+	.chmod		= tfs_chmod,
+};
+
+static void *run_fs(void *data)
+{
+	struct fuse *f = data;
+
+	fuse_loop(f);
+	return NULL;
+}
+
+static void list_dir(struct fuse_session *se, const char *mnt)
+{
+	struct dirent *de;
+	DIR *dp;
+
+	/* Drop the kernel's copy of the listing */
+	assert(fuse_lowlevel_notify_inval_inode(se, FUSE_ROOT_ID, 0, 0) == 0);
+	dp = opendir(mnt);
+	assert(dp != NULL);
+	while ((de = readdir(dp)) != NULL);
+	closedir(dp);
+}
+
+static struct stat check_stat(const char *mnt, const char *name)
+{
+	char path[4096];
+	struct stat st;
+
+	snprintf(path, sizeof(path), "%s/%s", mnt, name);
+	if (stat(path, &st) == -1) {
+		perror(path);
+		exit(1);
+	}
+	return st;
+}
+
+static void test_fs(struct fuse_session *se, const char *mnt)
+{
+	char path[4096];
+	struct stat st;
+	int fd;
+
+	/* Notifications need an initialized connection */
+	assert(stat(mnt, &st) == 0);
+
+	src_path(path, sizeof(path), "/f");
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	assert(fd != -1);
+	assert(write(fd, "0123456789", 10) == 10);
+	close(fd);
+
+	/* Builds the cached listing */
+	list_dir(se, mnt);
+	assert(check_stat(mnt, "f").st_size == 10);
+
+	snprintf(path, sizeof(path), "%s/f", mnt);
+	assert(truncate(path, 5000) == 0);
+	list_dir(se, mnt);
+	assert(check_stat(mnt, "f").st_size == 5000);
+
+	assert(chmod(path, 0600) == 0);
+	list_dir(se, mnt);
+	assert((check_stat(mnt, "f").st_mode & 07777) == 0600);
+
+	src_path(path, sizeof(path), "/f");
+	assert(unlink(path) == 0);
+}
+
+int main(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+	const char *mnt;
+	pthread_t fs_thread;
+	struct fuse *f;
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s <srcdir> <mountpoint>\n", argv[0]);
+		return 1;
+	}
+	src_dir = argv[1];
+	mnt = argv[2];
+
+	assert(fuse_opt_add_arg(&args, argv[0]) == 0);
+#ifndef __FreeBSD__
+	assert(fuse_opt_add_arg(&args, "-oauto_unmount") == 0);
+#endif
+	f = fuse_new(&args, &tfs_oper, sizeof(tfs_oper), NULL);
+	assert(f != NULL);
+	assert(fuse_mount(f, mnt) == 0);
+	assert(pthread_create(&fs_thread, NULL, run_fs, f) == 0);
+
+	test_fs(fuse_get_session(f), mnt);
+
+	fuse_exit(f);
+	fuse_unmount(f);
+	pthread_join(fs_thread, NULL);
+	fuse_destroy(f);
+	fuse_opt_free_args(&args);
+
+	printf("Test completed successfully.\n");
+	return 0;
+}